@@ -0,0 +1,561 @@
+//Command bench puts an unfs2go server (or any NFSv3 server) under load,
+//speaking MOUNT and NFSv3 itself over TCP or UDP, with no kernel client in
+//the way. It sets up what the chosen mix of workloads needs in a directory
+//of its own, runs the mix over several connections for a while, reports
+//calls a second and latency percentiles for each procedure, and cleans up.
+//
+//	go build -o unfs2go-bench ./bench
+//	unfs2go-bench -conns 8 -time 30s -mix getattr=60,lookup=30,readdir=10
+//
+//With -replay, it makes the calls recorded in a capture instead, at their
+//original pace or -speed times it, and compares how long they take with
+//how long they took then:
+//
+//	unfs2go -o capture=prod.cap -os /srv    (on the server with the problem)
+//	unfs2go-bench -replay prod.cap -speed 4  (against a copy of /srv)
+//
+//It exits 1 if any call failed, so it can gate CI runs too.
+package main
+
+import (
+	"errors"
+	"flag"
+	"fmt"
+	"math/rand"
+	"net"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+var (
+	server  = flag.String("server", "127.0.0.1", "server `host[:port]`, MOUNT and NFS both on the port (2049 if none)")
+	proto   = flag.String("proto", "tcp", "tcp or udp")
+	export  = flag.String("path", "/", "exported path to mount")
+	conns   = flag.Int("conns", 4, "concurrent connections, each making one call at a time")
+	runFor  = flag.Duration("time", 10*time.Second, "how long to run the mix")
+	mixFlag = flag.String("mix", "getattr", "workloads as `name[=weight],...`: "+strings.Join(workloadNames(), ", "))
+	ioSize  = flag.Int("io", 65536, "bytes per READ and WRITE (at most 32768 over UDP)")
+	sizeMiB = flag.Int("size", 64, "MiB in the file read, and in each connection's file written")
+	files   = flag.Int("files", 10000, "entries in the directory READDIR lists")
+	depth   = flag.Int("depth", 3, "levels of the directory tree LOOKUP walks")
+	fanout  = flag.Int("fanout", 8, "subdirectories of each directory in that tree")
+	seed    = flag.Int64("seed", 1, "seed for the random choices, so runs can be repeated")
+	keep    = flag.Bool("keep", false, "leave what was set up in place")
+	capFile = flag.String("replay", "", "replay the calls in capture `file` (from unfs2go -o capture=) instead of running a mix")
+	speed   = flag.Float64("speed", 1, "pace of a replay, relative to the capture's; 0 for as fast as replies come")
+)
+
+//workloads each make one randomly chosen call, or a few that go together.
+var workloads = map[string]func(w *worker) error{
+	"getattr":   (*worker).getattr,
+	"lookup":    (*worker).lookup,
+	"readdir":   (*worker).readdir,
+	"read":      (*worker).seqRead,
+	"randread":  (*worker).randRead,
+	"write":     (*worker).seqWrite,
+	"randwrite": (*worker).randWrite,
+	"churn":     (*worker).churn,
+}
+
+func workloadNames() []string {
+	var names []string
+	for name := range workloads {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	return names
+}
+
+type weighted struct {
+	name   string
+	weight int
+}
+
+func parseMix(s string) ([]weighted, error) {
+	var mix []weighted
+	for _, part := range strings.Split(s, ",") {
+		kv := strings.SplitN(part, "=", 2)
+		if _, ok := workloads[kv[0]]; !ok {
+			return nil, errors.New("Not a workload: " + kv[0])
+		}
+		w := weighted{kv[0], 1}
+		if len(kv) == 2 {
+			n, err := strconv.Atoi(kv[1])
+			if err != nil || n <= 0 {
+				return nil, errors.New("Weight of " + kv[0] + " must be a positive number: " + kv[1])
+			}
+			w.weight = n
+		}
+		mix = append(mix, w)
+	}
+	return mix, nil
+}
+
+func main() {
+	flag.Parse()
+	mix, err := parseMix(*mixFlag)
+	if err == nil && *proto != "tcp" && *proto != "udp" {
+		err = errors.New("Protocol must be tcp or udp: " + *proto)
+	}
+	if err == nil && (*conns < 1 || *ioSize < 1 || *sizeMiB < 1 || *files < 1 || *depth < 1 || *fanout < 1) {
+		err = errors.New("Counts and sizes must be at least 1")
+	}
+	if err == nil && *speed < 0 {
+		err = errors.New("Speed can't be negative")
+	}
+	if err != nil {
+		fmt.Println("Error:", err)
+		os.Exit(2)
+	}
+	if *proto == "udp" && *ioSize > 32768 {
+		*ioSize = 32768
+	}
+	addr := *server
+	if _, _, err := net.SplitHostPort(addr); err != nil {
+		addr = net.JoinHostPort(addr, "2049")
+	}
+	if *capFile != "" {
+		if replay(*capFile, addr, *speed) {
+			os.Exit(1)
+		}
+		return
+	}
+
+	ws := make([]*worker, *conns)
+	for i := range ws {
+		c, err := dial(*proto, addr)
+		if err != nil {
+			fmt.Println("Error connecting:", err)
+			os.Exit(2)
+		}
+		ws[i] = &worker{conn: c, id: i, rng: rand.New(rand.NewSource(*seed + int64(i))),
+			stats: make(map[string]*opStats), buf: make([]byte, *ioSize)}
+		ws[i].rng.Read(ws[i].buf)
+	}
+
+	start := time.Now()
+	f, err := setUp(ws, mix)
+	if err != nil {
+		fmt.Println("Error setting up:", err)
+		if f != nil && !*keep {
+			f.tearDown(ws[0].conn)
+		}
+		os.Exit(2)
+	}
+	fmt.Printf("Set up in %v; running %s over %d %s connections to %s for %v\n",
+		time.Since(start).Round(time.Millisecond), *mixFlag, *conns, *proto, addr, *runFor)
+
+	total := 0
+	for _, m := range mix {
+		total += m.weight
+	}
+	var wg sync.WaitGroup
+	deadline := time.Now().Add(*runFor)
+	start = time.Now()
+	for _, w := range ws {
+		wg.Add(1)
+		go func(w *worker) {
+			defer wg.Done()
+			w.fixture = f
+			for time.Now().Before(deadline) {
+				pick := w.rng.Intn(total)
+				i := 0
+				for pick >= mix[i].weight {
+					pick -= mix[i].weight
+					i++
+				}
+				if err := workloads[mix[i].name](w); err != nil {
+					if _, ok := err.(nfsError); !ok {
+						w.broken = err
+						return
+					}
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	failed := report(ws, elapsed)
+	for _, w := range ws {
+		if w.broken != nil {
+			fmt.Printf("Connection %d gave up: %v\n", w.id, w.broken)
+			failed = true
+		}
+	}
+	if !*keep {
+		if err := f.tearDown(ws[0].conn); err != nil {
+			fmt.Println("Error cleaning up:", err)
+			failed = true
+		}
+	}
+	if failed {
+		os.Exit(1)
+	}
+}
+
+//node is something set up, for looking up again and cleaning up.
+type node struct {
+	parent []byte
+	name   string
+	fh     []byte
+	dir    bool
+}
+
+//fixture is what the workloads work on, under a directory of the run's own.
+type fixture struct {
+	root    node
+	dirs    []node //the tree, but for its root
+	big     []byte //directory for READDIR
+	data    []byte //file for READ
+	size    uint64 //of that file, and of each written one
+	made    []node //in the order they were, to be removed in reverse
+	madeMux sync.Mutex
+}
+
+func (f *fixture) add(n node) {
+	f.madeMux.Lock()
+	f.made = append(f.made, n)
+	f.madeMux.Unlock()
+}
+
+//setUp makes what the mix needs, spreading the calls over every connection.
+func setUp(ws []*worker, mix []weighted) (*fixture, error) {
+	c := ws[0].conn
+	top, err := c.mount(*export)
+	if err != nil {
+		return nil, fmt.Errorf("mounting %s: %v", *export, err)
+	}
+	f := &fixture{size: uint64(*sizeMiB) << 20}
+	name := fmt.Sprintf("unfs2go-bench.%d", os.Getpid())
+	fh, err := c.mkdir(top, name)
+	if err != nil {
+		return nil, err
+	}
+	f.root = node{top, name, fh, true}
+	uses := make(map[string]bool)
+	for _, m := range mix {
+		uses[m.name] = true
+	}
+
+	if uses["getattr"] || uses["lookup"] {
+		level, fan := []node{f.root}, *fanout
+		for d := 0; d < *depth; d++ {
+			next := make([]node, len(level)*fan)
+			err := spread(ws, len(next), func(c *conn, i int) error {
+				parent := level[i/fan].fh
+				name := "d" + strconv.Itoa(i%fan)
+				fh, err := c.mkdir(parent, name)
+				if err == nil {
+					next[i] = node{parent, name, fh, true}
+					f.add(next[i])
+				}
+				return err
+			})
+			if err != nil {
+				return f, err
+			}
+			f.dirs = append(f.dirs, next...)
+			level = next
+		}
+	}
+	if uses["readdir"] {
+		if f.big, err = c.mkdir(f.root.fh, "big"); err != nil {
+			return f, err
+		}
+		f.add(node{f.root.fh, "big", f.big, true})
+		err := spread(ws, *files, func(c *conn, i int) error {
+			name := "f" + strconv.Itoa(i)
+			fh, err := c.create(f.big, name)
+			if err == nil {
+				f.add(node{f.big, name, fh, false})
+			}
+			return err
+		})
+		if err != nil {
+			return f, err
+		}
+	}
+	if uses["read"] || uses["randread"] {
+		if f.data, err = c.create(f.root.fh, "data"); err != nil {
+			return f, err
+		}
+		f.add(node{f.root.fh, "data", f.data, false})
+		chunks := int((f.size + uint64(*ioSize) - 1) / uint64(*ioSize))
+		err := spread(ws, chunks, func(c *conn, i int) error {
+			w := ws[i%len(ws)]
+			w.rng.Read(w.buf)
+			_, err := c.write(f.data, uint64(i)*uint64(*ioSize), w.buf[:min(uint64(*ioSize), f.size-uint64(i)*uint64(*ioSize))], unstable)
+			return err
+		})
+		if err == nil {
+			err = c.commit(f.data)
+		}
+		if err != nil {
+			return f, err
+		}
+	}
+	if uses["write"] || uses["randwrite"] {
+		err := spread(ws, len(ws), func(c *conn, i int) error {
+			name := "w" + strconv.Itoa(i)
+			fh, err := c.create(f.root.fh, name)
+			if err == nil {
+				ws[i].own = fh
+				f.add(node{f.root.fh, name, fh, false})
+			}
+			return err
+		})
+		if err != nil {
+			return f, err
+		}
+	}
+	return f, nil
+}
+
+//spread calls fn for 0 to n-1, each connection taking its share in turn.
+func spread(ws []*worker, n int, fn func(c *conn, i int) error) error {
+	errs := make(chan error, len(ws))
+	for k, w := range ws {
+		go func(k int, c *conn) {
+			for i := k; i < n; i += len(ws) {
+				if err := fn(c, i); err != nil {
+					errs <- err
+					return
+				}
+			}
+			errs <- nil
+		}(k, w.conn)
+	}
+	var first error
+	for range ws {
+		if err := <-errs; err != nil && first == nil {
+			first = err
+		}
+	}
+	return first
+}
+
+func (f *fixture) tearDown(c *conn) error {
+	var first error
+	for i := len(f.made) - 1; i >= 0; i-- {
+		n := f.made[i]
+		var err error
+		if n.dir {
+			err = c.rmdir(n.parent, n.name)
+		} else {
+			err = c.remove(n.parent, n.name)
+		}
+		if err != nil && first == nil {
+			first = fmt.Errorf("removing %s: %v", n.name, err)
+		}
+	}
+	if f.root.fh != nil {
+		if err := c.rmdir(f.root.parent, f.root.name); err != nil && first == nil {
+			first = fmt.Errorf("removing %s: %v", f.root.name, err)
+		}
+	}
+	return first
+}
+
+//worker runs the mix over one connection, timing every call it makes.
+type worker struct {
+	*conn
+	*fixture
+	id     int
+	rng    *rand.Rand
+	stats  map[string]*opStats
+	buf    []byte //what it writes
+	own    []byte //the file it writes to
+	rOff   uint64 //where its sequential read and write are
+	wOff   uint64
+	churns int
+	broken error //why it stopped, if the connection failed
+}
+
+type opStats struct {
+	lat    []time.Duration
+	errors int
+	bytes  int64
+	first  error
+}
+
+//record notes a call to proc that began at start and moved n bytes.
+func (w *worker) record(proc string, start time.Time, n int, err error) error {
+	d := time.Since(start)
+	s := w.stats[proc]
+	if s == nil {
+		s = new(opStats)
+		w.stats[proc] = s
+	}
+	s.lat = append(s.lat, d)
+	s.bytes += int64(n)
+	if err != nil {
+		s.errors++
+		if s.first == nil {
+			s.first = err
+		}
+	}
+	return err
+}
+
+func (w *worker) getattr() error {
+	fh := w.dirs[w.rng.Intn(len(w.dirs))].fh
+	start := time.Now()
+	return w.record("GETATTR", start, 0, w.conn.getattr(fh))
+}
+
+func (w *worker) lookup() error {
+	n := w.dirs[w.rng.Intn(len(w.dirs))]
+	start := time.Now()
+	_, err := w.conn.lookup(n.parent, n.name)
+	return w.record("LOOKUP", start, 0, err)
+}
+
+//readdir lists the whole of the big directory.
+func (w *worker) readdir() error {
+	cookie, verf := uint64(0), [8]byte{}
+	for {
+		start := time.Now()
+		_, next, nextVerf, eof, err := w.conn.readdir(w.big, cookie, verf)
+		if err := w.record("READDIR", start, 0, err); err != nil || eof {
+			return err
+		}
+		cookie, verf = next, nextVerf
+	}
+}
+
+func (w *worker) readAt(off uint64) error {
+	start := time.Now()
+	n, _, err := w.conn.read(w.data, off, uint32(*ioSize))
+	return w.record("READ", start, n, err)
+}
+
+func (w *worker) seqRead() error {
+	if w.rOff >= w.size {
+		w.rOff = 0
+	}
+	off := w.rOff
+	w.rOff += uint64(*ioSize)
+	return w.readAt(off)
+}
+
+func (w *worker) randRead() error {
+	return w.readAt(w.randOffset())
+}
+
+func (w *worker) randOffset() uint64 {
+	return uint64(w.rng.Int63n(int64((w.size+uint64(*ioSize)-1)/uint64(*ioSize)))) * uint64(*ioSize)
+}
+
+//writeAt writes UNSTABLE, as clients do, and COMMITs whenever the
+//sequential writer wraps around.
+func (w *worker) writeAt(off uint64) error {
+	start := time.Now()
+	n, err := w.conn.write(w.own, off, w.buf, unstable)
+	return w.record("WRITE", start, n, err)
+}
+
+func (w *worker) seqWrite() error {
+	if w.wOff >= w.size {
+		w.wOff = 0
+		start := time.Now()
+		if err := w.record("COMMIT", start, 0, w.conn.commit(w.own)); err != nil {
+			return err
+		}
+	}
+	off := w.wOff
+	w.wOff += uint64(*ioSize)
+	return w.writeAt(off)
+}
+
+func (w *worker) randWrite() error {
+	return w.writeAt(w.randOffset())
+}
+
+//churn creates a file and removes it again.
+func (w *worker) churn() error {
+	name := "c" + strconv.Itoa(w.id) + "." + strconv.Itoa(w.churns)
+	w.churns++
+	start := time.Now()
+	_, err := w.conn.create(w.root.fh, name)
+	if err := w.record("CREATE", start, 0, err); err != nil {
+		return err
+	}
+	start = time.Now()
+	return w.record("REMOVE", start, 0, w.conn.remove(w.root.fh, name))
+}
+
+//report prints what every worker counted, per procedure, and whether any
+//call failed.
+func report(ws []*worker, elapsed time.Duration) bool {
+	merged := make(map[string]*opStats)
+	var procs []string
+	for _, w := range ws {
+		for proc, s := range w.stats {
+			m := merged[proc]
+			if m == nil {
+				m = new(opStats)
+				merged[proc] = m
+				procs = append(procs, proc)
+			}
+			m.lat = append(m.lat, s.lat...)
+			m.errors += s.errors
+			m.bytes += s.bytes
+			if m.first == nil {
+				m.first = s.first
+			}
+		}
+	}
+	sort.Strings(procs)
+	fmt.Printf("%-8s %9s %7s %10s %8s %9s %9s %9s %9s %9s\n",
+		"proc", "calls", "errors", "calls/s", "MiB/s", "p50", "p90", "p99", "p99.9", "max")
+	failed := false
+	calls := 0
+	for _, proc := range procs {
+		s := merged[proc]
+		sort.Slice(s.lat, func(i, j int) bool { return s.lat[i] < s.lat[j] })
+		secs := elapsed.Seconds()
+		mib := "-"
+		if s.bytes > 0 {
+			mib = strconv.FormatFloat(float64(s.bytes)/secs/(1<<20), 'f', 1, 64)
+		}
+		fmt.Printf("%-8s %9d %7d %10.1f %8s %9v %9v %9v %9v %9v\n",
+			proc, len(s.lat), s.errors, float64(len(s.lat))/secs, mib,
+			percentile(s.lat, 0.5), percentile(s.lat, 0.9), percentile(s.lat, 0.99),
+			percentile(s.lat, 0.999), percentile(s.lat, 1))
+		calls += len(s.lat)
+		if s.errors > 0 {
+			fmt.Printf("  first %s error: %v\n", proc, s.first)
+			failed = true
+		}
+	}
+	fmt.Printf("%d calls in %v, %.1f a second\n", calls, elapsed.Round(time.Millisecond),
+		float64(calls)/elapsed.Seconds())
+	return failed
+}
+
+//percentile of sorted latencies, rounded for printing.
+func percentile(sorted []time.Duration, q float64) time.Duration {
+	if len(sorted) == 0 {
+		return 0
+	}
+	d := sorted[int(q*float64(len(sorted)-1))]
+	switch {
+	case d >= time.Millisecond:
+		return d.Round(10 * time.Microsecond)
+	case d >= time.Microsecond:
+		return d.Round(100 * time.Nanosecond)
+	}
+	return d
+}
+
+func min(a, b uint64) uint64 {
+	if a < b {
+		return a
+	}
+	return b
+}
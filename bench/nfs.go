@@ -0,0 +1,272 @@
+package main
+
+import "strconv"
+
+const (
+	progNFS   = 100003
+	progMount = 100005
+	mountMnt  = 1
+)
+
+//The NFSv3 procedures there are workloads for, and those replay needs to
+//know about.
+const (
+	procGetattr = 1
+	procLookup  = 3
+	procRead    = 6
+	procWrite   = 7
+	procCreate  = 8
+	procMkdir   = 9
+	procRemove  = 12
+	procRmdir   = 13
+	procRename  = 14
+	procLink    = 15
+	procReaddir = 16
+	procCommit  = 21
+)
+
+//stable_how
+const (
+	unstable = 0
+	fileSync = 2
+)
+
+//fattr3 is always this long, and pre-op attributes are a part of it.
+const (
+	fattr3Size   = 84
+	wccAttrSize  = 24
+	readdirBytes = 8192 //READDIR count, which limits a reply's size
+)
+
+//nfsError is a status other than NFS3_OK (or MNT3_OK).
+type nfsError uint32
+
+var nfsErrorNames = map[nfsError]string{1: "PERM", 2: "NOENT", 5: "IO", 13: "ACCES", 17: "EXIST",
+	20: "NOTDIR", 21: "ISDIR", 22: "INVAL", 27: "FBIG", 28: "NOSPC", 63: "NAMETOOLONG",
+	66: "NOTEMPTY", 70: "STALE", 10001: "BADHANDLE", 10003: "BAD_COOKIE", 10004: "NOTSUPP",
+	10006: "SERVERFAULT"}
+
+func (e nfsError) Error() string {
+	if name, ok := nfsErrorNames[e]; ok {
+		return "NFS3ERR_" + name
+	}
+	return "NFS error " + strconv.Itoa(int(e))
+}
+
+//status reads a reply's status, returning it as an error if it isn't OK.
+func status(x *xdrIn) error {
+	s := x.u32()
+	if x.err != nil {
+		return x.err
+	}
+	if s != 0 {
+		return nfsError(s)
+	}
+	return nil
+}
+
+func (x *xdrIn) postOpAttr() {
+	if x.bool() {
+		x.skip(fattr3Size)
+	}
+}
+
+func (x *xdrIn) wccData() {
+	if x.bool() {
+		x.skip(wccAttrSize)
+	}
+	x.postOpAttr()
+}
+
+//sattr3 asks for nothing to be set but, for new files and directories, the
+//mode.
+func (x *xdrOut) sattr3(mode uint32) {
+	x.u32(1)
+	x.u32(mode)
+	x.u32(0) //uid
+	x.u32(0) //gid
+	x.u32(0) //size
+	x.u32(0) //atime, DONT_CHANGE
+	x.u32(0) //mtime
+}
+
+func clone(b []byte) []byte {
+	return append([]byte(nil), b...)
+}
+
+//mount returns the root file handle of path.
+func (c *conn) mount(path string) ([]byte, error) {
+	c.start(progMount, 3, mountMnt).str(path)
+	x, err := c.send()
+	if err != nil {
+		return nil, err
+	}
+	if err := status(x); err != nil {
+		return nil, err
+	}
+	fh := clone(x.opaque())
+	return fh, x.err
+}
+
+func (c *conn) getattr(fh []byte) error {
+	c.start(progNFS, 3, procGetattr).opaque(fh)
+	x, err := c.send()
+	if err != nil {
+		return err
+	}
+	return status(x)
+}
+
+func (c *conn) lookup(dir []byte, name string) ([]byte, error) {
+	a := c.start(progNFS, 3, procLookup)
+	a.opaque(dir)
+	a.str(name)
+	x, err := c.send()
+	if err != nil {
+		return nil, err
+	}
+	if err := status(x); err != nil {
+		return nil, err
+	}
+	fh := clone(x.opaque())
+	return fh, x.err
+}
+
+//read returns how much it read, and whether that reached the end.
+func (c *conn) read(fh []byte, off uint64, count uint32) (int, bool, error) {
+	a := c.start(progNFS, 3, procRead)
+	a.opaque(fh)
+	a.u64(off)
+	a.u32(count)
+	x, err := c.send()
+	if err != nil {
+		return 0, false, err
+	}
+	if err := status(x); err != nil {
+		return 0, false, err
+	}
+	x.postOpAttr()
+	x.u32() //count, which the data says again
+	eof := x.bool()
+	n := len(x.opaque())
+	return n, eof, x.err
+}
+
+func (c *conn) write(fh []byte, off uint64, data []byte, stable uint32) (int, error) {
+	a := c.start(progNFS, 3, procWrite)
+	a.opaque(fh)
+	a.u64(off)
+	a.u32(uint32(len(data)))
+	a.u32(stable)
+	a.opaque(data)
+	x, err := c.send()
+	if err != nil {
+		return 0, err
+	}
+	if err := status(x); err != nil {
+		return 0, err
+	}
+	x.wccData()
+	n := int(x.u32())
+	return n, x.err
+}
+
+func (c *conn) commit(fh []byte) error {
+	a := c.start(progNFS, 3, procCommit)
+	a.opaque(fh)
+	a.u64(0)
+	a.u32(0)
+	x, err := c.send()
+	if err != nil {
+		return err
+	}
+	return status(x)
+}
+
+//create makes an empty file, or truncates one that's there.
+func (c *conn) create(dir []byte, name string) ([]byte, error) {
+	a := c.start(progNFS, 3, procCreate)
+	a.opaque(dir)
+	a.str(name)
+	a.u32(0) //UNCHECKED
+	a.sattr3(0644)
+	return c.made(dir, name)
+}
+
+func (c *conn) mkdir(dir []byte, name string) ([]byte, error) {
+	a := c.start(progNFS, 3, procMkdir)
+	a.opaque(dir)
+	a.str(name)
+	a.sattr3(0755)
+	return c.made(dir, name)
+}
+
+//made reads the reply to a CREATE or MKDIR, looking the new name up if
+//the server didn't say what its handle is.
+func (c *conn) made(dir []byte, name string) ([]byte, error) {
+	x, err := c.send()
+	if err != nil {
+		return nil, err
+	}
+	if err := status(x); err != nil {
+		return nil, err
+	}
+	if x.bool() {
+		fh := clone(x.opaque())
+		return fh, x.err
+	}
+	if x.err != nil {
+		return nil, x.err
+	}
+	return c.lookup(dir, name)
+}
+
+func (c *conn) remove(dir []byte, name string) error {
+	return c.unlink(procRemove, dir, name)
+}
+
+func (c *conn) rmdir(dir []byte, name string) error {
+	return c.unlink(procRmdir, dir, name)
+}
+
+func (c *conn) unlink(proc uint32, dir []byte, name string) error {
+	a := c.start(progNFS, 3, proc)
+	a.opaque(dir)
+	a.str(name)
+	x, err := c.send()
+	if err != nil {
+		return err
+	}
+	return status(x)
+}
+
+//readdir reads the entries after cookie, returning how many there were,
+//the cookie and verifier to go on from, and whether that was all of them.
+func (c *conn) readdir(dir []byte, cookie uint64, verf [8]byte) (int, uint64, [8]byte, bool, error) {
+	a := c.start(progNFS, 3, procReaddir)
+	a.opaque(dir)
+	a.u64(cookie)
+	*a = append(*a, verf[:]...)
+	a.u32(readdirBytes)
+	x, err := c.send()
+	if err != nil {
+		return 0, 0, verf, false, err
+	}
+	if err := status(x); err != nil {
+		return 0, 0, verf, false, err
+	}
+	x.postOpAttr()
+	if len(x.b) >= 8 {
+		copy(verf[:], x.b)
+	}
+	x.skip(8)
+	n := 0
+	for x.bool() {
+		x.u64() //fileid
+		x.opaque()
+		cookie = x.u64()
+		n++
+	}
+	eof := x.bool()
+	return n, cookie, verf, eof, x.err
+}
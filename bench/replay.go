@@ -0,0 +1,388 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+//What unfs2go -o capture= writes: see unfs3/capture.c.
+const (
+	captureMagic = "unfscap1"
+	captureCall  = 1
+	captureMap   = 2
+	captureUDP   = 1 //call flag
+)
+
+var nfsProcNames = [...]string{"null", "getattr", "setattr", "lookup", "access", "readlink",
+	"read", "write", "create", "mkdir", "symlink", "mknod", "remove", "rmdir", "rename",
+	"link", "readdir", "readdirplus", "fsstat", "fsinfo", "pathconf", "commit"}
+
+var mountProcNames = [...]string{"null", "mnt", "dump", "umnt", "umntall", "export"}
+
+//capturedConn is a connection calls came over, as the server saw it: a
+//socket for TCP, a client port for UDP.
+type capturedConn struct {
+	id, flags uint32
+}
+
+type capturedCall struct {
+	offset time.Duration //from when capture began
+	took   time.Duration //on the server, from decoding to sending the reply
+	conn   capturedConn
+	prog   uint32
+	vers   uint32
+	proc   uint32
+	status int32 //-1 where the result has none
+	args   []byte
+	spots  []int    //offsets of the file handles in args
+	paths  []string //they were for, "" where the capture doesn't say
+}
+
+func (c *capturedCall) name() string {
+	switch {
+	case c.prog == progNFS && int(c.proc) < len(nfsProcNames):
+		return nfsProcNames[c.proc]
+	case c.prog == progMount && int(c.proc) < len(mountProcNames):
+		return "mount." + mountProcNames[c.proc]
+	}
+	return fmt.Sprintf("%d.%d", c.prog, c.proc)
+}
+
+//readCapture reads a capture's calls, in the order the server finished
+//them, working out what each handle in their arguments stood for at the
+//time. A capture cut short by the server dying ends at its last whole call.
+func readCapture(path string) ([]*capturedCall, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	r := bufio.NewReaderSize(f, 1<<20)
+	var header [16]byte
+	if _, err := io.ReadFull(r, header[:]); err != nil || string(header[:8]) != captureMagic {
+		return nil, errors.New(path + " is not an unfs2go capture")
+	}
+
+	handles := make(map[string]string)
+	var calls []*capturedCall
+	var word [48]byte
+	u32 := func(b []byte) uint32 { return binary.BigEndian.Uint32(b) }
+	for {
+		if _, err := io.ReadFull(r, word[:4]); err != nil {
+			return calls, nil
+		}
+		switch u32(word[:]) {
+		case captureMap:
+			fh, err := readCounted(r)
+			if err != nil {
+				return calls, nil
+			}
+			p, err := readCounted(r)
+			if err != nil {
+				return calls, nil
+			}
+			handles[string(fh)] = string(p)
+		case captureCall:
+			if _, err := io.ReadFull(r, word[4:44]); err != nil {
+				return calls, nil
+			}
+			c := &capturedCall{
+				offset: time.Duration(binary.BigEndian.Uint64(word[4:])),
+				took:   time.Duration(binary.BigEndian.Uint64(word[12:])),
+				conn:   capturedConn{u32(word[20:]), u32(word[24:])},
+				prog:   u32(word[28:]),
+				vers:   u32(word[32:]),
+				proc:   u32(word[36:]),
+				status: int32(u32(word[40:])),
+			}
+			c.args, err = readCounted(r)
+			if err != nil {
+				return calls, nil
+			}
+			c.spots = handleSpots(c)
+			for _, at := range c.spots {
+				c.paths = append(c.paths, handles[string(opaqueAt(c.args, at))])
+			}
+			calls = append(calls, c)
+		default:
+			return nil, fmt.Errorf("%s: record of unknown type after %d calls", path, len(calls))
+		}
+	}
+}
+
+func readCounted(r io.Reader) ([]byte, error) {
+	var n [4]byte
+	if _, err := io.ReadFull(r, n[:]); err != nil {
+		return nil, err
+	}
+	b := make([]byte, binary.BigEndian.Uint32(n[:]))
+	_, err := io.ReadFull(r, b)
+	return b, err
+}
+
+//opaqueAt returns the variable length data at offset at of args.
+func opaqueAt(args []byte, at int) []byte {
+	n := int(binary.BigEndian.Uint32(args[at:]))
+	return args[at+4 : at+4+n]
+}
+
+//skipOpaque returns the offset past the variable length data at at, or -1
+//if args end first.
+func skipOpaque(args []byte, at int) int {
+	if at < 0 || at+4 > len(args) {
+		return -1
+	}
+	next := at + 4 + (int(binary.BigEndian.Uint32(args[at:]))+3)&^3
+	if next > len(args) {
+		return -1
+	}
+	return next
+}
+
+//handleSpots finds the file handles in an NFSv3 call's arguments. All but
+//NULL start with one; RENAME has another after the first name, and LINK
+//right after the first.
+func handleSpots(c *capturedCall) []int {
+	if c.prog != progNFS || c.vers != 3 || c.proc == 0 {
+		return nil
+	}
+	next := skipOpaque(c.args, 0)
+	if next < 0 {
+		return nil
+	}
+	spots := []int{0}
+	switch c.proc {
+	case procRename:
+		next = skipOpaque(c.args, next)
+		fallthrough
+	case procLink:
+		if skipOpaque(c.args, next) > 0 {
+			spots = append(spots, next)
+		}
+	}
+	return spots
+}
+
+//resolver finds the handles paths have on the server replayed against,
+//with LOOKUPs from the root, remembering them.
+type resolver struct {
+	mu   sync.Mutex
+	root []byte
+	fhs  map[string][]byte
+}
+
+func (r *resolver) cached(path string) []byte {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	return r.fhs[path]
+}
+
+func (r *resolver) resolve(c *conn, path string) ([]byte, error) {
+	if path == "/" {
+		return r.root, nil
+	}
+	if fh := r.cached(path); fh != nil {
+		return fh, nil
+	}
+	i := strings.LastIndexByte(path, '/')
+	parent := path[:i]
+	if parent == "" {
+		parent = "/"
+	}
+	dir, err := r.resolve(c, parent)
+	if err != nil {
+		return nil, err
+	}
+	fh, err := c.lookup(dir, path[i+1:])
+	if err != nil {
+		return nil, err
+	}
+	r.mu.Lock()
+	r.fhs[path] = fh
+	r.mu.Unlock()
+	return fh, nil
+}
+
+//args returns call's arguments with the handles in them swapped for the
+//replay server's. Where that isn't possible, an empty handle, which no
+//server takes, goes instead, rather than the captured one, which the
+//replay server may well have given to some other file.
+func (r *resolver) args(c *conn, call *capturedCall) []byte {
+	if len(call.spots) == 0 {
+		return call.args
+	}
+	var out xdrOut
+	prev := 0
+	for i, at := range call.spots {
+		var fh []byte
+		if call.paths[i] != "" {
+			fh, _ = r.resolve(c, call.paths[i])
+		}
+		out = append(out, call.args[prev:at]...)
+		out.opaque(fh)
+		prev = skipOpaque(call.args, at)
+	}
+	return append(out, call.args[prev:]...)
+}
+
+//replayStats compares one procedure's calls with how they went when they
+//were captured.
+type replayStats struct {
+	captured, replayed []time.Duration
+	mismatches         int //calls whose status differed
+	errors             int //calls that got no reply, or a rejected one
+	first              error
+	firstMismatch      string
+}
+
+//replay makes the calls in a capture again, against the server at addr,
+//each connection over a connection of its own, at the pace they were made
+//times speed (or, for speed 0, as fast as the replies come), then compares
+//how long they took with how long the captured server took. Those times
+//were measured in the server, so the replayed ones, measured here, include
+//the network too. Handles are looked up outside the timing. Statuses are
+//compared too; they will differ where the files aren't as they were when
+//capture began, and where calls on different connections came so close
+//together that replaying them puts them the other way around.
+func replay(path, addr string, speed float64) bool {
+	calls, err := readCapture(path)
+	if err != nil {
+		fmt.Println("Error:", err)
+		os.Exit(2)
+	}
+	if len(calls) == 0 {
+		fmt.Println("Error:", path, "has no calls in it")
+		os.Exit(2)
+	}
+	byConn := make(map[capturedConn][]*capturedCall)
+	var order []capturedConn
+	for _, c := range calls {
+		if byConn[c.conn] == nil {
+			order = append(order, c.conn)
+		}
+		byConn[c.conn] = append(byConn[c.conn], c)
+	}
+	clients := make([]*conn, len(order))
+	for i, cc := range order {
+		proto := "tcp"
+		if cc.flags&captureUDP != 0 {
+			proto = "udp"
+		}
+		if clients[i], err = dial(proto, addr); err != nil {
+			fmt.Println("Error connecting:", err)
+			os.Exit(2)
+		}
+	}
+	root, err := clients[0].mount(*export)
+	if err != nil {
+		fmt.Println("Error mounting", *export+":", err)
+		os.Exit(2)
+	}
+	res := &resolver{root: root, fhs: make(map[string][]byte)}
+	base := calls[0].offset
+	span := calls[len(calls)-1].offset - base
+	fmt.Printf("Replaying %d calls over %d connections, captured over %v, at %vx to %s\n",
+		len(calls), len(order), span.Round(time.Millisecond), speed, addr)
+
+	stats := make([]map[string]*replayStats, len(order))
+	var wg sync.WaitGroup
+	start := time.Now()
+	for i, cc := range order {
+		stats[i] = make(map[string]*replayStats)
+		wg.Add(1)
+		go func(c *conn, mine []*capturedCall, stats map[string]*replayStats) {
+			defer wg.Done()
+			for _, call := range mine {
+				if speed > 0 {
+					due := time.Duration(float64(call.offset-base) / speed)
+					time.Sleep(time.Until(start.Add(due)))
+				}
+				//only now, when calls due before it on other
+				//connections have been made, may its paths exist
+				args := res.args(c, call)
+				s := stats[call.name()]
+				if s == nil {
+					s = new(replayStats)
+					stats[call.name()] = s
+				}
+				t := time.Now()
+				a := c.start(call.prog, call.vers, call.proc)
+				*a = append(*a, args...)
+				x, err := c.send()
+				took := time.Since(t)
+				if err != nil {
+					s.errors++
+					if s.first == nil {
+						s.first = err
+					}
+					continue
+				}
+				s.captured = append(s.captured, call.took)
+				s.replayed = append(s.replayed, took)
+				if got := int32(x.u32()); call.status >= 0 && got != call.status {
+					if s.mismatches == 0 {
+						s.firstMismatch = fmt.Sprintf("status %d, captured %d, on %q at %v",
+							got, call.status, call.paths, call.offset)
+					}
+					s.mismatches++
+				}
+			}
+		}(clients[i], byConn[cc], stats[i])
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	merged := make(map[string]*replayStats)
+	var procs []string
+	for _, st := range stats {
+		for proc, s := range st {
+			m := merged[proc]
+			if m == nil {
+				m = new(replayStats)
+				merged[proc] = m
+				procs = append(procs, proc)
+			}
+			m.captured = append(m.captured, s.captured...)
+			m.replayed = append(m.replayed, s.replayed...)
+			m.mismatches += s.mismatches
+			m.errors += s.errors
+			if m.first == nil {
+				m.first = s.first
+			}
+			if m.firstMismatch == "" {
+				m.firstMismatch = s.firstMismatch
+			}
+		}
+	}
+	sort.Strings(procs)
+	fmt.Printf("%-13s %8s %8s %6s  %9s %9s %9s  %9s %9s %9s\n", "proc", "calls", "mismatch", "errors",
+		"was p50", "p99", "max", "now p50", "p99", "max")
+	failed := false
+	for _, proc := range procs {
+		s := merged[proc]
+		for _, lat := range [][]time.Duration{s.captured, s.replayed} {
+			sort.Slice(lat, func(i, j int) bool { return lat[i] < lat[j] })
+		}
+		fmt.Printf("%-13s %8d %8d %6d  %9v %9v %9v  %9v %9v %9v\n", proc, len(s.replayed), s.mismatches, s.errors,
+			percentile(s.captured, 0.5), percentile(s.captured, 0.99), percentile(s.captured, 1),
+			percentile(s.replayed, 0.5), percentile(s.replayed, 0.99), percentile(s.replayed, 1))
+		if s.mismatches > 0 {
+			fmt.Printf("  first %s mismatch: %s\n", proc, s.firstMismatch)
+		}
+		if s.errors > 0 {
+			fmt.Printf("  first %s error: %v\n", proc, s.first)
+			failed = true
+		}
+	}
+	fmt.Printf("%d calls in %v (captured over %v)\n", len(calls), elapsed.Round(time.Millisecond),
+		span.Round(time.Millisecond))
+	return failed
+}
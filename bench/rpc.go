@@ -0,0 +1,223 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math/rand"
+	"net"
+	"os"
+	"time"
+)
+
+//xdrOut is a call being built, header and all.
+type xdrOut []byte
+
+func (x *xdrOut) u32(v uint32) {
+	*x = append(*x, byte(v>>24), byte(v>>16), byte(v>>8), byte(v))
+}
+
+func (x *xdrOut) u64(v uint64) {
+	x.u32(uint32(v >> 32))
+	x.u32(uint32(v))
+}
+
+func (x *xdrOut) opaque(b []byte) {
+	x.u32(uint32(len(b)))
+	*x = append(*x, b...)
+	for i := len(b); i%4 != 0; i++ {
+		*x = append(*x, 0)
+	}
+}
+
+func (x *xdrOut) str(s string) {
+	x.u32(uint32(len(s)))
+	*x = append(*x, s...)
+	for i := len(s); i%4 != 0; i++ {
+		*x = append(*x, 0)
+	}
+}
+
+//xdrIn reads a reply's results. Reading past their end sets err and gives
+//zeroes from then on, so callers only need to check err once they're done.
+type xdrIn struct {
+	b   []byte
+	err error
+}
+
+var errShort = errors.New("reply too short")
+
+func (x *xdrIn) u32() uint32 {
+	if len(x.b) < 4 {
+		x.err, x.b = errShort, nil
+		return 0
+	}
+	v := binary.BigEndian.Uint32(x.b)
+	x.b = x.b[4:]
+	return v
+}
+
+func (x *xdrIn) u64() uint64 {
+	return uint64(x.u32())<<32 | uint64(x.u32())
+}
+
+func (x *xdrIn) bool() bool {
+	return x.u32() != 0
+}
+
+func (x *xdrIn) skip(n int) {
+	if len(x.b) < n {
+		x.err, x.b = errShort, nil
+		return
+	}
+	x.b = x.b[n:]
+}
+
+//opaque returns variable length data, which is only good until the next
+//call on the connection it came from.
+func (x *xdrIn) opaque() []byte {
+	n := int(x.u32())
+	padded := (n + 3) &^ 3
+	if len(x.b) < padded {
+		x.err, x.b = errShort, nil
+		return nil
+	}
+	v := x.b[:n]
+	x.b = x.b[padded:]
+	return v
+}
+
+//conn is a client connection, over TCP or UDP, making one call at a time.
+type conn struct {
+	net.Conn
+	udp  bool
+	xid  uint32
+	cred []byte //AUTH_UNIX, encoded
+	out  xdrOut
+	in   []byte
+}
+
+const (
+	udpTimeout = time.Second
+	udpTries   = 5
+)
+
+func dial(proto, addr string) (*conn, error) {
+	nc, err := net.Dial(proto, addr)
+	if err != nil {
+		return nil, err
+	}
+	host, _ := os.Hostname()
+	var cred xdrOut
+	cred.u32(uint32(time.Now().Unix()))
+	cred.str(host)
+	cred.u32(uint32(os.Getuid()))
+	cred.u32(uint32(os.Getgid()))
+	cred.u32(0)
+	return &conn{Conn: nc, udp: proto == "udp", xid: rand.Uint32(), cred: cred,
+		in: make([]byte, 1<<16)}, nil
+}
+
+//start begins a call to proc, returning where its arguments go; send makes
+//the call.
+func (c *conn) start(prog, vers, proc uint32) *xdrOut {
+	c.xid++
+	x := c.out[:0]
+	if !c.udp {
+		x.u32(0) //record mark, filled in by send
+	}
+	x.u32(c.xid)
+	x.u32(0) //CALL
+	x.u32(2) //RPC version
+	x.u32(prog)
+	x.u32(vers)
+	x.u32(proc)
+	x.u32(1) //AUTH_UNIX
+	x.opaque(c.cred)
+	x.u32(0) //AUTH_NULL verifier
+	x.u32(0)
+	c.out = x
+	return &c.out
+}
+
+//send makes the call start began, returning the results of an accepted
+//reply. They are only good until the next call.
+func (c *conn) send() (*xdrIn, error) {
+	var reply []byte
+	var err error
+	if c.udp {
+		reply, err = c.exchangeUDP()
+	} else {
+		reply, err = c.exchangeTCP()
+	}
+	if err != nil {
+		return nil, err
+	}
+	x := &xdrIn{b: reply}
+	if xid := x.u32(); xid != c.xid {
+		return nil, fmt.Errorf("reply for xid %#x, expected %#x", xid, c.xid)
+	}
+	if x.u32() != 1 {
+		return nil, errors.New("not a reply")
+	}
+	if x.u32() != 0 {
+		return nil, errors.New("call denied")
+	}
+	x.u32() //verifier
+	x.opaque()
+	if stat := x.u32(); stat != 0 {
+		return nil, fmt.Errorf("call not accepted (%d)", stat)
+	}
+	return x, x.err
+}
+
+func (c *conn) exchangeTCP() ([]byte, error) {
+	binary.BigEndian.PutUint32(c.out, 0x80000000|uint32(len(c.out)-4))
+	if _, err := c.Write(c.out); err != nil {
+		return nil, err
+	}
+	n := 0
+	for last := false; !last; {
+		var mark [4]byte
+		if _, err := io.ReadFull(c, mark[:]); err != nil {
+			return nil, err
+		}
+		m := binary.BigEndian.Uint32(mark[:])
+		last = m&0x80000000 != 0
+		frag := int(m & 0x7fffffff)
+		if n+frag > len(c.in) {
+			grown := make([]byte, n+frag)
+			copy(grown, c.in[:n])
+			c.in = grown
+		}
+		if _, err := io.ReadFull(c, c.in[n:n+frag]); err != nil {
+			return nil, err
+		}
+		n += frag
+	}
+	return c.in[:n], nil
+}
+
+//exchangeUDP sends the call until a reply with its xid comes back.
+func (c *conn) exchangeUDP() ([]byte, error) {
+	for try := 0; try < udpTries; try++ {
+		if _, err := c.Write(c.out); err != nil {
+			return nil, err
+		}
+		c.SetReadDeadline(time.Now().Add(udpTimeout))
+		for {
+			n, err := c.Read(c.in)
+			if ne, ok := err.(net.Error); ok && ne.Timeout() {
+				break
+			}
+			if err != nil {
+				return nil, err
+			}
+			if n >= 4 && binary.BigEndian.Uint32(c.in) == c.xid {
+				return c.in[:n], nil
+			}
+		}
+	}
+	return nil, fmt.Errorf("no reply after %d tries", udpTries)
+}
@@ -0,0 +1,597 @@
+package main
+
+import (
+	"container/list"
+	"crypto/sha1"
+	"encoding/hex"
+	"fmt"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+//File data cache for -shim. Data read through the shim is kept on local
+//disk in cacheBlock-sized blocks, in one sparse file per remote file, so
+//repeat reads never leave the box. Clean blocks are only trusted while the
+//remote file's size and modtime match what they were fetched under.
+//
+//Writes are write-back: they land in the local file and are pushed to the
+//remote side by COMMIT, by a timer once they're writeBackAge old, before a
+//dirty file's blocks get evicted, or on shutdown.
+//
+//What's cached, and what's still dirty, is logged to an index in the same
+//directory (see cacheIndex), so a restart picks up where it left off.
+//
+//One lock covers everything, remote fetches included. The server only runs
+//one NFS call at a time anyway; the lock is for the timers.
+
+const cacheBlock = 128 * 1024
+
+const writeBackAge = 5 * time.Second
+
+//largest single write used when pushing dirty data out
+const writeBackChunk = 1024 * 1024
+
+type blockCache struct {
+	minfs.MinFS //the shim: metadata, and where misses and write-backs go
+	dir         string
+	budget      int64 //bytes of blocks to keep
+	used        int64
+	lock        *sync.Mutex
+	files       map[string]*cachedFile
+	lru         *list.List //of *cachedBlock, most recently used in front
+	index       *cacheIndex
+
+	hits, misses, evictions, writeBacks int64
+}
+
+type cachedFile struct {
+	path   string
+	local  string
+	size   int64 //remote size and modtime the clean blocks are valid for
+	mtime  time.Time
+	blocks map[int64]*list.Element
+	dirty  []byteRange //sorted, not overlapping or touching
+	since  time.Time   //when the oldest dirty data came in
+}
+
+type cachedBlock struct {
+	file *cachedFile
+	idx  int64
+}
+
+type byteRange struct {
+	off, end int64
+}
+
+//syncer is a backend capability: Sync pushes anything held back for path
+//down to where it's stored for good. COMMIT calls it.
+type syncer interface {
+	Sync(path string) error
+}
+
+//sizedInfo reports a size other than the one the remote side knows about,
+//for files with dirty data past the remote end.
+type sizedInfo struct {
+	os.FileInfo
+	size int64
+}
+
+func (s sizedInfo) Size() int64 { return s.size }
+
+func newBlockCache(dir string, budget int64, meta minfs.MinFS) (*blockCache, error) {
+	if err := os.MkdirAll(dir, 0700); err != nil {
+		return nil, err
+	}
+	bc := &blockCache{MinFS: meta,
+		dir:    dir,
+		budget: budget,
+		lock:   new(sync.Mutex),
+		files:  make(map[string]*cachedFile),
+		lru:    list.New()}
+
+	bc.lock.Lock()
+	index, err := loadIndex(bc)
+	if err != nil {
+		bc.lock.Unlock()
+		return nil, err
+	}
+	bc.index = index
+	bc.evict() //the budget may have shrunk since last time
+	bc.index.sync(bc)
+	bc.lock.Unlock()
+
+	go bc.run()
+	return bc, nil
+}
+
+func (bc *blockCache) localName(path string) string {
+	sum := sha1.Sum([]byte(path))
+	return filepath.Join(bc.dir, hex.EncodeToString(sum[:]))
+}
+
+//entry returns the cache entry for path, creating it if need be, after
+//checking its clean blocks against fi. Caller holds bc.lock.
+func (bc *blockCache) entry(path string, fi os.FileInfo) (*cachedFile, error) {
+	f, ok := bc.files[path]
+	if !ok {
+		f = &cachedFile{path: path,
+			local:  bc.localName(path),
+			size:   fi.Size(),
+			mtime:  fi.ModTime(),
+			blocks: make(map[int64]*list.Element)}
+		bc.files[path] = f
+		bc.index.logFile(f)
+		return f, nil
+	}
+	if f.size == fi.Size() && f.mtime.Equal(fi.ModTime()) {
+		return f, nil
+	}
+
+	//changed on the remote side: what we have dirty still wins, then start over
+	if err := bc.writeBack(f); err != nil {
+		return nil, err
+	}
+	bc.dropBlocks(f)
+	fresh, err := bc.MinFS.Stat(path)
+	if err != nil {
+		return nil, err
+	}
+	f.size, f.mtime = fresh.Size(), fresh.ModTime()
+	bc.index.logFile(f)
+	return f, nil
+}
+
+func (f *cachedFile) dirtyEnd() int64 {
+	if len(f.dirty) == 0 {
+		return 0
+	}
+	return f.dirty[len(f.dirty)-1].end
+}
+
+func (bc *blockCache) ReadFile(path string, b []byte, off int64) (int, error) {
+	fi, err := bc.MinFS.Stat(path)
+	if err != nil {
+		return 0, err
+	}
+
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	defer bc.index.sync(bc)
+	f, err := bc.entry(path, fi)
+	if err != nil {
+		return 0, err
+	}
+
+	size := f.size
+	if end := f.dirtyEnd(); end > size {
+		size = end
+	}
+	if off >= size {
+		return 0, io.EOF
+	}
+	n := len(b)
+	if int64(n) > size-off {
+		n = int(size - off)
+	}
+
+	//only what the remote side has needs fetching, the rest is all dirty data
+	if fetchEnd := off + int64(n); off < f.size {
+		if fetchEnd > f.size {
+			fetchEnd = f.size
+		}
+		if err := bc.fill(f, off/cacheBlock, (fetchEnd+cacheBlock-1)/cacheBlock); err != nil {
+			return 0, err
+		}
+	}
+
+	lf, err := os.Open(f.local)
+	if err != nil && !os.IsNotExist(err) {
+		return 0, err
+	}
+	got := 0
+	if lf != nil {
+		got, _ = lf.ReadAt(b[:n], off)
+		lf.Close()
+	}
+	for i := got; i < n; i++ { //a hole at the end reads as zeros
+		b[i] = 0
+	}
+	bc.evict() //not before the read, it could take what was just fetched
+	if n < len(b) {
+		return n, io.EOF
+	}
+	return n, nil
+}
+
+//fill makes blocks [first, last) present, fetching runs of missing ones
+//with one remote read each.
+func (bc *blockCache) fill(f *cachedFile, first, last int64) error {
+	for idx := first; idx < last; idx++ {
+		if el, ok := f.blocks[idx]; ok {
+			bc.lru.MoveToFront(el)
+			bc.hits++
+			continue
+		}
+		run := idx + 1
+		for run < last {
+			if _, ok := f.blocks[run]; ok {
+				break
+			}
+			run++
+		}
+		if err := bc.fetch(f, idx, run); err != nil {
+			return err
+		}
+		idx = run - 1
+	}
+	return nil
+}
+
+func (bc *blockCache) fetch(f *cachedFile, first, last int64) error {
+	start := first * cacheBlock
+	end := last * cacheBlock
+	if end > f.size {
+		end = f.size
+	}
+	buf := make([]byte, end-start)
+	n, err := bc.MinFS.ReadFile(f.path, buf, start)
+	if err != nil && !strings.Contains(strings.ToLower(err.Error()), "eof") {
+		return err
+	}
+	buf = buf[:n]
+
+	lf, err := os.OpenFile(f.local, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return err
+	}
+	defer lf.Close()
+
+	//dirty data in the local file is newer than what came back
+	pos := start
+	for _, d := range f.dirty {
+		if d.end <= pos {
+			continue
+		}
+		if d.off >= start+int64(n) {
+			break
+		}
+		if d.off > pos {
+			if _, err := lf.WriteAt(buf[pos-start:d.off-start], pos); err != nil {
+				return err
+			}
+		}
+		pos = d.end
+	}
+	if pos < start+int64(n) {
+		if _, err := lf.WriteAt(buf[pos-start:], pos); err != nil {
+			return err
+		}
+	}
+
+	for idx := first; idx < last && idx*cacheBlock < start+int64(n); idx++ {
+		bc.addBlock(f, idx)
+		bc.misses++
+	}
+	return nil
+}
+
+func (bc *blockCache) addBlock(f *cachedFile, idx int64) {
+	if el, ok := f.blocks[idx]; ok {
+		bc.lru.MoveToFront(el)
+		return
+	}
+	f.blocks[idx] = bc.lru.PushFront(&cachedBlock{f, idx})
+	bc.used += cacheBlock
+	bc.index.logBlock(f, idx)
+}
+
+//evict drops least recently used blocks until we're within budget. Dirty
+//data has to reach the remote side before its blocks can go.
+func (bc *blockCache) evict() {
+	for bc.used > bc.budget {
+		el := bc.lru.Back()
+		if el == nil {
+			return
+		}
+		cb := el.Value.(*cachedBlock)
+		if len(cb.file.dirty) > 0 {
+			if err := bc.writeBack(cb.file); err != nil {
+				lg.error("write-back to make room in the cache failed", "path", cb.file.path, "err", err)
+				bc.lru.MoveToFront(el)
+				return
+			}
+		}
+		punchHole(cb.file.local, cb.idx*cacheBlock, cacheBlock)
+		bc.lru.Remove(el)
+		delete(cb.file.blocks, cb.idx)
+		bc.used -= cacheBlock
+		bc.evictions++
+		bc.index.logEvict(cb.file, cb.idx)
+		if len(cb.file.blocks) == 0 {
+			os.Remove(cb.file.local)
+			delete(bc.files, cb.file.path)
+			bc.index.logForget(cb.file.path)
+		}
+	}
+}
+
+//punchHole gives a block's disk space back while keeping the file's size.
+func punchHole(local string, off, n int64) {
+	lf, err := os.OpenFile(local, os.O_RDWR, 0)
+	if err != nil {
+		return
+	}
+	syscall.Fallocate(int(lf.Fd()), 0x01|0x02, off, n) //FALLOC_FL_KEEP_SIZE|FALLOC_FL_PUNCH_HOLE
+	lf.Close()
+}
+
+//dropBlocks forgets every clean block of f and deletes its local file.
+//Caller makes sure f isn't dirty.
+func (bc *blockCache) dropBlocks(f *cachedFile) {
+	bc.unlinkBlocks(f)
+	os.Remove(f.local)
+}
+
+//unlinkBlocks takes f's blocks out of the LRU and the accounting.
+func (bc *blockCache) unlinkBlocks(f *cachedFile) {
+	for idx, el := range f.blocks {
+		bc.lru.Remove(el)
+		delete(f.blocks, idx)
+		bc.used -= cacheBlock
+	}
+}
+
+//forget drops everything for path, dirty data included.
+func (bc *blockCache) forget(path string) {
+	if f, ok := bc.files[path]; ok {
+		f.dirty = nil
+		bc.dropBlocks(f)
+		delete(bc.files, path)
+		bc.index.logForget(path)
+	}
+}
+
+func (bc *blockCache) WriteFile(path string, b []byte, off int64) (int, error) {
+	fi, err := bc.MinFS.Stat(path)
+	if err != nil {
+		return 0, err
+	}
+
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	defer bc.index.sync(bc)
+	f, err := bc.entry(path, fi)
+	if err != nil {
+		return 0, err
+	}
+
+	lf, err := os.OpenFile(f.local, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return 0, err
+	}
+	n, err := lf.WriteAt(b, off)
+	lf.Close()
+	if err != nil {
+		return n, err
+	}
+
+	if len(f.dirty) == 0 {
+		f.since = time.Now()
+	}
+	f.addDirty(off, off+int64(n))
+	bc.index.logDirty(f, off, off+int64(n))
+
+	//blocks written from end to end are now complete locally
+	for idx := (off + cacheBlock - 1) / cacheBlock; (idx+1)*cacheBlock <= off+int64(n); idx++ {
+		bc.addBlock(f, idx)
+	}
+	bc.evict()
+	return n, nil
+}
+
+func (f *cachedFile) addDirty(off, end int64) {
+	kept := make([]byteRange, 0, len(f.dirty)+1)
+	for _, d := range f.dirty {
+		if d.end < off || d.off > end {
+			kept = append(kept, d)
+			continue
+		}
+		if d.off < off {
+			off = d.off
+		}
+		if d.end > end {
+			end = d.end
+		}
+	}
+	i := 0
+	for i < len(kept) && kept[i].off < off {
+		i++
+	}
+	kept = append(kept, byteRange{})
+	copy(kept[i+1:], kept[i:])
+	kept[i] = byteRange{off, end}
+	f.dirty = kept
+}
+
+//writeBack pushes f's dirty data to the remote side, then takes the remote
+//file's new size and modtime as what the blocks are valid for.
+//Caller holds bc.lock.
+func (bc *blockCache) writeBack(f *cachedFile) error {
+	if len(f.dirty) == 0 {
+		return nil
+	}
+	lf, err := os.Open(f.local)
+	if err != nil {
+		return err
+	}
+	defer lf.Close()
+
+	buf := make([]byte, writeBackChunk)
+	for len(f.dirty) > 0 {
+		d := f.dirty[0]
+		for pos := d.off; pos < d.end; {
+			n := d.end - pos
+			if n > writeBackChunk {
+				n = writeBackChunk
+			}
+			got, err := lf.ReadAt(buf[:n], pos)
+			if err != nil && err != io.EOF {
+				return err
+			}
+			for i := got; i < int(n); i++ {
+				buf[i] = 0
+			}
+			if _, err := bc.MinFS.WriteFile(f.path, buf[:n], pos); err != nil &&
+				!strings.Contains(strings.ToLower(err.Error()), "eof") {
+				return err
+			}
+			pos += n
+			f.dirty[0].off = pos
+		}
+		f.dirty = f.dirty[1:]
+		bc.writeBacks++
+	}
+	f.dirty = nil
+
+	fi, err := bc.MinFS.Stat(f.path)
+	if err != nil {
+		return err
+	}
+	f.size, f.mtime = fi.Size(), fi.ModTime()
+	bc.index.logValid(f)
+	return nil
+}
+
+//writeBackUnder writes back path and anything under it.
+func (bc *blockCache) writeBackUnder(path string) error {
+	var werr error
+	for p, f := range bc.files {
+		if p == path || strings.HasPrefix(p, path+"/") || path == "/" {
+			if err := bc.writeBack(f); err != nil && werr == nil {
+				werr = err
+			}
+		}
+	}
+	return werr
+}
+
+func (bc *blockCache) forgetUnder(path string) {
+	for p := range bc.files {
+		if p == path || strings.HasPrefix(p, path+"/") {
+			bc.forget(p)
+		}
+	}
+}
+
+func (bc *blockCache) Sync(path string) error {
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	defer bc.index.sync(bc)
+	if f, ok := bc.files[path]; ok {
+		return bc.writeBack(f)
+	}
+	return nil
+}
+
+func (bc *blockCache) Stat(path string) (os.FileInfo, error) {
+	fi, err := bc.MinFS.Stat(path)
+	if err != nil {
+		return fi, err
+	}
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	if f, ok := bc.files[path]; ok && f.dirtyEnd() > fi.Size() {
+		return sizedInfo{fi, f.dirtyEnd()}, nil
+	}
+	return fi, nil
+}
+
+func (bc *blockCache) CreateFile(path string) error {
+	bc.lock.Lock()
+	bc.forget(path)
+	bc.index.sync(bc)
+	bc.lock.Unlock()
+	return bc.MinFS.CreateFile(path)
+}
+
+func (bc *blockCache) Remove(path string) error {
+	bc.lock.Lock()
+	bc.forget(path)
+	bc.index.sync(bc)
+	bc.lock.Unlock()
+	return bc.MinFS.Remove(path)
+}
+
+func (bc *blockCache) Move(oldpath, newpath string) error {
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	defer bc.index.sync(bc)
+	if err := bc.writeBackUnder(oldpath); err != nil {
+		return err
+	}
+	bc.forgetUnder(oldpath)
+	bc.forgetUnder(newpath)
+	return bc.MinFS.Move(oldpath, newpath)
+}
+
+func (bc *blockCache) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	if attribute == "size" {
+		bc.lock.Lock()
+		defer bc.lock.Unlock()
+		defer bc.index.sync(bc)
+		if f, ok := bc.files[path]; ok {
+			if err := bc.writeBack(f); err != nil {
+				return err
+			}
+			bc.forget(path)
+		}
+	}
+	return bc.MinFS.SetAttribute(path, attribute, newvalue)
+}
+
+func (bc *blockCache) Close() error {
+	bc.lock.Lock()
+	err := bc.writeBackUnder("/")
+	bc.index.close()
+	bc.lock.Unlock()
+	if err != nil {
+		lg.error("write-back on close failed", "err", err)
+	}
+	return bc.MinFS.Close()
+}
+
+//run is the timer side of write-back.
+func (bc *blockCache) run() {
+	tick := time.NewTicker(writeBackAge / 2)
+	for range tick.C {
+		bc.lock.Lock()
+		for _, f := range bc.files {
+			if len(f.dirty) > 0 && time.Since(f.since) >= writeBackAge {
+				if err := bc.writeBack(f); err != nil {
+					lg.error("write-back failed", "path", f.path, "err", err)
+				}
+			}
+		}
+		bc.index.sync(bc)
+		bc.lock.Unlock()
+	}
+}
+
+func (bc *blockCache) stats() string {
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	return fmt.Sprintf("Block cache: %d of %d bytes used, %d block hits, %d misses, %d evictions, %d ranges written back",
+		bc.used, bc.budget, bc.hits, bc.misses, bc.evictions, bc.writeBacks)
+}
+
+func (bc *blockCache) lookups() (hits, misses int64) {
+	bc.lock.Lock()
+	defer bc.lock.Unlock()
+	return bc.hits, bc.misses
+}
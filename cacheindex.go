@@ -0,0 +1,243 @@
+package main
+
+import (
+	"bufio"
+	"container/list"
+	"fmt"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+)
+
+//cacheIndex is the block cache's bookkeeping on disk, so a restart comes
+//back warm. It's an append-only log of one-line records, each ending with
+//the quoted remote path:
+//
+//	F size mtime path    start over: no blocks, nothing dirty, these validators
+//	V size mtime path    dirty data written back, these are the new validators
+//	B idx path           block present
+//	E idx path           block evicted
+//	D off end path       range written locally but not yet written back
+//	X path               entry gone
+//
+//Records are written after the data they describe, so a crash can only
+//lose knowledge of a block, never vouch for one that isn't there. Loaded
+//entries aren't checked against the remote side until they're next used.
+//The log is rewritten from the live state when it loads and whenever it
+//grows to several times that size.
+type cacheIndex struct {
+	path    string
+	file    *os.File
+	w       *bufio.Writer
+	records int //in the log
+	live    int //roughly how many it would take to describe the current state
+}
+
+const indexName = "index.log"
+
+//loadIndex replays the log in dir into bc, drops local files it doesn't
+//know about, and starts a fresh compacted log. Caller holds bc.lock.
+func loadIndex(bc *blockCache) (*cacheIndex, error) {
+	ix := &cacheIndex{path: filepath.Join(bc.dir, indexName)}
+
+	if lf, err := os.Open(ix.path); err == nil {
+		sc := bufio.NewScanner(lf)
+		sc.Buffer(make([]byte, 4096), 64*1024)
+		for sc.Scan() {
+			if !bc.replay(sc.Text()) {
+				break //torn last write, or junk; what came before still stands
+			}
+		}
+		lf.Close()
+	}
+
+	//anything not in the index is from a crash between data and record
+	known := map[string]bool{indexName: true}
+	for _, f := range bc.files {
+		known[filepath.Base(f.local)] = true
+	}
+	if ents, err := os.ReadDir(bc.dir); err == nil {
+		for _, e := range ents {
+			if !known[e.Name()] {
+				os.Remove(filepath.Join(bc.dir, e.Name()))
+			}
+		}
+	}
+
+	if err := ix.compact(bc); err != nil {
+		return nil, err
+	}
+	return ix, nil
+}
+
+//replay applies one log record to bc, reporting whether it made sense.
+func (bc *blockCache) replay(line string) bool {
+	parts := strings.SplitN(line, " ", 4)
+	var nums []int64
+	var path string
+	for i, p := range parts[1:] {
+		if strings.HasPrefix(p, "\"") {
+			q, err := strconv.Unquote(strings.Join(parts[1+i:], " "))
+			if err != nil {
+				return false
+			}
+			path = q
+			break
+		}
+		n, err := strconv.ParseInt(p, 10, 64)
+		if err != nil {
+			return false
+		}
+		nums = append(nums, n)
+	}
+	if path == "" {
+		return false
+	}
+
+	f, ok := bc.files[path]
+	switch {
+	case parts[0] == "F" && len(nums) == 2:
+		if ok {
+			bc.unlinkBlocks(f)
+		}
+		f = &cachedFile{path: path,
+			local:  bc.localName(path),
+			size:   nums[0],
+			mtime:  time.Unix(0, nums[1]),
+			blocks: make(map[int64]*list.Element)}
+		bc.files[path] = f
+	case !ok:
+		return parts[0] == "X" //every other record needs an F before it
+	case parts[0] == "V" && len(nums) == 2:
+		f.size, f.mtime = nums[0], time.Unix(0, nums[1])
+		f.dirty = nil
+	case parts[0] == "B" && len(nums) == 1:
+		bc.addBlock(f, nums[0])
+	case parts[0] == "E" && len(nums) == 1:
+		if el, ok := f.blocks[nums[0]]; ok {
+			bc.lru.Remove(el)
+			delete(f.blocks, nums[0])
+			bc.used -= cacheBlock
+		}
+	case parts[0] == "D" && len(nums) == 2:
+		if len(f.dirty) == 0 {
+			f.since = time.Now()
+		}
+		f.addDirty(nums[0], nums[1])
+	case parts[0] == "X" && len(nums) == 0:
+		bc.unlinkBlocks(f)
+		delete(bc.files, path)
+	default:
+		return false
+	}
+	return true
+}
+
+//log appends a record; live is how it changes the size of the state.
+func (ix *cacheIndex) log(live int, format string, args ...interface{}) {
+	if ix == nil || ix.w == nil {
+		return
+	}
+	fmt.Fprintf(ix.w, format, args...)
+	ix.records++
+	ix.live += live
+}
+
+func (ix *cacheIndex) logFile(f *cachedFile) {
+	ix.log(1, "F %d %d %q\n", f.size, f.mtime.UnixNano(), f.path)
+}
+
+func (ix *cacheIndex) logValid(f *cachedFile) {
+	ix.log(0, "V %d %d %q\n", f.size, f.mtime.UnixNano(), f.path)
+}
+
+func (ix *cacheIndex) logBlock(f *cachedFile, idx int64) {
+	ix.log(1, "B %d %q\n", idx, f.path)
+}
+
+func (ix *cacheIndex) logEvict(f *cachedFile, idx int64) {
+	ix.log(-1, "E %d %q\n", idx, f.path)
+}
+
+func (ix *cacheIndex) logDirty(f *cachedFile, off, end int64) {
+	ix.log(1, "D %d %d %q\n", off, end, f.path)
+}
+
+func (ix *cacheIndex) logForget(path string) {
+	ix.log(0, "X %q\n", path)
+}
+
+//sync pushes buffered records out to the file, compacting first if the log
+//has got much bigger than the state it describes. Caller holds bc.lock.
+func (ix *cacheIndex) sync(bc *blockCache) {
+	if ix == nil || ix.w == nil {
+		return
+	}
+	if ix.records > 4*ix.live+1024 {
+		err := ix.compact(bc)
+		if err == nil {
+			return
+		}
+		lg.error("compacting the block cache index failed", "path", ix.path, "err", err)
+	}
+	if err := ix.w.Flush(); err != nil {
+		lg.error("writing the block cache index failed", "path", ix.path, "err", err)
+	}
+}
+
+//compact writes the current state out as a new log and switches to it.
+func (ix *cacheIndex) compact(bc *blockCache) error {
+	tmp := ix.path + ".new"
+	nf, err := os.OpenFile(tmp, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+	old, oldw := ix.file, ix.w
+	records, live := ix.records, ix.live
+	ix.file, ix.w = nf, bufio.NewWriter(nf)
+	ix.records, ix.live = 0, 0
+
+	for _, f := range bc.files {
+		ix.logFile(f)
+	}
+	//oldest blocks first, so replaying rebuilds the same LRU order
+	for el := bc.lru.Back(); el != nil; el = el.Prev() {
+		cb := el.Value.(*cachedBlock)
+		ix.logBlock(cb.file, cb.idx)
+	}
+	for _, f := range bc.files {
+		for _, d := range f.dirty {
+			ix.logDirty(f, d.off, d.end)
+		}
+	}
+
+	err = ix.w.Flush()
+	if err == nil {
+		err = nf.Sync()
+	}
+	if err == nil {
+		err = os.Rename(tmp, ix.path)
+	}
+	if err != nil {
+		nf.Close()
+		os.Remove(tmp)
+		ix.file, ix.w = old, oldw
+		ix.records, ix.live = records, live
+		return err
+	}
+	if old != nil {
+		old.Close()
+	}
+	return nil
+}
+
+func (ix *cacheIndex) close() {
+	if ix == nil || ix.file == nil {
+		return
+	}
+	ix.w.Flush()
+	ix.file.Close()
+	ix.file, ix.w = nil, nil
+}
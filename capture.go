@@ -0,0 +1,97 @@
+package main
+
+//#include "unfs3/daemon.h"
+import "C"
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"os"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+//A capture file starts with captureMagic and the wall clock time, in ns
+//since 1970, that the offsets in its call records count from.
+const (
+	captureMagic = "unfscap1"
+	captureRing  = 64 << 20
+)
+
+//captureFile is where the records capture_call leaves in its ring go.
+type captureFile struct {
+	mu  sync.Mutex
+	f   *os.File
+	w   *bufio.Writer
+	buf []byte
+}
+
+var capture *captureFile
+
+//startCapture turns on recording of every call (see unfs3/capture.c) to
+//path, with a goroutine that writes the records out as they come.
+func startCapture(path string) error {
+	f, err := os.Create(path)
+	if err != nil {
+		return err
+	}
+	if C.capture_init(captureRing) == 0 {
+		f.Close()
+		return errors.New("Unable to allocate the capture buffer")
+	}
+	w := bufio.NewWriterSize(f, 1<<20)
+	var header [16]byte
+	copy(header[:], captureMagic)
+	binary.BigEndian.PutUint64(header[8:], uint64(time.Now().UnixNano()))
+	w.Write(header[:])
+	capture = &captureFile{f: f, w: w, buf: make([]byte, 1<<16)}
+	go func() {
+		dropped := C.uint64(0)
+		for range time.Tick(10 * time.Millisecond) {
+			if err := capture.drain(); err != nil {
+				lg.error("capture failed", "path", path, "err", err)
+				return
+			}
+			if d := C.capture_dropped(); d != dropped {
+				lg.warn("capture buffer full, calls not recorded", "count", d-dropped)
+				dropped = d
+			}
+		}
+	}()
+	return nil
+}
+
+//drain writes out what's in the ring, and flushes it.
+func (c *captureFile) drain() error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if c.f == nil {
+		return nil
+	}
+	for {
+		n := C.capture_take((*C.char)(unsafe.Pointer(&c.buf[0])), C.u_int(len(c.buf)))
+		if n == 0 {
+			break
+		}
+		if _, err := c.w.Write(c.buf[:n]); err != nil {
+			return err
+		}
+	}
+	return c.w.Flush()
+}
+
+//close writes out the last of the records, for shutDown.
+func (c *captureFile) close() error {
+	if c == nil {
+		return nil
+	}
+	err := c.drain()
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if cerr := c.f.Close(); err == nil {
+		err = cerr
+	}
+	c.f = nil
+	return err
+}
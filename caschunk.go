@@ -0,0 +1,235 @@
+package main
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync"
+	"sync/atomic"
+)
+
+//Content-defined chunking for -cas. A chunk ends wherever a rolling gear
+//hash of the last 64 bytes hits a pattern, between casMin and casMax bytes
+//in, so an edit only changes the chunks around it and the same content in
+//different files, or at different offsets, comes out as the same chunks.
+//Chunks are named by their SHA-256, which crypto/sha256 computes with the
+//CPU's SHA extensions or vector units where it has them.
+
+const (
+	casMin  = 4 * 1024
+	casMax  = 64 * 1024
+	casMask = (1<<14 - 1) << 50 //about 16KiB between boundaries
+
+	casBlock = 4 * 1024 * 1024 //read at a time while chunking
+)
+
+//gear is fixed, so chunk boundaries are the same from run to run.
+var gear [256]uint64
+
+func init() {
+	x := uint64(0x9e3779b97f4a7c15)
+	for i := range gear { //splitmix64
+		x += 0x9e3779b97f4a7c15
+		z := x
+		z = (z ^ z>>30) * 0xbf58476d1ce4e5b9
+		z = (z ^ z>>27) * 0x94d049bb133111eb
+		gear[i] = z ^ z>>31
+	}
+}
+
+//cut returns the length of the chunk at the start of b, which holds either
+//at least casMax bytes or the rest of the data.
+func cut(b []byte) int {
+	if len(b) <= casMin {
+		return len(b)
+	}
+	if len(b) > casMax {
+		b = b[:casMax]
+	}
+	h := uint64(0)
+	for i := casMin - 64; i < len(b); i++ {
+		h = h<<1 + gear[b[i]]
+		if h&casMask == 0 && i >= casMin {
+			return i + 1
+		}
+	}
+	return len(b)
+}
+
+//casRef is one chunk of a file.
+type casRef struct {
+	sum [sha256.Size]byte
+	n   uint32
+}
+
+//chunkStore keeps chunks as files named by their hash, under a directory
+//per first byte, so the same chunk in any number of files is one file on
+//disk and one copy in the page cache. Open chunks are kept around for reads.
+type chunkStore struct {
+	dir string
+
+	lock  sync.Mutex
+	files map[[sha256.Size]byte]*os.File
+	max   int
+
+	stored, deduped, storedBytes, dedupedBytes int64
+}
+
+func newChunkStore(dir string) (*chunkStore, error) {
+	for i := 0; i < 256; i++ {
+		if err := os.MkdirAll(filepath.Join(dir, hex.EncodeToString([]byte{byte(i)})), 0700); err != nil {
+			return nil, err
+		}
+	}
+	return &chunkStore{dir: dir, files: make(map[[sha256.Size]byte]*os.File), max: 256}, nil
+}
+
+func (s *chunkStore) path(sum [sha256.Size]byte) string {
+	name := hex.EncodeToString(sum[:])
+	return filepath.Join(s.dir, name[:2], name)
+}
+
+//put stores a chunk unless it's already there.
+func (s *chunkStore) put(sum [sha256.Size]byte, data []byte) error {
+	path := s.path(sum)
+	if _, err := os.Stat(path); err == nil {
+		atomic.AddInt64(&s.deduped, 1)
+		atomic.AddInt64(&s.dedupedBytes, int64(len(data)))
+		return nil
+	}
+	f, err := os.CreateTemp(filepath.Dir(path), "new-")
+	if err != nil {
+		return err
+	}
+	_, err = f.Write(data)
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(f.Name(), path)
+	}
+	if err != nil {
+		os.Remove(f.Name())
+		return err
+	}
+	atomic.AddInt64(&s.stored, 1)
+	atomic.AddInt64(&s.storedBytes, int64(len(data)))
+	return nil
+}
+
+//readAt reads from the chunk sum at off.
+func (s *chunkStore) readAt(sum [sha256.Size]byte, b []byte, off int64) (int, error) {
+	s.lock.Lock()
+	f, ok := s.files[sum]
+	s.lock.Unlock()
+	if !ok {
+		var err error
+		if f, err = os.Open(s.path(sum)); err != nil {
+			return 0, err
+		}
+		s.lock.Lock()
+		if old, ok := s.files[sum]; ok {
+			f.Close()
+			f = old
+		} else {
+			if len(s.files) >= s.max {
+				for k, old := range s.files { //evict whatever the map hands us first
+					old.Close()
+					delete(s.files, k)
+					break
+				}
+			}
+			s.files[sum] = f
+		}
+		s.lock.Unlock()
+	}
+	n, err := f.ReadAt(b, off)
+	if errors.Is(err, os.ErrClosed) { //evicted under us
+		return s.readAt(sum, b, off)
+	}
+	return n, err
+}
+
+func (s *chunkStore) close() {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	for k, f := range s.files {
+		f.Close()
+		delete(s.files, k)
+	}
+}
+
+//chunk splits everything r has into chunks and stores them. Boundaries are
+//found here, one after another; hashing and storing the chunks is spread
+//over a worker per CPU.
+func (s *chunkStore) chunk(r io.Reader) ([]casRef, error) {
+	type job struct {
+		ref  *casRef
+		data []byte
+	}
+	workers := runtime.GOMAXPROCS(0)
+	jobs := make(chan job, 4*workers)
+	failed := make(chan error, 1)
+	var wg sync.WaitGroup
+	wg.Add(workers)
+	for i := 0; i < workers; i++ {
+		go func() {
+			defer wg.Done()
+			for j := range jobs {
+				j.ref.sum = sha256.Sum256(j.data)
+				j.ref.n = uint32(len(j.data))
+				if err := s.put(j.ref.sum, j.data); err != nil {
+					select {
+					case failed <- err:
+					default:
+					}
+				}
+			}
+		}()
+	}
+
+	var refs []*casRef
+	var err error
+	block := make([]byte, casBlock)
+	have := 0
+	for err == nil {
+		var n int
+		n, err = io.ReadFull(r, block[have:])
+		have += n
+		if err == io.ErrUnexpectedEOF {
+			err = io.EOF
+		}
+		//chunks are handed off as slices of block, so it's never reused
+		p := 0
+		for have-p >= casMax || (err != nil && p < have) {
+			k := cut(block[p:have])
+			ref := new(casRef)
+			refs = append(refs, ref)
+			jobs <- job{ref, block[p : p+k]}
+			p += k
+		}
+		next := make([]byte, casBlock)
+		have = copy(next, block[p:have])
+		block = next
+	}
+	close(jobs)
+	wg.Wait()
+	if err != io.EOF {
+		return nil, err
+	}
+	select {
+	case err := <-failed:
+		return nil, err
+	default:
+	}
+
+	list := make([]casRef, len(refs))
+	for i, ref := range refs {
+		list[i] = *ref
+	}
+	return list, nil
+}
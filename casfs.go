@@ -0,0 +1,715 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+//casFS stores files as lists of content-addressed chunks (see caschunk.go),
+//so trees that are mostly the same share most of their storage, on disk and
+//in the page cache. Under its directory it keeps:
+//
+//	files/  the tree, with each file a recipe: its size and chunk list
+//	chunks/ the chunks, by hash
+//	dirty/  files being written, mirroring files/
+//	tmp/    recipes being written, before they're renamed into files/
+//
+//Writes go to a plain copy of the file under dirty/. Once it's been left
+//alone for writeBackAge, or on COMMIT, it's sealed: cut into chunks, which
+//are hashed and stored in parallel, and its recipe replaced. Anything still
+//dirty at startup is sealed then.
+type casFS struct {
+	dir    string
+	chunks *chunkStore
+
+	lock    sync.Mutex
+	dirty   map[string]*casDirty
+	recipes map[string]*casRecipe //recently used, by path
+	max     int
+
+	seals int64
+}
+
+//casDirty is a file being written. Reads and writes hold lock for reading,
+//since the file takes care of itself; sealing, truncating and dropping it
+//hold it for writing.
+type casDirty struct {
+	lock  sync.RWMutex
+	f     *os.File
+	mtime time.Time
+	done  bool //sealed or dropped, so whoever's holding it has to look again
+}
+
+type casRecipe struct {
+	size int64
+	refs []casRef
+	ends []int64 //where each chunk ends in the file
+}
+
+var casMagic = [8]byte{'u', 'n', 'f', 's', 'c', 'a', 's', '1'}
+
+var errCasRecipe = errors.New("damaged cas recipe")
+
+//config example:   /srv/cas gc
+func casfsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) < 1 || len(args) > 2 || (len(args) == 2 && args[1] != "gc") {
+		return nil, errors.New("-cas needs a store directory, and optionally gc")
+	}
+	c, err := newCasFS(args[0])
+	if err != nil {
+		return nil, err
+	}
+	if len(args) == 2 {
+		if err := c.collect(); err != nil {
+			c.Close()
+			return nil, err
+		}
+	}
+	return c, nil
+}
+
+func newCasFS(dir string) (*casFS, error) {
+	//recipes half written when we last stopped are of no use
+	if err := os.RemoveAll(filepath.Join(dir, "tmp")); err != nil {
+		return nil, err
+	}
+	for _, d := range []string{"files", "dirty", "tmp"} {
+		if err := os.MkdirAll(filepath.Join(dir, d), 0700); err != nil {
+			return nil, err
+		}
+	}
+	chunks, err := newChunkStore(filepath.Join(dir, "chunks"))
+	if err != nil {
+		return nil, err
+	}
+	c := &casFS{dir: dir, chunks: chunks,
+		dirty:   make(map[string]*casDirty),
+		recipes: make(map[string]*casRecipe),
+		max:     4096}
+
+	//seal whatever was still being written when we last stopped
+	dirtyDir := filepath.Join(dir, "dirty")
+	err = filepath.Walk(dirtyDir, func(local string, fi os.FileInfo, err error) error {
+		if err != nil || fi.IsDir() {
+			return err
+		}
+		path := filepath.ToSlash(strings.TrimPrefix(local, dirtyDir))
+		if _, err := os.Stat(c.recipePath(path)); err != nil {
+			return os.Remove(local)
+		}
+		f, err := os.OpenFile(local, os.O_RDWR, 0)
+		if err != nil {
+			return err
+		}
+		c.dirty[path] = &casDirty{f: f, mtime: fi.ModTime()}
+		lg.info("sealing a file left dirty last time", "path", path)
+		return c.seal(path)
+	})
+	if err != nil {
+		return nil, err
+	}
+
+	go c.run()
+	return c, nil
+}
+
+func (c *casFS) recipePath(path string) string {
+	return filepath.Join(c.dir, "files", filepath.FromSlash(path))
+}
+
+func (c *casFS) dirtyPath(path string) string {
+	return filepath.Join(c.dir, "dirty", filepath.FromSlash(path))
+}
+
+//fsErr turns the errors os gives into the ones errTranslator knows.
+func fsErr(err error) error {
+	switch {
+	case err == nil:
+		return nil
+	case os.IsNotExist(err):
+		return os.ErrNotExist
+	case os.IsExist(err):
+		return os.ErrExist
+	case os.IsPermission(err):
+		return os.ErrPermission
+	}
+	return err
+}
+
+//recipe returns path's recipe, reading it in if it's not in memory.
+func (c *casFS) recipe(path string) (*casRecipe, error) {
+	c.lock.Lock()
+	r, ok := c.recipes[path]
+	c.lock.Unlock()
+	if ok {
+		return r, nil
+	}
+	r, err := readRecipe(c.recipePath(path))
+	if err != nil {
+		return nil, err
+	}
+	c.remember(path, r)
+	return r, nil
+}
+
+func (c *casFS) remember(path string, r *casRecipe) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	if len(c.recipes) >= c.max {
+		for p := range c.recipes { //evict whatever the map hands us first
+			delete(c.recipes, p)
+			break
+		}
+	}
+	c.recipes[path] = r
+}
+
+//forget drops the recipes of path and everything under it.
+func (c *casFS) forget(path string) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	delete(c.recipes, path)
+	for p := range c.recipes {
+		if strings.HasPrefix(p, path+"/") {
+			delete(c.recipes, p)
+		}
+	}
+}
+
+func readRecipe(file string) (*casRecipe, error) {
+	f, err := os.Open(file)
+	if err != nil {
+		return nil, fsErr(err)
+	}
+	defer f.Close()
+	br := bufio.NewReader(f)
+	var h struct {
+		Magic [8]byte
+		Size  int64
+		Count uint32
+	}
+	if err := binary.Read(br, binary.LittleEndian, &h); err != nil {
+		if fi, serr := f.Stat(); serr == nil && fi.IsDir() {
+			return nil, os.ErrInvalid
+		}
+		return nil, err
+	}
+	if h.Magic != casMagic || h.Size < 0 || int64(h.Count) > h.Size/casMin+1 {
+		return nil, errCasRecipe
+	}
+	r := &casRecipe{size: h.Size, refs: make([]casRef, h.Count), ends: make([]int64, h.Count)}
+	end := int64(0)
+	for i := range r.refs {
+		if _, err := io.ReadFull(br, r.refs[i].sum[:]); err != nil {
+			return nil, err
+		}
+		var n uint32
+		if err := binary.Read(br, binary.LittleEndian, &n); err != nil {
+			return nil, err
+		}
+		r.refs[i].n = n
+		end += int64(n)
+		r.ends[i] = end
+	}
+	if end != h.Size {
+		return nil, errCasRecipe
+	}
+	return r, nil
+}
+
+//writeRecipe replaces the recipe at file, keeping its mode. The new one is
+//written under tmp/, out of clients' sight, and renamed over the old.
+func (c *casFS) writeRecipe(file string, refs []casRef, mode os.FileMode, mtime time.Time) (*casRecipe, error) {
+	r := &casRecipe{refs: refs, ends: make([]int64, len(refs))}
+	for i, ref := range refs {
+		r.size += int64(ref.n)
+		r.ends[i] = r.size
+	}
+
+	f, err := os.CreateTemp(filepath.Join(c.dir, "tmp"), "recipe")
+	if err != nil {
+		return nil, err
+	}
+	tmp := f.Name()
+	w := bufio.NewWriter(f)
+	w.Write(casMagic[:])
+	binary.Write(w, binary.LittleEndian, r.size)
+	binary.Write(w, binary.LittleEndian, uint32(len(refs)))
+	for _, ref := range refs {
+		w.Write(ref.sum[:])
+		binary.Write(w, binary.LittleEndian, ref.n)
+	}
+	err = w.Flush()
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Chmod(tmp, mode)
+	}
+	if err == nil {
+		err = os.Chtimes(tmp, time.Now(), mtime)
+	}
+	if err == nil {
+		err = os.Rename(tmp, file)
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return nil, err
+	}
+	return r, nil
+}
+
+//readAt reads the file r describes, chunk by chunk.
+func (c *casFS) readAt(r *casRecipe, b []byte, off int64) (int, error) {
+	i := sort.Search(len(r.ends), func(i int) bool { return r.ends[i] > off })
+	n := 0
+	for n < len(b) && i < len(r.refs) {
+		start := r.ends[i] - int64(r.refs[i].n)
+		k, err := c.chunks.readAt(r.refs[i].sum, b[n:min64(int64(len(b)), r.ends[i]-off)], off+int64(n)-start)
+		n += k
+		if err != nil && err != io.EOF {
+			return n, err
+		}
+		if off+int64(n) >= r.ends[i] {
+			i++
+		} else if k == 0 {
+			return n, io.ErrUnexpectedEOF //the chunk's shorter than the recipe says
+		}
+	}
+	return n, nil
+}
+
+func min64(a, b int64) int64 {
+	if a < b {
+		return a
+	}
+	return b
+}
+
+func (c *casFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	if d := c.held(path); d != nil {
+		defer d.lock.RUnlock()
+		return d.f.ReadAt(b, off)
+	}
+	r, err := c.recipe(path)
+	if err != nil {
+		return 0, err
+	}
+	if off >= r.size {
+		return 0, io.EOF
+	}
+	want := len(b)
+	if int64(want) > r.size-off {
+		b = b[:r.size-off]
+	}
+	n, err := c.readAt(r, b, off)
+	if err == nil && n < want {
+		err = io.EOF
+	}
+	return n, err
+}
+
+//held returns path's dirty copy, if it has one, locked for reading.
+func (c *casFS) held(path string) *casDirty {
+	for {
+		c.lock.Lock()
+		d := c.dirty[path]
+		c.lock.Unlock()
+		if d == nil {
+			return nil
+		}
+		d.lock.RLock()
+		if !d.done {
+			return d
+		}
+		d.lock.RUnlock()
+	}
+}
+
+//hold returns path's dirty copy locked for reading, making one first if
+//need be.
+func (c *casFS) hold(path string) (*casDirty, error) {
+	for {
+		if d := c.held(path); d != nil {
+			return d, nil
+		}
+		fi, err := os.Stat(c.recipePath(path))
+		if err != nil {
+			return nil, fsErr(err)
+		}
+		if fi.IsDir() {
+			return nil, os.ErrInvalid
+		}
+		r, err := c.recipe(path)
+		if err != nil {
+			return nil, err
+		}
+
+		d := &casDirty{mtime: fi.ModTime()}
+		d.lock.Lock()
+		c.lock.Lock()
+		if c.dirty[path] != nil {
+			c.lock.Unlock()
+			continue //someone beat us to it
+		}
+		c.dirty[path] = d
+		c.lock.Unlock()
+
+		err = c.unpack(d, path, r)
+		if err != nil {
+			c.lock.Lock()
+			delete(c.dirty, path)
+			c.lock.Unlock()
+			d.done = true
+			d.lock.Unlock()
+			return nil, err
+		}
+		d.lock.Unlock()
+	}
+}
+
+//unpack writes the file out under dirty/ so it can be changed in place.
+func (c *casFS) unpack(d *casDirty, path string, r *casRecipe) error {
+	local := c.dirtyPath(path)
+	if err := os.MkdirAll(filepath.Dir(local), 0700); err != nil {
+		return err
+	}
+	f, err := os.OpenFile(local, os.O_RDWR|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+	buf := make([]byte, casMax)
+	for off := int64(0); off < r.size && err == nil; {
+		var n int
+		n, err = c.readAt(r, buf[:min64(casMax, r.size-off)], off)
+		if err == nil {
+			_, err = f.WriteAt(buf[:n], off)
+		}
+		off += int64(n)
+	}
+	if err != nil {
+		f.Close()
+		os.Remove(local)
+		return err
+	}
+	d.f = f
+	return nil
+}
+
+func (c *casFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	d, err := c.hold(path)
+	if err != nil {
+		return 0, err
+	}
+	defer d.lock.RUnlock()
+	n, err := d.f.WriteAt(b, off)
+	c.lock.Lock()
+	d.mtime = time.Now()
+	c.lock.Unlock()
+	return n, err
+}
+
+//seal turns path's dirty copy back into chunks and a recipe.
+func (c *casFS) seal(path string) error {
+	c.lock.Lock()
+	d := c.dirty[path]
+	c.lock.Unlock()
+	if d == nil {
+		return nil
+	}
+	d.lock.Lock()
+	defer d.lock.Unlock()
+	if d.done {
+		return nil
+	}
+
+	fi, err := os.Stat(c.recipePath(path))
+	if err != nil {
+		return fsErr(err)
+	}
+	if _, err := d.f.Seek(0, io.SeekStart); err != nil {
+		return err
+	}
+	refs, err := c.chunks.chunk(bufio.NewReaderSize(d.f, casBlock))
+	if err != nil {
+		return err
+	}
+	c.lock.Lock()
+	mtime := d.mtime
+	c.lock.Unlock()
+	r, err := c.writeRecipe(c.recipePath(path), refs, fi.Mode(), mtime)
+	if err != nil {
+		return err
+	}
+	c.drop(path, d)
+	c.remember(path, r)
+	c.lock.Lock()
+	c.seals++
+	c.lock.Unlock()
+	return nil
+}
+
+//drop throws away a dirty copy. Caller holds d.lock.
+func (c *casFS) drop(path string, d *casDirty) {
+	d.f.Close()
+	os.Remove(d.f.Name())
+	d.done = true
+	c.lock.Lock()
+	if c.dirty[path] == d {
+		delete(c.dirty, path)
+	}
+	c.lock.Unlock()
+}
+
+func (c *casFS) Sync(path string) error {
+	return c.seal(path)
+}
+
+//sealAll seals path and everything under it, or every file if path is "".
+func (c *casFS) sealAll(path string) error {
+	c.lock.Lock()
+	var paths []string
+	for p := range c.dirty {
+		if path == "" || p == path || strings.HasPrefix(p, path+"/") {
+			paths = append(paths, p)
+		}
+	}
+	c.lock.Unlock()
+	for _, p := range paths {
+		if err := c.seal(p); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (c *casFS) run() {
+	tick := time.NewTicker(writeBackAge / 2)
+	for range tick.C {
+		c.lock.Lock()
+		var idle []string
+		for p, d := range c.dirty {
+			if time.Since(d.mtime) >= writeBackAge {
+				idle = append(idle, p)
+			}
+		}
+		c.lock.Unlock()
+		for _, p := range idle {
+			if err := c.seal(p); err != nil {
+				lg.error("sealing into chunks failed", "path", p, "err", err)
+			}
+		}
+	}
+}
+
+func (c *casFS) Stat(path string) (os.FileInfo, error) {
+	fi, err := os.Stat(c.recipePath(path))
+	if err != nil {
+		return nil, fsErr(err)
+	}
+	return c.info(path, fi)
+}
+
+//info makes what Stat returns from the recipe file's own FileInfo.
+func (c *casFS) info(path string, fi os.FileInfo) (os.FileInfo, error) {
+	if fi.IsDir() {
+		return fi, nil
+	}
+	if d := c.held(path); d != nil {
+		defer d.lock.RUnlock()
+		dfi, err := d.f.Stat()
+		if err != nil {
+			return nil, err
+		}
+		c.lock.Lock()
+		defer c.lock.Unlock()
+		return &zipInfo{fi.Name(), dfi.Size(), fi.Mode(), d.mtime}, nil
+	}
+	r, err := c.recipe(path)
+	if err != nil {
+		return nil, err
+	}
+	return sizedInfo{fi, r.size}, nil
+}
+
+func (c *casFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	entries, err := os.ReadDir(c.recipePath(path))
+	if err != nil {
+		return nil, fsErr(err)
+	}
+	list := make([]os.FileInfo, 0, len(entries))
+	for _, e := range entries {
+		fi, err := e.Info()
+		if err == nil {
+			fi, err = c.info(filepath.Join(path, e.Name()), fi)
+		}
+		if err != nil {
+			if err == os.ErrNotExist || os.IsNotExist(err) {
+				continue //removed since the listing
+			}
+			return nil, err
+		}
+		list = append(list, fi)
+	}
+	return list, nil
+}
+
+func (c *casFS) CreateFile(path string) error {
+	f, err := os.OpenFile(c.recipePath(path), os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	if err != nil {
+		return fsErr(err)
+	}
+	f.Close()
+	_, err = c.writeRecipe(c.recipePath(path), nil, 0644, time.Now())
+	c.forget(path)
+	return err
+}
+
+func (c *casFS) CreateDirectory(path string) error {
+	return fsErr(os.Mkdir(c.recipePath(path), 0755))
+}
+
+func (c *casFS) Remove(path string) error {
+	if d := c.held(path); d != nil {
+		d.lock.RUnlock()
+		d.lock.Lock()
+		if !d.done {
+			c.drop(path, d)
+		}
+		d.lock.Unlock()
+	}
+	c.forget(path)
+	return fsErr(os.Remove(c.recipePath(path)))
+}
+
+func (c *casFS) Move(oldpath string, newpath string) error {
+	if err := c.sealAll(oldpath); err != nil {
+		return err
+	}
+	if err := c.sealAll(newpath); err != nil {
+		return err
+	}
+	err := os.Rename(c.recipePath(oldpath), c.recipePath(newpath))
+	c.forget(oldpath)
+	c.forget(newpath)
+	return fsErr(err)
+}
+
+func (c *casFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	return nil, os.ErrInvalid
+}
+
+func (c *casFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	file := c.recipePath(path)
+	switch attribute {
+	case "mode":
+		mode, ok := newvalue.(os.FileMode)
+		if !ok {
+			return os.ErrInvalid
+		}
+		return fsErr(os.Chmod(file, mode))
+	case "modtime":
+		mtime, ok := newvalue.(time.Time)
+		if !ok {
+			return os.ErrInvalid
+		}
+		if d := c.held(path); d != nil {
+			c.lock.Lock()
+			d.mtime = mtime
+			c.lock.Unlock()
+			d.lock.RUnlock()
+		}
+		return fsErr(os.Chtimes(file, time.Now(), mtime))
+	case "size":
+		size, ok := newvalue.(int64)
+		if !ok || size < 0 {
+			return os.ErrInvalid
+		}
+		d, err := c.hold(path)
+		if err != nil {
+			return err
+		}
+		defer d.lock.RUnlock()
+		c.lock.Lock()
+		d.mtime = time.Now()
+		c.lock.Unlock()
+		return d.f.Truncate(size)
+	}
+	return os.ErrInvalid
+}
+
+//collect removes chunks no recipe uses any more.
+func (c *casFS) collect() error {
+	if err := c.sealAll(""); err != nil {
+		return err
+	}
+	used := make(map[[sha256.Size]byte]bool)
+	err := filepath.Walk(filepath.Join(c.dir, "files"), func(file string, fi os.FileInfo, err error) error {
+		if err != nil || fi.IsDir() {
+			return err
+		}
+		r, err := readRecipe(file)
+		if err != nil {
+			return errors.New("can't collect garbage, " + file + ": " + err.Error())
+		}
+		for _, ref := range r.refs {
+			used[ref.sum] = true
+		}
+		return nil
+	})
+	if err != nil {
+		return err
+	}
+
+	removed, kept := 0, 0
+	err = filepath.Walk(c.chunks.dir, func(file string, fi os.FileInfo, err error) error {
+		if err != nil || fi.IsDir() {
+			return err
+		}
+		var sum [sha256.Size]byte
+		if b, err := hex.DecodeString(fi.Name()); err == nil && len(b) == len(sum) {
+			copy(sum[:], b)
+			if used[sum] {
+				kept++
+				return nil
+			}
+		}
+		removed++
+		return os.Remove(file)
+	})
+	lg.info("collected unused chunks", "removed", removed, "kept", kept)
+	return err
+}
+
+func (c *casFS) String() string {
+	return "cas(" + c.dir + ")"
+}
+
+func (c *casFS) Close() error {
+	err := c.sealAll("")
+	c.chunks.close()
+	return err
+}
+
+func (c *casFS) stats() string {
+	c.lock.Lock()
+	seals := c.seals
+	c.lock.Unlock()
+	s := c.chunks
+	return fmt.Sprintf("Content store: %d files sealed, %d chunks (%d bytes) stored, %d chunks (%d bytes) already there",
+		seals, atomic.LoadInt64(&s.stored), atomic.LoadInt64(&s.storedBytes),
+		atomic.LoadInt64(&s.deduped), atomic.LoadInt64(&s.dedupedBytes))
+}
@@ -0,0 +1,277 @@
+package main
+
+import (
+	"io"
+	"os"
+	"sync"
+)
+
+//deflateReader reads deflate streams held in src, for the backends that
+//serve compressed archives. Reads go through a shared chunk cache (see
+//zipcache.go), and a chunk that isn't cached is decoded from the nearest
+//seek point before it, or from where an earlier read of the same stream
+//stopped, so a read anywhere in a big stream decodes about one span at most
+//instead of everything before it.
+type deflateReader struct {
+	src     io.ReaderAt
+	span    int64
+	mapping sync.RWMutex //held for reading while src is in use
+	closed  bool
+
+	cache *chunkCache
+	jobs  chan *deflated //streams wanting read-ahead
+
+	lock   sync.Mutex
+	parked []*inflater //where recent reads stopped, oldest first
+}
+
+//deflated is one deflate stream in src.
+type deflated struct {
+	offset int64 //where it starts
+	csize  int64
+	size   int64      //decompressed
+	index  *seekIndex //made on first read if nil
+	atEnd  func()     //called whenever a decode reaches the end, if set
+
+	ends      [4]int64 //where recent reads stopped, to spot sequential ones
+	aheadNext int64    //chunks [aheadNext, aheadTo) are wanted ahead of reads
+	aheadTo   int64
+	aheadBusy bool //a worker is on them
+}
+
+const parkedStreams = 8
+
+func (r *deflateReader) init(src io.ReaderAt, span, cache int64) {
+	r.src, r.span = src, span
+	r.cache = newChunkCache(cache)
+	r.jobs = make(chan *deflated, 64)
+	for i := 0; i < zipWorkers; i++ {
+		go r.aheadWorker()
+	}
+}
+
+//inflate reads decompressed data of e through the chunk cache. The caller
+//holds mapping for reading and keeps off+len(b) within e.size.
+func (r *deflateReader) inflate(e *deflated, b []byte, off int64) (int, error) {
+	n := 0
+	last := (off + int64(len(b)) - 1) / zipChunk
+	for n < len(b) {
+		pos := off + int64(n)
+		data, err := r.chunk(e, pos/zipChunk, last)
+		if err != nil {
+			return n, err
+		}
+		n += copy(b[n:], data[pos%zipChunk:])
+	}
+	r.readAhead(e, off, off+int64(n))
+	return n, nil
+}
+
+//chunk returns chunk idx of e, decoding it if nobody else is already,
+//along with any chunks after it up to last that are missing too.
+func (r *deflateReader) chunk(e *deflated, idx, last int64) ([]byte, error) {
+	key := chunkKey{e.offset, idx}
+	for {
+		data, wait := r.cache.claim(key)
+		if data != nil {
+			r.cache.count(true, false)
+			return data, nil
+		}
+		if wait == nil {
+			data, _, err := r.decode(e, idx, last, false)
+			return data, err
+		}
+		<-wait
+	}
+}
+
+//decode inflates claimed chunk idx of e, and after it any up to last that
+//nobody has yet, starting from the closest of a seek point and a parked
+//inflater. It returns the first chunk and how many it did.
+func (r *deflateReader) decode(e *deflated, idx, last int64, ahead bool) ([]byte, int64, error) {
+	off := idx * zipChunk
+	ix := r.seekIndex(e)
+	p := ix.find(off)
+	s := r.unpark(e, p.pos, off)
+	if s == nil {
+		s = newInflater(r.src, e.offset, e.csize, p.bit, p.pos, p.window)
+		s.onBlock = func(s *inflater) { ix.mark(s, r.span) }
+	}
+
+	var first []byte
+	done := int64(0)
+	err := s.discard(off - s.offset())
+	for err == nil {
+		data := make([]byte, zipChunk)
+		if rest := e.size - off; rest < zipChunk {
+			data = data[:rest]
+		}
+		if _, err = io.ReadFull(s, data); err != nil {
+			break
+		}
+		r.cache.put(chunkKey{e.offset, idx}, data)
+		r.cache.count(false, ahead)
+		if first == nil {
+			first = data
+		}
+		done++
+		idx++
+		off += int64(len(data))
+		if idx > last || off >= e.size {
+			break
+		}
+		if data, wait := r.cache.claim(chunkKey{e.offset, idx}); data != nil || wait != nil {
+			break
+		}
+	}
+	if err != nil {
+		r.cache.put(chunkKey{e.offset, idx}, nil)
+		if err == io.EOF {
+			err = io.ErrUnexpectedEOF //the stream is shorter than it claims
+		}
+		return nil, done, err
+	}
+
+	//all of the output is enough: when it ends on a full window the inflater
+	//stops short of the final block's end and never sees EOF itself
+	if off >= e.size {
+		ix.finish(e.size)
+		if e.atEnd != nil {
+			e.atEnd()
+		}
+	} else {
+		r.park(s)
+	}
+	return first, done, nil
+}
+
+//readAhead has a worker decode the next zipAhead bytes of e once reads of
+//it look sequential, so inflating the next read's data overlaps with
+//sending this one's. Each stream has at most one worker on it at a time,
+//which extends its run as more reads come in.
+func (r *deflateReader) readAhead(e *deflated, off, end int64) {
+	r.lock.Lock()
+	seq := false
+	for i, prev := range e.ends {
+		if off <= prev && prev-off < zipChunk { //reads can overlap a little
+			seq = true
+			e.ends[i] = end
+		}
+	}
+	if !seq {
+		copy(e.ends[1:], e.ends[:])
+		e.ends[0] = end
+	}
+	to := (end + zipAhead + zipChunk - 1) / zipChunk
+	if n := (e.size + zipChunk - 1) / zipChunk; to > n {
+		to = n
+	}
+	start := false
+	if seq && to > e.aheadTo {
+		e.aheadTo = to
+		if e.aheadNext < end/zipChunk {
+			e.aheadNext = end / zipChunk
+		}
+		start = !e.aheadBusy
+		e.aheadBusy = true
+	}
+	r.lock.Unlock()
+
+	if start {
+		select {
+		case r.jobs <- e:
+		default:
+			r.lock.Lock()
+			e.aheadBusy = false
+			r.lock.Unlock()
+		}
+	}
+}
+
+func (r *deflateReader) aheadWorker() {
+	for e := range r.jobs {
+		for {
+			r.lock.Lock()
+			idx, to := e.aheadNext, e.aheadTo
+			if idx >= to {
+				e.aheadBusy = false
+				r.lock.Unlock()
+				break
+			}
+			r.lock.Unlock()
+
+			//the mapping comes before any claim: with a claim held,
+			//waiting on a Close that waits on a read waiting on the
+			//claim would never end
+			n := int64(1)
+			var err error
+			r.mapping.RLock()
+			if r.closed {
+				err = os.ErrClosed
+			} else if data, wait := r.cache.claim(chunkKey{e.offset, idx}); data == nil && wait == nil {
+				_, n, err = r.decode(e, idx, to-1, true)
+			}
+			r.mapping.RUnlock()
+			if err != nil {
+				r.lock.Lock()
+				e.aheadNext, e.aheadBusy = to, false
+				r.lock.Unlock()
+				break
+			}
+			r.lock.Lock()
+			if e.aheadNext < idx+n {
+				e.aheadNext = idx + n
+			}
+			r.lock.Unlock()
+		}
+	}
+}
+
+func (r *deflateReader) seekIndex(e *deflated) *seekIndex {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+	if e.index == nil {
+		e.index = newSeekIndex()
+	}
+	return e.index
+}
+
+//unpark takes back the parked inflater for e that's furthest along without
+//being past off, if it's no further back than from.
+func (r *deflateReader) unpark(e *deflated, from, off int64) *inflater {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+	best := -1
+	for i, s := range r.parked {
+		if s.base == e.offset && s.offset() >= from && s.offset() <= off &&
+			(best < 0 || s.offset() > r.parked[best].offset()) {
+			best = i
+		}
+	}
+	if best < 0 {
+		return nil
+	}
+	s := r.parked[best]
+	r.parked = append(r.parked[:best], r.parked[best+1:]...)
+	return s
+}
+
+func (r *deflateReader) park(s *inflater) {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+	if len(r.parked) == parkedStreams {
+		r.parked = r.parked[1:]
+	}
+	r.parked = append(r.parked, s)
+}
+
+//close stops reads of src, running release once any already going are done.
+func (r *deflateReader) close(release func()) {
+	r.lock.Lock()
+	r.parked = nil
+	r.lock.Unlock()
+	r.mapping.Lock()
+	r.closed = true
+	release()
+	r.mapping.Unlock()
+}
@@ -0,0 +1,540 @@
+package main
+
+import (
+	"errors"
+	"io"
+	"math/bits"
+)
+
+//inflater decodes raw deflate data (RFC 1951), as stored in zip entries.
+//It's here instead of compress/flate because it can start at any block
+//boundary, given the bit offset and the 32KiB of output before it, which is
+//what lets a read from the middle of an entry skip decoding everything before.
+type inflater struct {
+	src   io.ReaderAt
+	base  int64 //where the deflate data starts in src
+	csize int64 //and how long it is
+
+	in     []byte
+	inOff  int64 //offset of in[0] in the deflate data
+	ip     int   //next byte of in
+	bits   uint64
+	nbits  uint
+	srcErr error
+
+	hist [inflateWindow]byte //ring of the most recent output
+	wr   int                 //next byte of hist to decode into
+	rd   int                 //next byte of hist to hand out
+	full bool                //hist has wrapped, so all of it is history
+	pos  int64               //uncompressed offset of hist[wr]
+
+	state    int
+	final    bool
+	stored   int //bytes left in a stored block
+	copyLen  int //of a back reference still being copied
+	copyDist int
+	lit      *huffman
+	dist     *huffman
+	dyn      [2]huffman
+	err      error
+
+	onBlock func(z *inflater) //called at each block boundary, before its header
+}
+
+const (
+	inflateWindow = 1 << 15
+	inflateInput  = 32 * 1024
+)
+
+const (
+	stateHeader = iota
+	stateStored
+	stateHuffman
+)
+
+var errCorrupt = errors.New("zip entry has corrupt deflate data")
+
+//newInflater starts decoding src[base:base+csize] at bit offset bit, where
+//pos bytes of output lie before and window holds the last of them.
+func newInflater(src io.ReaderAt, base, csize, bit, pos int64, window []byte) *inflater {
+	z := &inflater{src: src, base: base, csize: csize,
+		in:    make([]byte, 0, inflateInput),
+		inOff: bit / 8,
+		pos:   pos}
+	z.wr = copy(z.hist[:], window)
+	if z.wr == len(z.hist) {
+		z.wr, z.full = 0, true
+	}
+	z.rd = z.wr
+	if n := uint(bit % 8); n > 0 {
+		if _, err := z.getBits(n); err != nil {
+			z.err = err
+		}
+	}
+	return z
+}
+
+//offset is where the next Read will start in the uncompressed data.
+func (z *inflater) offset() int64 {
+	return z.pos - int64(z.wr-z.rd)
+}
+
+//bitPos is where decoding has got to in the deflate data.
+func (z *inflater) bitPos() int64 {
+	return (z.inOff+int64(z.ip))*8 - int64(z.nbits)
+}
+
+//window returns a copy of the output history, oldest first.
+func (z *inflater) window() []byte {
+	if !z.full {
+		return append([]byte(nil), z.hist[:z.wr]...)
+	}
+	w := make([]byte, 0, len(z.hist))
+	return append(append(w, z.hist[z.wr:]...), z.hist[:z.wr]...)
+}
+
+func (z *inflater) Read(p []byte) (int, error) {
+	for {
+		if z.rd < z.wr {
+			n := copy(p, z.hist[z.rd:z.wr])
+			z.rd += n
+			return n, nil
+		}
+		if z.err != nil {
+			return 0, z.err
+		}
+		if z.wr == len(z.hist) {
+			z.wr, z.rd, z.full = 0, 0, true
+		}
+		z.step()
+	}
+}
+
+//discard skips n bytes of output.
+func (z *inflater) discard(n int64) error {
+	for n > 0 {
+		if z.rd < z.wr {
+			k := z.wr - z.rd
+			if int64(k) > n {
+				k = int(n)
+			}
+			z.rd += k
+			n -= int64(k)
+			continue
+		}
+		if z.err != nil {
+			return z.err
+		}
+		if z.wr == len(z.hist) {
+			z.wr, z.rd, z.full = 0, 0, true
+		}
+		z.step()
+	}
+	return nil
+}
+
+//step decodes until hist is full, the data ends, or something goes wrong.
+func (z *inflater) step() {
+	for z.wr < len(z.hist) && z.err == nil {
+		switch z.state {
+		case stateHeader:
+			if z.final {
+				z.err = io.EOF
+				return
+			}
+			if z.onBlock != nil {
+				z.onBlock(z)
+			}
+			z.header()
+		case stateStored:
+			z.copyStored()
+		case stateHuffman:
+			z.decodeBlock()
+		}
+	}
+}
+
+//fill tops the bit buffer up to more than 56 bits, or as far as the data goes.
+func (z *inflater) fill() {
+	for z.nbits <= 56 {
+		if z.ip == len(z.in) && !z.refill() {
+			return
+		}
+		z.bits |= uint64(z.in[z.ip]) << z.nbits
+		z.ip++
+		z.nbits += 8
+	}
+}
+
+func (z *inflater) refill() bool {
+	z.inOff += int64(len(z.in))
+	z.ip = 0
+	left := z.csize - z.inOff
+	if left > int64(cap(z.in)) {
+		left = int64(cap(z.in))
+	}
+	if left <= 0 || z.srcErr != nil {
+		z.in = z.in[:0]
+		return false
+	}
+	n, err := z.src.ReadAt(z.in[:left], z.base+z.inOff)
+	if n < int(left) {
+		z.srcErr = err
+	}
+	z.in = z.in[:n]
+	return n > 0
+}
+
+//short is the error for running out of data.
+func (z *inflater) short() error {
+	if z.srcErr != nil && z.srcErr != io.EOF {
+		return z.srcErr
+	}
+	return io.ErrUnexpectedEOF
+}
+
+func (z *inflater) getBits(n uint) (int, error) {
+	if z.nbits < n {
+		z.fill()
+		if z.nbits < n {
+			return 0, z.short()
+		}
+	}
+	v := int(z.bits & (1<<n - 1))
+	z.bits >>= n
+	z.nbits -= n
+	return v, nil
+}
+
+func (z *inflater) header() {
+	h, err := z.getBits(3)
+	if err != nil {
+		z.err = err
+		return
+	}
+	z.final = h&1 == 1
+	switch h >> 1 {
+	case 0:
+		drop := z.nbits % 8
+		z.bits >>= drop
+		z.nbits -= drop
+		v, err := z.getBits(32)
+		if err != nil {
+			z.err = err
+			return
+		}
+		if v&0xffff != ^v>>16&0xffff {
+			z.err = errCorrupt
+			return
+		}
+		z.stored = v & 0xffff
+		z.state = stateStored
+	case 1:
+		z.lit, z.dist = &fixedLit, &fixedDist
+		z.state = stateHuffman
+	case 2:
+		z.err = z.dynamicTables()
+		z.lit, z.dist = &z.dyn[0], &z.dyn[1]
+		z.state = stateHuffman
+	default:
+		z.err = errCorrupt
+	}
+}
+
+var codeOrder = [19]int{16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}
+
+func (z *inflater) dynamicTables() error {
+	h, err := z.getBits(14)
+	if err != nil {
+		return err
+	}
+	nlit, ndist, ncode := h&31+257, h>>5&31+1, h>>10+4
+	if nlit > 286 || ndist > 30 {
+		return errCorrupt
+	}
+
+	var lengths [286 + 30]uint8
+	for i := 0; i < ncode; i++ {
+		l, err := z.getBits(3)
+		if err != nil {
+			return err
+		}
+		lengths[codeOrder[i]] = uint8(l)
+	}
+	var codes huffman
+	if err := codes.init(lengths[:19]); err != nil {
+		return err
+	}
+
+	lengths = [286 + 30]uint8{}
+	for i := 0; i < nlit+ndist; {
+		sym, err := z.decode(&codes)
+		if err != nil {
+			return err
+		}
+		if sym < 16 {
+			lengths[i] = uint8(sym)
+			i++
+			continue
+		}
+		var rep int
+		var l uint8
+		switch sym {
+		case 16:
+			if i == 0 {
+				return errCorrupt
+			}
+			l = lengths[i-1]
+			rep, err = z.getBits(2)
+			rep += 3
+		case 17:
+			rep, err = z.getBits(3)
+			rep += 3
+		default:
+			rep, err = z.getBits(7)
+			rep += 11
+		}
+		if err != nil {
+			return err
+		}
+		if i+rep > nlit+ndist {
+			return errCorrupt
+		}
+		for ; rep > 0; rep-- {
+			lengths[i] = l
+			i++
+		}
+	}
+	if lengths[256] == 0 {
+		return errCorrupt
+	}
+	if err := z.dyn[0].init(lengths[:nlit]); err != nil {
+		return err
+	}
+	return z.dyn[1].init(lengths[nlit : nlit+ndist])
+}
+
+func (z *inflater) copyStored() {
+	for z.stored > 0 && z.wr < len(z.hist) {
+		if z.nbits >= 8 {
+			z.hist[z.wr] = byte(z.bits)
+			z.bits >>= 8
+			z.nbits -= 8
+			z.wr++
+			z.pos++
+			z.stored--
+			continue
+		}
+		if z.ip == len(z.in) && !z.refill() {
+			z.err = z.short()
+			return
+		}
+		end := z.wr + z.stored
+		if end > len(z.hist) {
+			end = len(z.hist)
+		}
+		n := copy(z.hist[z.wr:end], z.in[z.ip:])
+		z.ip += n
+		z.wr += n
+		z.pos += int64(n)
+		z.stored -= n
+	}
+	if z.stored == 0 {
+		z.state = stateHeader
+	}
+}
+
+var lenBase = [29]int{3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258}
+var lenExtra = [29]uint{0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0}
+var distBase = [30]int{1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577}
+var distExtra = [30]uint{0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13}
+
+func (z *inflater) decodeBlock() {
+	for z.wr < len(z.hist) {
+		if z.copyLen > 0 {
+			z.copyBack()
+			continue
+		}
+		sym, err := z.decode(z.lit)
+		if err != nil {
+			z.err = err
+			return
+		}
+		if sym < 256 {
+			z.hist[z.wr] = byte(sym)
+			z.wr++
+			z.pos++
+			continue
+		}
+		if sym == 256 {
+			z.state = stateHeader
+			return
+		}
+		sym -= 257
+		if sym >= len(lenBase) {
+			z.err = errCorrupt
+			return
+		}
+		extra, err := z.getBits(lenExtra[sym])
+		if err != nil {
+			z.err = err
+			return
+		}
+		z.copyLen = lenBase[sym] + extra
+
+		d, err := z.decode(z.dist)
+		if err != nil {
+			z.err = err
+			return
+		}
+		if d >= len(distBase) {
+			z.err = errCorrupt
+			return
+		}
+		if extra, err = z.getBits(distExtra[d]); err != nil {
+			z.err = err
+			return
+		}
+		z.copyDist = distBase[d] + extra
+		if !z.full && z.copyDist > z.wr {
+			z.err = errCorrupt
+			return
+		}
+	}
+}
+
+//copyBack copies as much of a back reference as fits before hist wraps.
+func (z *inflater) copyBack() {
+	for z.copyLen > 0 && z.wr < len(z.hist) {
+		src := z.wr - z.copyDist
+		if src < 0 {
+			src += len(z.hist)
+		}
+		n := z.copyLen
+		if n > len(z.hist)-z.wr {
+			n = len(z.hist) - z.wr
+		}
+		end := z.wr + n
+		if src >= z.wr {
+			if n > len(z.hist)-src {
+				n = len(z.hist) - src
+				end = z.wr + n
+			}
+			copy(z.hist[z.wr:end], z.hist[src:src+n])
+			z.wr = end
+		} else {
+			//overlapping copies repeat the pattern, which doubles each pass
+			for z.wr < end {
+				z.wr += copy(z.hist[z.wr:end], z.hist[src:z.wr])
+			}
+		}
+		z.pos += int64(n)
+		z.copyLen -= n
+	}
+}
+
+//huffman is a canonical Huffman code. Codes up to fastBits long decode with
+//one table lookup; longer ones (rare in practice) a bit at a time.
+type huffman struct {
+	fast   [1 << fastBits]uint16 //symbol<<4 | length, 0 for a longer code
+	count  [16]uint16            //codes of each length
+	symbol [288]uint16           //in canonical order
+}
+
+const fastBits = 9
+
+func (h *huffman) init(lengths []uint8) error {
+	*h = huffman{}
+	for _, l := range lengths {
+		h.count[l]++
+	}
+	h.count[0] = 0
+	left := 1
+	for l := 1; l < 16; l++ {
+		left = left<<1 - int(h.count[l])
+		if left < 0 {
+			return errCorrupt
+		}
+	}
+
+	var offs, next [16]int
+	code := 0
+	for l := 1; l < 16; l++ {
+		offs[l] = offs[l-1] + int(h.count[l-1])
+		code = (code + int(h.count[l-1])) << 1
+		next[l] = code
+	}
+	for sym, l := range lengths {
+		if l == 0 {
+			continue
+		}
+		h.symbol[offs[l]] = uint16(sym)
+		offs[l]++
+		c := next[l]
+		next[l]++
+		if l <= fastBits {
+			r := int(bits.Reverse16(uint16(c)) >> (16 - l))
+			for i := r; i < len(h.fast); i += 1 << l {
+				h.fast[i] = uint16(sym<<4 | int(l))
+			}
+		}
+	}
+	return nil
+}
+
+func (z *inflater) decode(h *huffman) (int, error) {
+	if z.nbits < 15 {
+		z.fill()
+	}
+	if e := h.fast[z.bits&(1<<fastBits-1)]; e != 0 {
+		if n := uint(e & 15); n <= z.nbits {
+			z.bits >>= n
+			z.nbits -= n
+			return int(e >> 4), nil
+		}
+	}
+	code, first, index := 0, 0, 0
+	for l := uint(1); l < 16 && l <= z.nbits; l++ {
+		code |= int(z.bits>>(l-1)) & 1
+		count := int(h.count[l])
+		if code-first < count {
+			z.bits >>= l
+			z.nbits -= l
+			return int(h.symbol[index+code-first]), nil
+		}
+		index += count
+		first = (first + count) << 1
+		code <<= 1
+	}
+	if z.nbits < 15 {
+		return 0, z.short()
+	}
+	return 0, errCorrupt
+}
+
+var fixedLit, fixedDist huffman
+
+func init() {
+	var l [288]uint8
+	for i := range l {
+		switch {
+		case i < 144:
+			l[i] = 8
+		case i < 256:
+			l[i] = 9
+		case i < 280:
+			l[i] = 7
+		default:
+			l[i] = 8
+		}
+	}
+	fixedLit.init(l[:])
+	for i := 0; i < 30; i++ {
+		l[i] = 5
+	}
+	fixedDist.init(l[:30])
+}
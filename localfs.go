@@ -0,0 +1,108 @@
+package main
+
+import (
+	"github.com/Zilog8/minfs"
+	"os"
+	"path/filepath"
+	"strings"
+	"sync"
+)
+
+//fdSource is a backend capability: backends whose files are real files on a
+//local filesystem can open them, which lets TCP READ replies sendfile the data
+//straight out of the page cache. Backends without it get the ReadFile path.
+type fdSource interface {
+	OpenFile(path string) (*os.File, error)
+	Stat(path string) (os.FileInfo, error)
+}
+
+//localFS is osfs plus the fdSource capability.
+type localFS struct {
+	minfs.MinFS
+	base string
+}
+
+func (l *localFS) OpenFile(path string) (*os.File, error) {
+	return os.Open(filepath.Join(l.base, filepath.FromSlash(path)))
+}
+
+//openFiles keeps files opened for sendfile around between READs, keyed by
+//path. Each get checks the path still names the same file, since it can be
+//replaced behind our back; entries are also dropped when we remove or rename.
+//The descriptor handed to C is only used until that READ's reply is sent,
+//and nothing else runs on the C thread in between, so closing on drop is safe.
+type openFiles struct {
+	lock  sync.Mutex
+	files map[string]openFile
+	max   int
+}
+
+type openFile struct {
+	f  *os.File
+	fi os.FileInfo //as of opening, to tell whether the path was replaced
+}
+
+var readfds = openFiles{files: make(map[string]openFile), max: 256}
+
+//get returns an open file for path along with its current attributes.
+func (o *openFiles) get(src fdSource, path string) (*os.File, os.FileInfo, error) {
+	cur, err := src.Stat(path)
+	if err != nil {
+		o.drop(path)
+		return nil, nil, err
+	}
+
+	o.lock.Lock()
+	defer o.lock.Unlock()
+	if of, ok := o.files[path]; ok {
+		if os.SameFile(of.fi, cur) {
+			return of.f, cur, nil
+		}
+		of.f.Close()
+		delete(o.files, path)
+	}
+
+	f, err := src.OpenFile(path)
+	if err != nil {
+		return nil, nil, err
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil, nil, err
+	}
+	if len(o.files) >= o.max {
+		for p, old := range o.files { //evict whatever the map hands us first
+			old.f.Close()
+			delete(o.files, p)
+			break
+		}
+	}
+	o.files[path] = openFile{f, fi}
+	return f, fi, nil
+}
+
+func (o *openFiles) drop(path string) {
+	o.lock.Lock()
+	if of, ok := o.files[path]; ok {
+		of.f.Close()
+		delete(o.files, path)
+	}
+	o.lock.Unlock()
+}
+
+//dropPrefix drops path and everything under it.
+func (o *openFiles) dropPrefix(dirpath string) {
+	o.lock.Lock()
+	for p, of := range o.files {
+		if p == dirpath || strings.HasPrefix(p, dirpath+"/") || dirpath == "/" {
+			of.f.Close()
+			delete(o.files, p)
+		}
+	}
+	o.lock.Unlock()
+}
+
+func (o *openFiles) closeAll() {
+	o.dropPrefix("/")
+}
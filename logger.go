@@ -0,0 +1,186 @@
+package main
+
+import (
+	"bufio"
+	"errors"
+	"fmt"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+//Log levels, least severe first.
+const (
+	levelDebug = iota
+	levelInfo
+	levelWarn
+	levelError
+)
+
+var levelNames = [...]string{"debug", "info", "warn", "error"}
+
+const (
+	logQueue = 1024 //lines waiting for the writer, past which they're dropped
+	logBurst = 20   //lines a second with the same message, past which they're suppressed
+)
+
+//logger writes lines from a goroutine of its own, so that whoever logs, the
+//dispatching thread above all, only ever queues a line and goes on. A line
+//is a message and key=value fields. A message that comes more than logBurst
+//times in a second is suppressed for the rest of it, and its next line says
+//how many were; when the queue is full, lines are dropped, and the writer
+//says how many once it has caught up.
+type logger struct {
+	level      int32
+	queue      chan logLine
+	flushes    chan chan struct{}
+	limits     sync.Map //key to *logLimit
+	dropped    int64
+	suppressed int64
+}
+
+type logLine struct {
+	at     time.Time
+	level  int
+	msg    string
+	fields []interface{} //keys and values, alternately
+}
+
+//logLimit counts lines with one key in the current second.
+type logLimit struct {
+	second, count, suppressed int64
+}
+
+var lg = newLogger()
+
+func newLogger() *logger {
+	l := &logger{level: levelInfo, queue: make(chan logLine, logQueue),
+		flushes: make(chan chan struct{})}
+	go l.run()
+	return l
+}
+
+//setLevel takes a level by name; lines below it aren't logged at all.
+func (l *logger) setLevel(name string) error {
+	for i, n := range levelNames {
+		if n == name {
+			atomic.StoreInt32(&l.level, int32(i))
+			return nil
+		}
+	}
+	return errors.New("Option loglevel must be one of " + strings.Join(levelNames[:], ", "))
+}
+
+func (l *logger) debug(msg string, kv ...interface{}) { l.log(levelDebug, msg, msg, kv) }
+func (l *logger) info(msg string, kv ...interface{})  { l.log(levelInfo, msg, msg, kv) }
+func (l *logger) warn(msg string, kv ...interface{})  { l.log(levelWarn, msg, msg, kv) }
+func (l *logger) error(msg string, kv ...interface{}) { l.log(levelError, msg, msg, kv) }
+
+//log limits the line by key, which is usually its message.
+func (l *logger) log(level int, key, msg string, kv []interface{}) {
+	if int32(level) < atomic.LoadInt32(&l.level) {
+		return
+	}
+	now := time.Now()
+	lim, ok := l.limits.Load(key)
+	if !ok {
+		lim, _ = l.limits.LoadOrStore(key, new(logLimit))
+	}
+	n := lim.(*logLimit).allow(now.Unix())
+	if n < 0 {
+		atomic.AddInt64(&l.suppressed, 1)
+		return
+	}
+	if n > 0 {
+		kv = append(kv, "suppressed", n)
+	}
+	select {
+	case l.queue <- logLine{now, level, msg, kv}:
+	default:
+		atomic.AddInt64(&l.dropped, 1)
+	}
+}
+
+//allow counts a line in second, returning -1 if it's one too many, or else
+//how many were suppressed since the last one allowed.
+func (c *logLimit) allow(second int64) int64 {
+	if s := atomic.LoadInt64(&c.second); s != second && atomic.CompareAndSwapInt64(&c.second, s, second) {
+		atomic.StoreInt64(&c.count, 0)
+	}
+	if atomic.AddInt64(&c.count, 1) > logBurst {
+		atomic.AddInt64(&c.suppressed, 1)
+		return -1
+	}
+	return atomic.SwapInt64(&c.suppressed, 0)
+}
+
+//flush returns once everything queued so far has been written out.
+func (l *logger) flush() {
+	done := make(chan struct{})
+	l.flushes <- done
+	<-done
+}
+
+func (l *logger) run() {
+	w := bufio.NewWriter(os.Stdout)
+	var b []byte
+	write := func(line logLine) {
+		b = line.format(b[:0])
+		w.Write(b)
+	}
+	reported := int64(0)
+	reportDrops := func() {
+		if d := atomic.LoadInt64(&l.dropped); d != reported {
+			write(logLine{time.Now(), levelWarn, "log queue full, lines dropped", []interface{}{"count", d - reported}})
+			reported = d
+		}
+	}
+	tick := time.NewTicker(time.Second)
+	for {
+		select {
+		case line := <-l.queue:
+			write(line)
+			if len(l.queue) == 0 {
+				w.Flush()
+			}
+		case <-tick.C:
+			reportDrops()
+			w.Flush()
+		case done := <-l.flushes:
+			for len(l.queue) > 0 {
+				write(<-l.queue)
+			}
+			reportDrops()
+			w.Flush()
+			close(done)
+		}
+	}
+}
+
+//format appends the line to b, as a time, level, message and fields.
+func (line *logLine) format(b []byte) []byte {
+	b = line.at.AppendFormat(b, "2006-01-02 15:04:05.000000 ")
+	b = append(b, levelNames[line.level]...)
+	b = append(b, ' ')
+	b = append(b, line.msg...)
+	for i := 0; i+1 < len(line.fields); i += 2 {
+		b = append(b, ' ')
+		b = append(b, fmt.Sprint(line.fields[i])...)
+		b = append(b, '=')
+		v := fmt.Sprint(line.fields[i+1])
+		if v == "" || strings.ContainsAny(v, " \t\n\"=\\") {
+			b = strconv.AppendQuote(b, v)
+		} else {
+			b = append(b, v...)
+		}
+	}
+	return append(b, '\n')
+}
+
+//counts is how many lines were suppressed and dropped so far.
+func (l *logger) counts() (suppressed, dropped int64) {
+	return atomic.LoadInt64(&l.suppressed), atomic.LoadInt64(&l.dropped)
+}
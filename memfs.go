@@ -0,0 +1,352 @@
+package main
+
+import (
+	"errors"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	pathpkg "path"
+	"sort"
+	"sync"
+	"time"
+)
+
+//memFS keeps a whole filesystem in memory, for measuring the NFS layer
+//without a backend's own costs in the way, and for scratch exports. Paths
+//are looked up in a sync.Map, so the READs, WRITEs and GETATTRs that make up
+//most traffic never wait on a shared lock. Only changes to the tree (create,
+//remove, rename) take tree, which also guards each directory's list of
+//children. File data is kept in memChunk pieces allocated as they're first
+//written and looked up by index, so growing files don't copy what they
+//already have, holes cost nothing however far they reach, and each file has
+//its own lock for its data.
+type memFS struct {
+	nodes sync.Map //path -> *memNode
+	tree  sync.RWMutex
+}
+
+type memNode struct {
+	lock   sync.RWMutex //data, size, mode and mtime
+	name   string
+	dir    bool
+	mode   os.FileMode
+	mtime  time.Time
+	size   int64
+	chunks map[int64]*memChunk //by index, missing for holes
+
+	children map[string]*memNode //of a directory, guarded by memFS.tree
+}
+
+const memChunkSize = 64 * 1024
+
+type memChunk [memChunkSize]byte
+
+var errNotEmpty = errors.New("directory not empty")
+
+//config example:   -mem
+func memfsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) > 0 {
+		return nil, errors.New("-mem takes no arguments")
+	}
+	return newMemFS(), nil
+}
+
+func newMemFS() *memFS {
+	m := &memFS{}
+	m.nodes.Store("/", &memNode{name: "/", dir: true, mode: os.ModeDir | 0755,
+		mtime: time.Now(), children: make(map[string]*memNode)})
+	return m
+}
+
+func (m *memFS) node(path string) (*memNode, error) {
+	if n, ok := m.nodes.Load(path); ok {
+		return n.(*memNode), nil
+	}
+	return nil, os.ErrNotExist
+}
+
+func (m *memFS) file(path string) (*memNode, error) {
+	n, err := m.node(path)
+	if err == nil && n.dir {
+		return nil, os.ErrInvalid
+	}
+	return n, err
+}
+
+func (m *memFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	n, err := m.file(path)
+	if err != nil {
+		return 0, err
+	}
+	n.lock.RLock()
+	defer n.lock.RUnlock()
+	if off >= n.size {
+		return 0, io.EOF
+	}
+	want := len(b)
+	if int64(want) > n.size-off {
+		b = b[:n.size-off]
+	}
+	for done := 0; done < len(b); {
+		pos := off + int64(done)
+		i, o := pos/memChunkSize, pos%memChunkSize
+		var k int
+		if c := n.chunks[i]; c != nil {
+			k = copy(b[done:], c[o:])
+		} else {
+			k = zero(b[done:], memChunkSize-int(o))
+		}
+		done += k
+	}
+	if len(b) < want {
+		return len(b), io.EOF
+	}
+	return len(b), nil
+}
+
+//zero clears up to n bytes at the start of b, returning how many.
+func zero(b []byte, n int) int {
+	if n > len(b) {
+		n = len(b)
+	}
+	for i := range b[:n] {
+		b[i] = 0
+	}
+	return n
+}
+
+func (m *memFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	n, err := m.file(path)
+	if err != nil {
+		return 0, err
+	}
+	if off < 0 {
+		return 0, os.ErrInvalid
+	}
+	n.lock.Lock()
+	defer n.lock.Unlock()
+	end := off + int64(len(b))
+	if n.chunks == nil {
+		n.chunks = make(map[int64]*memChunk)
+	}
+	for done := 0; done < len(b); {
+		pos := off + int64(done)
+		c := n.chunks[pos/memChunkSize]
+		if c == nil {
+			c = new(memChunk)
+			n.chunks[pos/memChunkSize] = c
+		}
+		done += copy(c[pos%memChunkSize:], b[done:])
+	}
+	if end > n.size {
+		n.size = end
+	}
+	n.mtime = time.Now()
+	return len(b), nil
+}
+
+//truncate sets the file's size, dropping or zeroing what's past it.
+func (n *memNode) truncate(size int64) {
+	if size < n.size {
+		keep := (size + memChunkSize - 1) / memChunkSize
+		for i := range n.chunks {
+			if i >= keep {
+				delete(n.chunks, i)
+			}
+		}
+		if c := n.chunks[keep-1]; size%memChunkSize != 0 && c != nil {
+			zero(c[size%memChunkSize:], memChunkSize)
+		}
+	}
+	n.size = size
+}
+
+//add puts a new node at path, which mustn't exist yet.
+func (m *memFS) add(path string, n *memNode) error {
+	m.tree.Lock()
+	defer m.tree.Unlock()
+	parent, err := m.node(pathpkg.Dir(path))
+	if err != nil {
+		return err
+	}
+	if !parent.dir {
+		return os.ErrInvalid
+	}
+	if _, ok := parent.children[n.name]; ok {
+		return os.ErrExist
+	}
+	parent.children[n.name] = n
+	m.nodes.Store(path, n)
+	parent.touch()
+	return nil
+}
+
+func (n *memNode) touch() {
+	n.lock.Lock()
+	n.mtime = time.Now()
+	n.lock.Unlock()
+}
+
+func (m *memFS) CreateFile(path string) error {
+	return m.add(path, &memNode{name: pathpkg.Base(path), mode: 0644, mtime: time.Now()})
+}
+
+func (m *memFS) CreateDirectory(path string) error {
+	return m.add(path, &memNode{name: pathpkg.Base(path), dir: true, mode: os.ModeDir | 0755,
+		mtime: time.Now(), children: make(map[string]*memNode)})
+}
+
+func (m *memFS) Remove(path string) error {
+	if path == "/" {
+		return os.ErrPermission
+	}
+	m.tree.Lock()
+	defer m.tree.Unlock()
+	n, err := m.node(path)
+	if err != nil {
+		return err
+	}
+	if n.dir && len(n.children) > 0 {
+		return errNotEmpty
+	}
+	parent, _ := m.node(pathpkg.Dir(path))
+	delete(parent.children, n.name)
+	m.nodes.Delete(path)
+	parent.touch()
+	return nil
+}
+
+//Move renames like rename(2): a file replaces any file at newpath, and a
+//directory any empty directory.
+func (m *memFS) Move(oldpath string, newpath string) error {
+	if oldpath == "/" || newpath == "/" {
+		return os.ErrPermission
+	}
+	if oldpath == newpath {
+		return nil
+	}
+	m.tree.Lock()
+	defer m.tree.Unlock()
+	n, err := m.node(oldpath)
+	if err != nil {
+		return err
+	}
+	if n.dir && len(newpath) > len(oldpath) && newpath[:len(oldpath)+1] == oldpath+"/" {
+		return os.ErrInvalid //into itself
+	}
+	to, err := m.node(pathpkg.Dir(newpath))
+	if err != nil {
+		return err
+	}
+	if !to.dir {
+		return os.ErrInvalid
+	}
+	name := pathpkg.Base(newpath)
+	if old, ok := to.children[name]; ok {
+		switch {
+		case old.dir != n.dir:
+			return os.ErrExist
+		case old.dir && len(old.children) > 0:
+			return errNotEmpty
+		}
+	}
+
+	from, _ := m.node(pathpkg.Dir(oldpath))
+	delete(from.children, n.name)
+	m.rekey(oldpath, newpath, n)
+	n.lock.Lock()
+	n.name = name
+	n.lock.Unlock()
+	to.children[name] = n
+	from.touch()
+	to.touch()
+	return nil
+}
+
+//rekey moves n, and everything under it, from oldpath to newpath in nodes.
+func (m *memFS) rekey(oldpath, newpath string, n *memNode) {
+	m.nodes.Delete(oldpath)
+	m.nodes.Store(newpath, n)
+	for name, c := range n.children {
+		m.rekey(oldpath+"/"+name, newpath+"/"+name, c)
+	}
+}
+
+func (m *memFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	m.tree.RLock()
+	defer m.tree.RUnlock()
+	n, err := m.node(path)
+	if err != nil {
+		return nil, err
+	}
+	if !n.dir {
+		return nil, os.ErrInvalid
+	}
+	list := make([]os.FileInfo, 0, len(n.children))
+	for _, c := range n.children {
+		list = append(list, c.info())
+	}
+	//READDIR cookies are positions in the list, so keep it in a fixed order
+	sort.Slice(list, func(i, j int) bool { return list[i].Name() < list[j].Name() })
+	return list, nil
+}
+
+func (m *memFS) Stat(path string) (os.FileInfo, error) {
+	n, err := m.node(path)
+	if err != nil {
+		return nil, err
+	}
+	return n.info(), nil
+}
+
+//info snapshots n as a zipInfo, which is all an os.FileInfo needs.
+func (n *memNode) info() os.FileInfo {
+	n.lock.RLock()
+	defer n.lock.RUnlock()
+	return &zipInfo{n.name, n.size, n.mode, n.mtime}
+}
+
+func (m *memFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	return nil, os.ErrInvalid
+}
+
+func (m *memFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	n, err := m.node(path)
+	if err != nil {
+		return err
+	}
+	n.lock.Lock()
+	defer n.lock.Unlock()
+	switch attribute {
+	case "mode":
+		mode, ok := newvalue.(os.FileMode)
+		if !ok {
+			return os.ErrInvalid
+		}
+		n.mode = n.mode&os.ModeDir | mode&os.ModePerm
+	case "size":
+		size, ok := newvalue.(int64)
+		if !ok || size < 0 || n.dir {
+			return os.ErrInvalid
+		}
+		n.truncate(size)
+		n.mtime = time.Now()
+	case "modtime":
+		mtime, ok := newvalue.(time.Time)
+		if !ok {
+			return os.ErrInvalid
+		}
+		n.mtime = mtime
+	default:
+		return os.ErrInvalid
+	}
+	return nil
+}
+
+func (m *memFS) String() string {
+	return "mem"
+}
+
+func (m *memFS) Close() error {
+	return nil
+}
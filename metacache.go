@@ -0,0 +1,293 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"github.com/Zilog8/minfs"
+	"os"
+	pathpkg "path"
+	"strings"
+	"sync"
+	"time"
+)
+
+//Metadata cache for -shim: Stat and ReadDirectory results are kept for a
+//TTL that depends on the path. Once an entry has expired it's still served
+//for up to stale longer, while a background refresh fetches the real thing,
+//so GETATTR and LOOKUP don't wait on the remote side just because a timer ran
+//out. A refresh that fails keeps the old entry until it's too stale to use.
+//Changes made through the cache invalidate what they touch.
+type metaCache struct {
+	minfs.MinFS
+	rules   []ttlRule //first match wins
+	dirTTL  time.Duration
+	fileTTL time.Duration
+	stale   time.Duration
+
+	lock       *sync.Mutex
+	attrs      map[string]*statEntry
+	dirs       map[string]*dirEntry
+	gen        uint64 //bumped by every invalidation, so late fetches don't undo one
+	refreshing map[string]bool
+	slots      chan bool //limits background refreshes in flight
+
+	hits, staleHits, misses, refreshes int64
+}
+
+//ttlRule gives paths matching pattern their own TTL. Patterns with a
+//slash are matched against the whole path, others against the last element.
+type ttlRule struct {
+	pattern string
+	ttl     time.Duration
+}
+
+type statEntry struct {
+	fi  os.FileInfo
+	err error //only ever nil or os.ErrNotExist
+	at  time.Time
+}
+
+type dirEntry struct {
+	list []os.FileInfo
+	at   time.Time
+}
+
+const metaRefreshers = 8
+
+func newMetaCache(sub minfs.MinFS) *metaCache {
+	return &metaCache{MinFS: sub,
+		dirTTL:     5 * time.Second,
+		fileTTL:    5 * time.Second,
+		stale:      time.Minute,
+		lock:       new(sync.Mutex),
+		attrs:      make(map[string]*statEntry),
+		dirs:       make(map[string]*dirEntry),
+		refreshing: make(map[string]bool),
+		slots:      make(chan bool, metaRefreshers)}
+}
+
+//setTTL takes one "class=duration" shim argument: dir, file, stale, or a
+//path pattern.
+func (m *metaCache) setTTL(arg string) error {
+	kv := strings.SplitN(arg, "=", 2)
+	if len(kv) != 2 {
+		return errors.New("-shim TTL not in class=duration form: " + arg)
+	}
+	d, err := time.ParseDuration(kv[1])
+	if err != nil || d < 0 {
+		return errors.New("-shim TTL needs a duration like 30s or 5m: " + arg)
+	}
+	switch kv[0] {
+	case "dir":
+		m.dirTTL = d
+	case "file":
+		m.fileTTL = d
+	case "stale":
+		m.stale = d
+	default:
+		if _, err := pathpkg.Match(kv[0], ""); err != nil {
+			return errors.New("-shim TTL has a bad path pattern: " + kv[0])
+		}
+		m.rules = append(m.rules, ttlRule{kv[0], d})
+	}
+	return nil
+}
+
+func (m *metaCache) ttl(path string, isDir bool) time.Duration {
+	for _, r := range m.rules {
+		name := path
+		if !strings.Contains(r.pattern, "/") {
+			name = pathpkg.Base(path)
+		}
+		if ok, _ := pathpkg.Match(r.pattern, name); ok {
+			return r.ttl
+		}
+	}
+	if isDir {
+		return m.dirTTL
+	}
+	return m.fileTTL
+}
+
+//refresh runs fetch in the background unless one for key is already going.
+//Caller holds m.lock.
+func (m *metaCache) refresh(key string, fetch func()) {
+	if m.refreshing[key] {
+		return
+	}
+	m.refreshing[key] = true
+	m.refreshes++
+	go func() {
+		m.slots <- true
+		fetch()
+		<-m.slots
+		m.lock.Lock()
+		delete(m.refreshing, key)
+		m.lock.Unlock()
+	}()
+}
+
+func (m *metaCache) Stat(path string) (os.FileInfo, error) {
+	m.lock.Lock()
+	if e, ok := m.attrs[path]; ok {
+		age := time.Since(e.at)
+		ttl := m.ttl(path, e.fi != nil && e.fi.IsDir())
+		if age < ttl {
+			m.hits++
+			m.lock.Unlock()
+			return e.fi, e.err
+		}
+		if age < ttl+m.stale {
+			m.staleHits++
+			m.refresh("s"+path, func() { m.fetchStat(path) })
+			m.lock.Unlock()
+			return e.fi, e.err
+		}
+	}
+	m.misses++
+	m.lock.Unlock()
+	return m.fetchStat(path)
+}
+
+func (m *metaCache) fetchStat(path string) (os.FileInfo, error) {
+	m.lock.Lock()
+	gen := m.gen
+	m.lock.Unlock()
+
+	fi, err := m.MinFS.Stat(path)
+	if err == nil || err == os.ErrNotExist {
+		m.lock.Lock()
+		if m.gen == gen {
+			m.attrs[path] = &statEntry{fi, err, time.Now()}
+		}
+		m.lock.Unlock()
+	}
+	return fi, err
+}
+
+func (m *metaCache) ReadDirectory(path string) ([]os.FileInfo, error) {
+	m.lock.Lock()
+	if e, ok := m.dirs[path]; ok {
+		age := time.Since(e.at)
+		ttl := m.ttl(path, true)
+		if age < ttl {
+			m.hits++
+			m.lock.Unlock()
+			return e.list, nil
+		}
+		if age < ttl+m.stale {
+			m.staleHits++
+			m.refresh("d"+path, func() { m.fetchDir(path) })
+			m.lock.Unlock()
+			return e.list, nil
+		}
+	}
+	m.misses++
+	m.lock.Unlock()
+	return m.fetchDir(path)
+}
+
+//fetchDir lists path, and takes the opportunity to fill in its entries' stats.
+func (m *metaCache) fetchDir(path string) ([]os.FileInfo, error) {
+	m.lock.Lock()
+	gen := m.gen
+	m.lock.Unlock()
+
+	list, err := m.MinFS.ReadDirectory(path)
+	if err != nil {
+		return list, err
+	}
+	m.lock.Lock()
+	if m.gen == gen {
+		now := time.Now()
+		m.dirs[path] = &dirEntry{list, now}
+		for _, fi := range list {
+			m.attrs[pathpkg.Join(path, fi.Name())] = &statEntry{fi, nil, now}
+		}
+	}
+	m.lock.Unlock()
+	return list, nil
+}
+
+//invalidate forgets path and its parent's listing.
+func (m *metaCache) invalidate(path string) {
+	m.lock.Lock()
+	m.gen++
+	delete(m.dirs, pathpkg.Dir(path))
+	delete(m.attrs, path)
+	delete(m.dirs, path)
+	m.lock.Unlock()
+}
+
+//invalidateTree is invalidate for everything under path too.
+func (m *metaCache) invalidateTree(path string) {
+	m.lock.Lock()
+	m.gen++
+	delete(m.dirs, pathpkg.Dir(path))
+	for p := range m.attrs {
+		if p == path || strings.HasPrefix(p, path+"/") || path == "/" {
+			delete(m.attrs, p)
+		}
+	}
+	for p := range m.dirs {
+		if p == path || strings.HasPrefix(p, path+"/") || path == "/" {
+			delete(m.dirs, p)
+		}
+	}
+	m.lock.Unlock()
+}
+
+func (m *metaCache) WriteFile(path string, b []byte, off int64) (int, error) {
+	n, err := m.MinFS.WriteFile(path, b, off)
+	m.invalidate(path)
+	return n, err
+}
+
+func (m *metaCache) CreateFile(path string) error {
+	err := m.MinFS.CreateFile(path)
+	m.invalidate(path)
+	return err
+}
+
+func (m *metaCache) CreateDirectory(path string) error {
+	err := m.MinFS.CreateDirectory(path)
+	m.invalidate(path)
+	return err
+}
+
+func (m *metaCache) Remove(path string) error {
+	err := m.MinFS.Remove(path)
+	m.invalidate(path)
+	return err
+}
+
+func (m *metaCache) Move(oldpath, newpath string) error {
+	err := m.MinFS.Move(oldpath, newpath)
+	m.invalidateTree(oldpath)
+	m.invalidateTree(newpath)
+	return err
+}
+
+func (m *metaCache) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	err := m.MinFS.SetAttribute(path, attribute, newvalue)
+	m.invalidate(path)
+	return err
+}
+
+func (m *metaCache) String() string {
+	return "shim(" + m.MinFS.String() + ")"
+}
+
+func (m *metaCache) stats() string {
+	m.lock.Lock()
+	defer m.lock.Unlock()
+	return fmt.Sprintf("Metadata cache: %d hits, %d served stale, %d misses, %d background refreshes",
+		m.hits, m.staleHits, m.misses, m.refreshes)
+}
+
+//lookups counts stale hits as hits, since they were answered from memory.
+func (m *metaCache) lookups() (hits, misses int64) {
+	m.lock.Lock()
+	defer m.lock.Unlock()
+	return m.hits + m.staleHits, m.misses
+}
@@ -0,0 +1,248 @@
+package main
+
+//#include "unfs3/daemon.h"
+import "C"
+import (
+	"fmt"
+	"github.com/Zilog8/minfs"
+	"io"
+	"math/bits"
+	"os"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+//procStats is what the dispatchers have counted for one procedure (see
+//unfs3/metrics.c), added up over every thread.
+type procStats struct {
+	program  string //"nfs" or "mount"
+	name     string
+	calls    uint64
+	garbage  uint64 //calls whose arguments wouldn't decode
+	bytesIn  uint64
+	bytesOut uint64
+	total    time.Duration
+	inGo     time.Duration //of total, spent in Go exports
+	statuses map[string]uint64
+	hist     []uint64 //latency, bucketed as bucketLow says
+}
+
+//readProcStats returns the procedures that have been called at all.
+func readProcStats() []procStats {
+	var procs [C.METRICS_PROCS]C.struct_metrics_proc
+	C.metrics_read(&procs[0])
+	var list []procStats
+	for i := range procs {
+		p := &procs[i]
+		if p.calls == 0 && p.garbage == 0 {
+			continue
+		}
+		s := procStats{program: "nfs", name: C.GoString(C.metrics_proc_name(C.int(i))),
+			calls: uint64(p.calls), garbage: uint64(p.garbage),
+			bytesIn: uint64(p.bytes_in), bytesOut: uint64(p.bytes_out),
+			total: time.Duration(p.ns), inGo: time.Duration(p.go_ns),
+			statuses: make(map[string]uint64),
+			hist:     make([]uint64, C.METRICS_BUCKETS)}
+		if i >= C.METRICS_MOUNT {
+			s.program = "mount"
+		}
+		for j, n := range p.status {
+			if n > 0 {
+				s.statuses[C.GoString(C.metrics_status_name(C.int(j)))] = uint64(n)
+			}
+		}
+		for j, n := range p.hist {
+			s.hist[j] = uint64(n)
+		}
+		list = append(list, s)
+	}
+	return list
+}
+
+//bucketLow is the shortest latency that goes in histogram bucket i.
+func bucketLow(i int) time.Duration {
+	return time.Duration(C.metrics_bucket_low(C.int(i)))
+}
+
+//errors counts the calls that ended in anything but OK.
+func (s *procStats) errors() uint64 {
+	n := uint64(0)
+	for status, k := range s.statuses {
+		if status != "NFS3_OK" {
+			n += k
+		}
+	}
+	return n
+}
+
+//quantile estimates the latency q of the calls were faster than, to within
+//a histogram bucket.
+func (s *procStats) quantile(q float64) time.Duration {
+	want := uint64(q*float64(s.calls) + 0.5)
+	seen := uint64(0)
+	for i, n := range s.hist {
+		seen += n
+		if n > 0 && seen >= want {
+			if i+1 < len(s.hist) {
+				return bucketLow(i + 1)
+			}
+			return bucketLow(i)
+		}
+	}
+	return 0
+}
+
+func callStats() string {
+	var b strings.Builder
+	b.WriteString("Calls:")
+	for _, s := range readProcStats() {
+		fmt.Fprintf(&b, "\n  %s %s: %d calls, %d errors, %d undecodable, %d bytes in, %d out; "+
+			"p50 %v, p99 %v, %v avg in C and %v in Go",
+			s.program, s.name, s.calls, s.errors(), s.garbage, s.bytesIn, s.bytesOut,
+			s.quantile(0.5), s.quantile(0.99),
+			avg(s.total-s.inGo, s.calls), avg(s.inGo, s.calls))
+	}
+	return b.String()
+}
+
+func avg(d time.Duration, n uint64) time.Duration {
+	if n == 0 {
+		return 0
+	}
+	return d / time.Duration(n)
+}
+
+//timedFS times every call into the backend, by method, for the metrics
+//listener. It only sits in front of the backend while that's on, and
+//anything that needs to know what the backend can do looks at backend
+//instead, since timedFS has only the MinFS methods.
+type timedFS struct {
+	minfs.MinFS
+	name string //bind type, without the dash
+	ops  [opCount]opTimes
+}
+
+type opTimes struct {
+	calls, errors, ns int64
+	hist              [latencyBuckets]int64
+}
+
+const (
+	opReadFile = iota
+	opWriteFile
+	opCreateFile
+	opRemove
+	opMove
+	opReadDirectory
+	opCreateDirectory
+	opGetAttribute
+	opSetAttribute
+	opStat
+	opCount
+)
+
+var opNames = [opCount]string{"ReadFile", "WriteFile", "CreateFile", "Remove", "Move",
+	"ReadDirectory", "CreateDirectory", "GetAttribute", "SetAttribute", "Stat"}
+
+//Latencies the metrics listener reports are bucketed by powers of two from
+//1024ns (about 1us) to 2^35ns (about 34s), then everything longer.
+const (
+	latencyMinShift = 10
+	latencyBuckets  = 27
+)
+
+//latencyBucket is the bucket of a call that took d.
+func latencyBucket(d time.Duration) int {
+	i := bits.Len64(uint64(d) >> latencyMinShift)
+	if i >= latencyBuckets {
+		i = latencyBuckets - 1
+	}
+	return i
+}
+
+//latencyBound is the upper bound of bucket i, but for the last.
+func latencyBound(i int) time.Duration {
+	return time.Duration(1) << (latencyMinShift + i)
+}
+
+func (t *timedFS) done(op int, start time.Time, err error) {
+	d := time.Since(start)
+	o := &t.ops[op]
+	atomic.AddInt64(&o.calls, 1)
+	atomic.AddInt64(&o.ns, int64(d))
+	atomic.AddInt64(&o.hist[latencyBucket(d)], 1)
+	if err != nil && err != io.EOF {
+		atomic.AddInt64(&o.errors, 1)
+	}
+}
+
+func (t *timedFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	start := time.Now()
+	n, err := t.MinFS.ReadFile(path, b, off)
+	t.done(opReadFile, start, err)
+	return n, err
+}
+
+func (t *timedFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	start := time.Now()
+	n, err := t.MinFS.WriteFile(path, b, off)
+	t.done(opWriteFile, start, err)
+	return n, err
+}
+
+func (t *timedFS) CreateFile(path string) error {
+	start := time.Now()
+	err := t.MinFS.CreateFile(path)
+	t.done(opCreateFile, start, err)
+	return err
+}
+
+func (t *timedFS) Remove(path string) error {
+	start := time.Now()
+	err := t.MinFS.Remove(path)
+	t.done(opRemove, start, err)
+	return err
+}
+
+func (t *timedFS) Move(oldpath string, newpath string) error {
+	start := time.Now()
+	err := t.MinFS.Move(oldpath, newpath)
+	t.done(opMove, start, err)
+	return err
+}
+
+func (t *timedFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	start := time.Now()
+	list, err := t.MinFS.ReadDirectory(path)
+	t.done(opReadDirectory, start, err)
+	return list, err
+}
+
+func (t *timedFS) CreateDirectory(path string) error {
+	start := time.Now()
+	err := t.MinFS.CreateDirectory(path)
+	t.done(opCreateDirectory, start, err)
+	return err
+}
+
+func (t *timedFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	start := time.Now()
+	v, err := t.MinFS.GetAttribute(path, attribute)
+	t.done(opGetAttribute, start, err)
+	return v, err
+}
+
+func (t *timedFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	start := time.Now()
+	err := t.MinFS.SetAttribute(path, attribute, newvalue)
+	t.done(opSetAttribute, start, err)
+	return err
+}
+
+func (t *timedFS) Stat(path string) (os.FileInfo, error) {
+	start := time.Now()
+	fi, err := t.MinFS.Stat(path)
+	t.done(opStat, start, err)
+	return fi, err
+}
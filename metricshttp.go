@@ -0,0 +1,235 @@
+package main
+
+//#include "unfs3/daemon.h"
+import "C"
+import (
+	"bufio"
+	"fmt"
+	"net"
+	"net/http"
+	"net/http/pprof"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+//serveMetrics starts the HTTP listener asked for with -o http=: Prometheus
+//text at /metrics, and Go's profiles under /debug/pprof/. A bare port
+//listens on loopback only.
+func serveMetrics(addr string) error {
+	if _, err := strconv.Atoi(addr); err == nil {
+		addr = "127.0.0.1:" + addr
+	}
+	l, err := net.Listen("tcp", addr)
+	if err != nil {
+		return err
+	}
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", writeMetrics)
+	mux.HandleFunc("/debug/pprof/", pprof.Index)
+	mux.HandleFunc("/debug/pprof/cmdline", pprof.Cmdline)
+	mux.HandleFunc("/debug/pprof/profile", pprof.Profile)
+	mux.HandleFunc("/debug/pprof/symbol", pprof.Symbol)
+	mux.HandleFunc("/debug/pprof/trace", pprof.Trace)
+	go func() {
+		err := http.Serve(l, mux)
+		lg.error("metrics listener stopped", "err", err)
+	}()
+	lg.info("serving metrics and profiles", "addr", l.Addr())
+	return nil
+}
+
+//promWriter writes the Prometheus text format, a family at a time.
+type promWriter struct {
+	*bufio.Writer
+}
+
+func (p promWriter) family(name, kind, help string) {
+	fmt.Fprintf(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+}
+
+func (p promWriter) sample(name, labels string, v float64) {
+	if labels != "" {
+		labels = "{" + labels + "}"
+	}
+	fmt.Fprintf(p, "%s%s %s\n", name, labels, strconv.FormatFloat(v, 'g', -1, 64))
+}
+
+//histogram writes one series of a histogram family from cumulative bucket
+//counts, the last of which is everything.
+func (p promWriter) histogram(name, labels string, cumulative []uint64, sum time.Duration) {
+	for i, n := range cumulative[:len(cumulative)-1] {
+		p.sample(name+"_bucket", labels+`,le="`+
+			strconv.FormatFloat(latencyBound(i).Seconds(), 'g', -1, 64)+`"`, float64(n))
+	}
+	count := float64(cumulative[len(cumulative)-1])
+	p.sample(name+"_bucket", labels+`,le="+Inf"`, count)
+	p.sample(name+"_sum", labels, sum.Seconds())
+	p.sample(name+"_count", labels, count)
+}
+
+//cumulative regroups one of the dispatchers' histograms into the buckets
+//timedFS uses, whose bounds fall on its bucket boundaries.
+func (s *procStats) cumulative() []uint64 {
+	out := make([]uint64, latencyBuckets)
+	seen, j := uint64(0), 0
+	for i := range out[:latencyBuckets-1] {
+		for j+1 < len(s.hist) && bucketLow(j+1) <= latencyBound(i) {
+			seen += s.hist[j]
+			j++
+		}
+		out[i] = seen
+	}
+	out[latencyBuckets-1] = s.calls
+	return out
+}
+
+//cacheCounter is a cache we can report hits and misses for.
+type cacheCounter interface {
+	lookups() (hits, misses int64)
+}
+
+//caches finds the backend's caches, by name.
+func caches() map[string]cacheCounter {
+	found := make(map[string]cacheCounter)
+	switch b := backend.(type) {
+	case *blockCache:
+		found["block"] = b
+		if mc, ok := b.MinFS.(*metaCache); ok {
+			found["metadata"] = mc
+		}
+	case *metaCache:
+		found["metadata"] = b
+	case *zipFS:
+		found["chunk"] = b.cache
+	case *tarFS:
+		if b.cache != nil {
+			found["chunk"] = b.cache
+		}
+	case *overlayFS:
+		found["overlay"] = b
+	}
+	return found
+}
+
+func label(name, value string) string {
+	return name + `="` + strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`).Replace(value) + `"`
+}
+
+func writeMetrics(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+	p := promWriter{bufio.NewWriter(w)}
+	defer p.Flush()
+
+	procs := readProcStats()
+	p.family("unfs2go_calls_total", "counter", "Calls handled, by procedure.")
+	for _, s := range procs {
+		p.sample("unfs2go_calls_total", label("program", s.program)+","+label("proc", s.name), float64(s.calls))
+	}
+	p.family("unfs2go_replies_total", "counter", "Replies, by procedure and status.")
+	for _, s := range procs {
+		for status, n := range s.statuses {
+			p.sample("unfs2go_replies_total", label("program", s.program)+","+label("proc", s.name)+
+				","+label("status", status), float64(n))
+		}
+	}
+	p.family("unfs2go_undecodable_calls_total", "counter", "Calls whose arguments wouldn't decode.")
+	for _, s := range procs {
+		p.sample("unfs2go_undecodable_calls_total", label("program", s.program)+","+label("proc", s.name), float64(s.garbage))
+	}
+	p.family("unfs2go_received_bytes_total", "counter", "Bytes of calls, whole records on TCP, arguments on UDP.")
+	for _, s := range procs {
+		p.sample("unfs2go_received_bytes_total", label("program", s.program)+","+label("proc", s.name), float64(s.bytesIn))
+	}
+	p.family("unfs2go_sent_bytes_total", "counter", "Bytes of replies, whole records on TCP, results on UDP.")
+	for _, s := range procs {
+		p.sample("unfs2go_sent_bytes_total", label("program", s.program)+","+label("proc", s.name), float64(s.bytesOut))
+	}
+	p.family("unfs2go_call_duration_seconds", "histogram", "Time from decoding a call to sending its reply.")
+	for _, s := range procs {
+		p.histogram("unfs2go_call_duration_seconds", label("program", s.program)+","+label("proc", s.name),
+			s.cumulative(), s.total)
+	}
+	p.family("unfs2go_call_go_seconds_total", "counter", "Of call time, the part spent calling Go exports, cgo crossings included.")
+	for _, s := range procs {
+		p.sample("unfs2go_call_go_seconds_total", label("program", s.program)+","+label("proc", s.name), s.inGo.Seconds())
+	}
+	p.family("unfs2go_calls_in_flight", "gauge", "Calls being handled.")
+	p.sample("unfs2go_calls_in_flight", "", float64(C.metrics_in_flight()))
+
+	if t, ok := ns.(*timedFS); ok {
+		b := label("backend", t.name)
+		p.family("unfs2go_backend_call_duration_seconds", "histogram", "Time spent in calls into the backend.")
+		for op := range t.ops {
+			o := &t.ops[op]
+			cumulative := make([]uint64, latencyBuckets)
+			seen := uint64(0)
+			for i := range o.hist {
+				seen += uint64(atomic.LoadInt64(&o.hist[i]))
+				cumulative[i] = seen
+			}
+			p.histogram("unfs2go_backend_call_duration_seconds", b+","+label("op", opNames[op]),
+				cumulative, time.Duration(atomic.LoadInt64(&o.ns)))
+		}
+		p.family("unfs2go_backend_errors_total", "counter", "Backend calls that failed, but for EOF.")
+		for op := range t.ops {
+			p.sample("unfs2go_backend_errors_total", b+","+label("op", opNames[op]),
+				float64(atomic.LoadInt64(&t.ops[op].errors)))
+		}
+	}
+
+	if wgather != nil {
+		for _, c := range []struct {
+			name, help string
+			n          *int64
+		}{
+			{"writes_in", "Client UNSTABLE writes gathered.", &wgather.writesIn},
+			{"bytes_in", "Bytes of client writes gathered.", &wgather.bytesIn},
+			{"writes_out", "Backend writes the gathered data went out as.", &wgather.writesOut},
+			{"bytes_out", "Bytes written out to the backend.", &wgather.bytesOut},
+			{"verifier_changes", "Write verifier changes after a gathered flush failed.", &wgather.verfRegen},
+			{"resends", "Client writes landing on ranges lost to a failed flush.", &wgather.resends},
+		} {
+			name := "unfs2go_write_gather_" + c.name + "_total"
+			p.family(name, "counter", c.help)
+			p.sample(name, "", float64(atomic.LoadInt64(c.n)))
+		}
+	}
+
+	fddb.FDlistLock.RLock()
+	paths := len(fddb.PathMapA)
+	fddb.FDlistLock.RUnlock()
+	p.family("unfs2go_file_ids", "gauge", "Paths given file IDs so far.")
+	p.sample("unfs2go_file_ids", "", float64(paths))
+
+	suppressed, dropped := lg.counts()
+	p.family("unfs2go_log_lines_suppressed_total", "counter", "Log lines over the rate limit for their message.")
+	p.sample("unfs2go_log_lines_suppressed_total", "", float64(suppressed))
+	p.family("unfs2go_log_lines_dropped_total", "counter", "Log lines that found the queue full.")
+	p.sample("unfs2go_log_lines_dropped_total", "", float64(dropped))
+
+	type looked struct {
+		name         string
+		hits, misses int64
+	}
+	var found []looked
+	for name, c := range caches() {
+		hits, misses := c.lookups()
+		found = append(found, looked{name, hits, misses})
+	}
+	p.family("unfs2go_cache_hits_total", "counter", "Lookups answered from a cache.")
+	for _, c := range found {
+		p.sample("unfs2go_cache_hits_total", label("cache", c.name), float64(c.hits))
+	}
+	p.family("unfs2go_cache_misses_total", "counter", "Lookups a cache couldn't answer.")
+	for _, c := range found {
+		p.sample("unfs2go_cache_misses_total", label("cache", c.name), float64(c.misses))
+	}
+	p.family("unfs2go_cache_hit_ratio", "gauge", "Share of all lookups so far answered from a cache.")
+	for _, c := range found {
+		if c.hits+c.misses > 0 {
+			p.sample("unfs2go_cache_hit_ratio", label("cache", c.name), float64(c.hits)/float64(c.hits+c.misses))
+		}
+	}
+}
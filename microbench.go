@@ -0,0 +1,50 @@
+//go:build microbench
+
+package main
+
+//#include <stdlib.h>
+//#include "unfs3/daemon.h"
+//#include "unfs3/microbench.h"
+//#include "unfs3/microbench.c"
+import "C"
+import "unsafe"
+
+//The XDR routines unfs3/microbench.c times, for microbench_test.go, which
+//can't use cgo itself. Like the C it builds, this is only there with the
+//microbench tag, so the server doesn't carry it.
+const (
+	benchFattr3      = C.MICROBENCH_FATTR3
+	benchRead3res    = C.MICROBENCH_READ3RES
+	benchReaddir3res = C.MICROBENCH_READDIR3RES
+	benchWrite3args  = C.MICROBENCH_WRITE3ARGS
+	benchLookup3args = C.MICROBENCH_LOOKUP3ARGS
+)
+
+//microbenchXDR runs one of them n times over in C, so that what's timed is
+//the routine rather than a cgo call per run, returning the bytes each run
+//encodes or decodes, or -1 if one fails.
+func microbenchXDR(which, n, size int) int {
+	return int(C.microbench_xdr(C.int(which), C.int(n), C.u_int(size)))
+}
+
+//readdirPager reads pages of a directory through go_readdir_full, as
+//READDIR does.
+type readdirPager struct {
+	dir  *C.char
+	buf  unsafe.Pointer
+	used C.uint32
+}
+
+func newReaddirPager(dir string) *readdirPager {
+	return &readdirPager{dir: C.CString(dir), buf: C.malloc(4096)}
+}
+
+//page reads the page starting at cookie, returning false if that failed.
+func (p *readdirPager) page(cookie int) bool {
+	return go_readdir_full(p.dir, C.uint64(cookie), 4096-C.RESOK_SIZE, p.buf, &p.used) <= 0
+}
+
+func (p *readdirPager) close() {
+	C.free(unsafe.Pointer(p.dir))
+	C.free(p.buf)
+}
@@ -0,0 +1,188 @@
+//go:build microbench
+
+package main
+
+import (
+	"math/rand"
+	"strconv"
+	"sync"
+	"testing"
+)
+
+//Microbenchmarks of the hot paths on their own. Compare commits with
+//benchstat:
+//
+//	go test -tags microbench -run '^$' -bench . -count 10 > old.txt
+//	(check out the other commit)
+//	go test -tags microbench -run '^$' -bench . -count 10 > new.txt
+//	benchstat old.txt new.txt
+
+func xdrBench(b *testing.B, which, size int) {
+	n := microbenchXDR(which, 1, size)
+	if n < 0 {
+		b.Fatal("XDR routine failed")
+	}
+	b.SetBytes(int64(n))
+	b.ResetTimer()
+	microbenchXDR(which, b.N, size)
+}
+
+func BenchmarkXDREncodeFattr3(b *testing.B) {
+	xdrBench(b, benchFattr3, 0)
+}
+
+func BenchmarkXDREncodeRead3res(b *testing.B) {
+	b.Run("32KiB", func(b *testing.B) { xdrBench(b, benchRead3res, 32<<10) })
+	b.Run("1MiB", func(b *testing.B) { xdrBench(b, benchRead3res, 1<<20) })
+}
+
+func BenchmarkXDREncodeReaddir3res(b *testing.B) {
+	b.Run("100", func(b *testing.B) { xdrBench(b, benchReaddir3res, 100) })
+	b.Run("10000", func(b *testing.B) { xdrBench(b, benchReaddir3res, 10000) })
+}
+
+func BenchmarkXDRDecodeWrite3args(b *testing.B) {
+	b.Run("32KiB", func(b *testing.B) { xdrBench(b, benchWrite3args, 32<<10) })
+}
+
+func BenchmarkXDRDecodeLookup3args(b *testing.B) {
+	xdrBench(b, benchLookup3args, 0)
+}
+
+//The fdCache benchmarks share one cache of 1M paths, 1000 directories of
+//1000 files each, which takes a while to build.
+var (
+	benchFDs     *fdCache
+	benchPaths   []string
+	benchFDsOnce sync.Once
+)
+
+func fdCacheOf1M() *fdCache {
+	benchFDsOnce.Do(func() {
+		benchFDs = &fdCache{FDlistLock: new(sync.RWMutex),
+			PathMapA:  make(map[string]int),
+			PathMapB:  make(map[int]string),
+			FDcounter: 100}
+		for d := 0; d < 1000; d++ {
+			dir := "/dir" + strconv.Itoa(d)
+			benchFDs.GetFD(dir)
+			for f := 0; f < 1000; f++ {
+				p := dir + "/file" + strconv.Itoa(f)
+				benchFDs.GetFD(p)
+				benchPaths = append(benchPaths, p)
+			}
+		}
+		rand.New(rand.NewSource(1)).Shuffle(len(benchPaths), func(i, j int) {
+			benchPaths[i], benchPaths[j] = benchPaths[j], benchPaths[i]
+		})
+	})
+	return benchFDs
+}
+
+func BenchmarkFdCacheGetFDHit(b *testing.B) {
+	c := fdCacheOf1M()
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		c.GetFD(benchPaths[i%len(benchPaths)])
+	}
+}
+
+func BenchmarkFdCacheGetPath(b *testing.B) {
+	c := fdCacheOf1M()
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		c.GetPath(101 + i%len(benchPaths))
+	}
+}
+
+//BenchmarkFdCacheReplacePath renames a file, or a directory of 1000, and
+//back again, by turns.
+func BenchmarkFdCacheReplacePath(b *testing.B) {
+	for _, bench := range []struct {
+		name     string
+		from, to string
+		dir      bool
+	}{
+		{"file", "/dir500/file500", "/dir500/renamed", false},
+		{"dir", "/dir500", "/renamed", true},
+	} {
+		b.Run(bench.name, func(b *testing.B) {
+			c := fdCacheOf1M()
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if i%2 == 0 {
+					c.ReplacePath(bench.from, bench.to, bench.dir)
+				} else {
+					c.ReplacePath(bench.to, bench.from, bench.dir)
+				}
+			}
+			if b.N%2 == 1 {
+				c.ReplacePath(bench.to, bench.from, bench.dir)
+			}
+		})
+	}
+}
+
+//BenchmarkFdCacheGetFDNew adds paths the cache hasn't seen, made up ahead
+//of time in batches, outside the timer. It leaves the shared cache bigger.
+func BenchmarkFdCacheGetFDNew(b *testing.B) {
+	c := fdCacheOf1M()
+	b.ReportAllocs()
+	b.ResetTimer()
+	batch := make([]string, 0, 1<<16)
+	for i := 0; i < b.N; {
+		b.StopTimer()
+		batch = batch[:0]
+		for j := 0; j < cap(batch); j++ {
+			batch = append(batch, "/new"+strconv.Itoa(b.N)+"/"+strconv.Itoa(i+j))
+		}
+		b.StartTimer()
+		for _, p := range batch {
+			if i == b.N {
+				break
+			}
+			c.GetFD(p)
+			i++
+		}
+	}
+}
+
+//BenchmarkReaddirFull reads a page of a 100k entry -mem directory as
+//READDIR does: from the start, or from anywhere in it.
+func BenchmarkReaddirFull(b *testing.B) {
+	saved := ns
+	defer func() { ns = saved }()
+	go_init()
+	m := newMemFS()
+	m.CreateDirectory("/big")
+	for i := 0; i < 100000; i++ {
+		m.CreateFile("/big/entry" + strconv.Itoa(i))
+	}
+	ns = m
+	p := newReaddirPager("/big")
+	defer p.close()
+
+	for _, anywhere := range []bool{false, true} {
+		name := "first"
+		if anywhere {
+			name = "anywhere"
+		}
+		b.Run(name, func(b *testing.B) {
+			rng := rand.New(rand.NewSource(1))
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				cookie := 0
+				if anywhere {
+					cookie = rng.Intn(100000)
+				}
+				if !p.page(cookie) {
+					b.Fatal("go_readdir_full failed")
+				}
+			}
+		})
+	}
+}
@@ -0,0 +1,560 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	pathpkg "path"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+)
+
+//overlayFS puts a writable upper backend over a read-only lower one, such
+//as a directory over a zip. Files are read from the upper layer if they're
+//there and the lower one otherwise, and a lower file is copied up before
+//it's first changed. Removing something that's in the lower layer leaves a
+//whiteout in the upper one, an empty file named whiteoutPrefix+name, which
+//hides it from then on. Directories in both layers are merged.
+//
+//Which layers a path is in is kept in a lookup cache, so a file that's only
+//in the lower layer costs one map lookup to find rather than a Stat of each
+//layer and of its whiteout. Listing a directory fills in its entries. All
+//changes go through the overlay, so the cache only has to be told about its
+//own; changing either layer behind its back isn't supported.
+type overlayFS struct {
+	lower minfs.MinFS
+	upper minfs.MinFS
+
+	lock sync.Mutex //held by anything that changes the upper layer's tree
+
+	cache   sync.RWMutex
+	entries map[string]layers
+	gen     uint64 //bumped by every invalidation, so late lookups don't undo one
+	max     int
+
+	hits, misses int64
+}
+
+//layers says what's at a path in each layer. lower is only set when the
+//lower entry shows through: its parent is in the lower layer and shows
+//through, and there's no whiteout for it.
+type layers struct {
+	upper, upperDir bool
+	lower, lowerDir bool
+}
+
+func (l layers) exists() bool { return l.upper || l.lower }
+func (l layers) isDir() bool  { return l.upperDir || (!l.upper && l.lowerDir) }
+
+//merged is whether the lower layer's directory shows through l.
+func (l layers) merged() bool { return l.lower && l.lowerDir && (!l.upper || l.upperDir) }
+
+const (
+	whiteoutPrefix = ".wh."
+	overlayCache   = 1 << 16 //paths
+	copyUpPiece    = 1 << 20
+)
+
+//config example:   -zip ./base.zip -- -os /srv/changes
+//the lower bind comes first, then "--", then the upper one
+func overlayfsPrep(args []string) (minfs.MinFS, error) {
+	split := -1
+	for i, a := range args {
+		if a == "--" {
+			split = i
+			break
+		}
+	}
+	if split < 1 || split == len(args)-1 {
+		return nil, errors.New("-overlay needs a lower bind type, then --, then an upper one")
+	}
+	lower, err := parseArgs(args[:split])
+	if err != nil {
+		return nil, err
+	}
+	upper, err := parseArgs(args[split+1:])
+	if err != nil {
+		lower.Close()
+		return nil, err
+	}
+	return &overlayFS{lower: lower, upper: upper,
+		entries: make(map[string]layers),
+		max:     overlayCache}, nil
+}
+
+//lookup returns what's at path, from the cache if it can.
+func (o *overlayFS) lookup(path string) (layers, error) {
+	if path == "/" {
+		return layers{true, true, true, true}, nil
+	}
+	o.cache.RLock()
+	l, ok := o.entries[path]
+	gen := o.gen
+	o.cache.RUnlock()
+	if ok {
+		atomic.AddInt64(&o.hits, 1)
+		return l, nil
+	}
+	atomic.AddInt64(&o.misses, 1)
+
+	parent, err := o.lookup(pathpkg.Dir(path))
+	if err != nil {
+		return layers{}, err
+	}
+	if !parent.isDir() {
+		return layers{}, os.ErrNotExist
+	}
+	name := pathpkg.Base(path)
+	if strings.HasPrefix(name, whiteoutPrefix) {
+		return layers{}, nil
+	}
+	if parent.upper {
+		if fi, err := o.upper.Stat(path); err == nil {
+			l.upper, l.upperDir = true, fi.IsDir()
+		} else if !os.IsNotExist(err) {
+			return layers{}, err
+		}
+	}
+	if parent.merged() {
+		out, err := o.whitedOut(path)
+		if err != nil {
+			return layers{}, err
+		}
+		if !out {
+			if fi, err := o.lower.Stat(path); err == nil {
+				l.lower, l.lowerDir = true, fi.IsDir()
+			} else if !os.IsNotExist(err) {
+				return layers{}, err
+			}
+		}
+	}
+	o.remember(path, l, gen)
+	return l, nil
+}
+
+//whitedOut reports whether the upper layer hides path. Only a missing whiteout
+//means it doesn't; any other error is passed on rather than exposing the lower copy.
+func (o *overlayFS) whitedOut(path string) (bool, error) {
+	_, err := o.upper.Stat(whiteout(path))
+	if err == nil {
+		return true, nil
+	}
+	if os.IsNotExist(err) {
+		return false, nil
+	}
+	return false, err
+}
+
+func whiteout(path string) string {
+	return pathpkg.Join(pathpkg.Dir(path), whiteoutPrefix+pathpkg.Base(path))
+}
+
+//remember caches l for path, unless the cache has been invalidated since gen.
+func (o *overlayFS) remember(path string, l layers, gen uint64) {
+	o.cache.Lock()
+	defer o.cache.Unlock()
+	if gen != o.gen {
+		return
+	}
+	if len(o.entries) >= o.max {
+		for p := range o.entries { //evict whatever the map hands us first
+			delete(o.entries, p)
+			break
+		}
+	}
+	o.entries[path] = l
+}
+
+//forget drops path, and everything under it, from the cache.
+func (o *overlayFS) forget(path string) {
+	o.cache.Lock()
+	defer o.cache.Unlock()
+	o.gen++
+	delete(o.entries, path)
+	prefix := path + "/"
+	for p := range o.entries {
+		if strings.HasPrefix(p, prefix) {
+			delete(o.entries, p)
+		}
+	}
+}
+
+//layer returns the backend that serves path.
+func (o *overlayFS) layer(path string) (minfs.MinFS, layers, error) {
+	l, err := o.lookup(path)
+	switch {
+	case err != nil:
+		return nil, l, err
+	case l.upper:
+		return o.upper, l, nil
+	case l.lower:
+		return o.lower, l, nil
+	}
+	return nil, l, os.ErrNotExist
+}
+
+func (o *overlayFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	fs, _, err := o.layer(path)
+	if err != nil {
+		return 0, err
+	}
+	return fs.ReadFile(path, b, off)
+}
+
+func (o *overlayFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	if err := o.copyUp(path, -1); err != nil {
+		return 0, err
+	}
+	return o.upper.WriteFile(path, b, off)
+}
+
+func (o *overlayFS) Stat(path string) (os.FileInfo, error) {
+	fs, _, err := o.layer(path)
+	if err != nil {
+		return nil, err
+	}
+	return fs.Stat(path)
+}
+
+func (o *overlayFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	fs, _, err := o.layer(path)
+	if err != nil {
+		return nil, err
+	}
+	return fs.GetAttribute(path, attribute)
+}
+
+func (o *overlayFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	size := int64(-1)
+	if attribute == "size" {
+		if n, ok := newvalue.(int64); ok {
+			size = n //no need to copy up what's about to be cut off
+		}
+	}
+	if err := o.copyUp(path, size); err != nil {
+		return err
+	}
+	return o.upper.SetAttribute(path, attribute, newvalue)
+}
+
+//copyUp makes sure path is in the upper layer, copying it from the lower one
+//if need be, up to limit bytes of it if limit isn't -1.
+func (o *overlayFS) copyUp(path string, limit int64) error {
+	if l, err := o.lookup(path); err != nil || l.upper || !l.lower {
+		if err == nil && !l.exists() {
+			err = os.ErrNotExist
+		}
+		return err
+	}
+	o.lock.Lock()
+	defer o.lock.Unlock()
+	return o.copyUpLocked(path, limit)
+}
+
+func (o *overlayFS) copyUpLocked(path string, limit int64) error {
+	l, err := o.lookup(path)
+	if err != nil || l.upper {
+		return err
+	}
+	if !l.lower {
+		return os.ErrNotExist
+	}
+	if err := o.copyUpLocked(pathpkg.Dir(path), -1); err != nil {
+		return err
+	}
+	fi, err := o.lower.Stat(path)
+	if err != nil {
+		return err
+	}
+
+	if fi.IsDir() {
+		err = o.upper.CreateDirectory(path)
+	} else if err = o.upper.CreateFile(path); err == nil {
+		if err = o.copyData(path, fi.Size(), limit); err != nil {
+			o.upper.Remove(path)
+		}
+	}
+	if err == nil {
+		mode := fi.Mode() & os.ModePerm
+		if fi.IsDir() {
+			mode |= 0200 //read-only lowers say 0555, but this one takes changes
+		}
+		o.upper.SetAttribute(path, "mode", mode)
+		o.upper.SetAttribute(path, "modtime", fi.ModTime())
+	}
+	o.forget(path)
+	return err
+}
+
+func (o *overlayFS) copyData(path string, size, limit int64) error {
+	if limit >= 0 && limit < size {
+		size = limit
+	}
+	buf := make([]byte, copyUpPiece)
+	for off := int64(0); off < size; {
+		b := buf
+		if int64(len(b)) > size-off {
+			b = b[:size-off]
+		}
+		n, err := o.lower.ReadFile(path, b, off)
+		if err != nil && !(err == io.EOF && n == len(b)) {
+			if err == io.EOF {
+				err = io.ErrUnexpectedEOF
+			}
+			return err
+		}
+		if _, err := o.upper.WriteFile(path, b[:n], off); err != nil {
+			return err
+		}
+		off += int64(n)
+	}
+	return nil
+}
+
+//copyUpTree copies up the directory at path and everything in it.
+func (o *overlayFS) copyUpTree(path string) error {
+	if err := o.copyUpLocked(path, -1); err != nil {
+		return err
+	}
+	list, err := o.ReadDirectory(path)
+	if err != nil {
+		return err
+	}
+	for _, fi := range list {
+		child := pathpkg.Join(path, fi.Name())
+		if fi.IsDir() {
+			err = o.copyUpTree(child)
+		} else {
+			err = o.copyUpLocked(child, -1)
+		}
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (o *overlayFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	l, err := o.lookup(path)
+	if err != nil {
+		return nil, err
+	}
+	if !l.exists() {
+		return nil, os.ErrNotExist
+	}
+	if !l.isDir() {
+		return nil, os.ErrInvalid
+	}
+	o.cache.RLock()
+	gen := o.gen
+	o.cache.RUnlock()
+
+	var list []os.FileInfo
+	hidden := make(map[string]bool)
+	found := make(map[string]layers)
+	if l.upper {
+		upper, err := o.upper.ReadDirectory(path)
+		if err != nil {
+			return nil, err
+		}
+		for _, fi := range upper {
+			if name := fi.Name(); strings.HasPrefix(name, whiteoutPrefix) {
+				hidden[name[len(whiteoutPrefix):]] = true
+			} else {
+				list = append(list, fi)
+				found[name] = layers{upper: true, upperDir: fi.IsDir()}
+			}
+		}
+	}
+	if l.merged() {
+		lower, err := o.lower.ReadDirectory(path)
+		if err != nil {
+			return nil, err
+		}
+		for _, fi := range lower {
+			name := fi.Name()
+			if hidden[name] || strings.HasPrefix(name, whiteoutPrefix) {
+				continue
+			}
+			f, ok := found[name]
+			if !ok {
+				list = append(list, fi)
+			}
+			f.lower, f.lowerDir = true, fi.IsDir()
+			found[name] = f
+		}
+	}
+	for name, f := range found {
+		o.remember(pathpkg.Join(path, name), f, gen)
+	}
+	//READDIR cookies are positions in the list, so keep it in a fixed order
+	sort.Slice(list, func(i, j int) bool { return list[i].Name() < list[j].Name() })
+	return list, nil
+}
+
+//create makes a new file or directory at path.
+func (o *overlayFS) create(path string, make func(string) error) error {
+	if strings.HasPrefix(pathpkg.Base(path), whiteoutPrefix) {
+		return os.ErrPermission
+	}
+	o.lock.Lock()
+	defer o.lock.Unlock()
+	l, err := o.lookup(path)
+	if err != nil {
+		return err
+	}
+	if l.exists() {
+		return os.ErrExist
+	}
+	if err := o.copyUpLocked(pathpkg.Dir(path), -1); err != nil {
+		return err
+	}
+	//any whiteout stays, to keep hiding what the lower layer has here
+	err = make(path)
+	o.forget(path)
+	return err
+}
+
+func (o *overlayFS) CreateFile(path string) error {
+	return o.create(path, o.upper.CreateFile)
+}
+
+func (o *overlayFS) CreateDirectory(path string) error {
+	return o.create(path, o.upper.CreateDirectory)
+}
+
+func (o *overlayFS) Remove(path string) error {
+	if path == "/" {
+		return os.ErrPermission
+	}
+	o.lock.Lock()
+	defer o.lock.Unlock()
+	l, err := o.lookup(path)
+	if err != nil {
+		return err
+	}
+	if !l.exists() {
+		return os.ErrNotExist
+	}
+	if err := o.emptyDir(path, l); err != nil {
+		return err
+	}
+	if l.upper {
+		err = o.upper.Remove(path)
+	}
+	if err == nil && l.lower {
+		err = o.copyUpLocked(pathpkg.Dir(path), -1)
+		if err == nil {
+			err = o.upper.CreateFile(whiteout(path))
+		}
+	}
+	o.forget(path)
+	return err
+}
+
+//emptyDir checks a directory about to be removed or replaced looks empty,
+//and clears the whiteouts out of its upper layer.
+func (o *overlayFS) emptyDir(path string, l layers) error {
+	if !l.isDir() {
+		return nil
+	}
+	list, err := o.ReadDirectory(path)
+	if err != nil {
+		return err
+	}
+	if len(list) > 0 {
+		return errNotEmpty
+	}
+	if l.upper {
+		upper, err := o.upper.ReadDirectory(path)
+		if err != nil {
+			return err
+		}
+		for _, fi := range upper {
+			if err := o.upper.Remove(pathpkg.Join(path, fi.Name())); err != nil {
+				return err
+			}
+		}
+	}
+	return nil
+}
+
+//Move renames in the upper layer, copying up first whatever's only in the
+//lower one; a directory that's in the lower layer is copied up whole.
+func (o *overlayFS) Move(oldpath string, newpath string) error {
+	if oldpath == "/" || newpath == "/" || strings.HasPrefix(pathpkg.Base(newpath), whiteoutPrefix) {
+		return os.ErrPermission
+	}
+	if oldpath == newpath {
+		return nil
+	}
+	o.lock.Lock()
+	defer o.lock.Unlock()
+	from, err := o.lookup(oldpath)
+	if err != nil {
+		return err
+	}
+	if !from.exists() {
+		return os.ErrNotExist
+	}
+	to, err := o.lookup(newpath)
+	if err != nil {
+		return err
+	}
+	if to.exists() {
+		if to.isDir() != from.isDir() {
+			return os.ErrExist
+		}
+		if err := o.emptyDir(newpath, to); err != nil {
+			return err
+		}
+	}
+
+	if from.merged() {
+		err = o.copyUpTree(oldpath)
+	} else {
+		err = o.copyUpLocked(oldpath, -1)
+	}
+	if err == nil {
+		err = o.copyUpLocked(pathpkg.Dir(newpath), -1)
+	}
+	if err == nil && to.lower {
+		err = o.upper.CreateFile(whiteout(newpath))
+	}
+	if err == nil {
+		err = o.upper.Move(oldpath, newpath)
+	}
+	if err == nil && from.lower {
+		err = o.upper.CreateFile(whiteout(oldpath))
+	}
+	o.forget(oldpath)
+	o.forget(newpath)
+	return err
+}
+
+func (o *overlayFS) String() string {
+	return "overlay(" + o.lower.String() + ", " + o.upper.String() + ")"
+}
+
+func (o *overlayFS) Close() error {
+	err := o.upper.Close()
+	if lerr := o.lower.Close(); err == nil {
+		err = lerr
+	}
+	return err
+}
+
+func (o *overlayFS) stats() string {
+	o.cache.RLock()
+	defer o.cache.RUnlock()
+	return fmt.Sprintf("Overlay lookup cache: %d paths, %d hits, %d misses",
+		len(o.entries), atomic.LoadInt64(&o.hits), atomic.LoadInt64(&o.misses))
+}
+
+func (o *overlayFS) lookups() (hits, misses int64) {
+	return atomic.LoadInt64(&o.hits), atomic.LoadInt64(&o.misses)
+}
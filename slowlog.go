@@ -0,0 +1,54 @@
+package main
+
+//#include "unfs3/daemon.h"
+import "C"
+import (
+	"fmt"
+	"net"
+	"strings"
+	"time"
+	"unsafe"
+)
+
+//startSlowLog turns on logging of calls that take longer than threshold
+//(see unfs3/slowlog.c), with a goroutine that logs them as they come.
+func startSlowLog(threshold time.Duration) {
+	C.slowlog_threshold = C.uint64(threshold)
+	go func() {
+		var c C.struct_slowlog_call
+		dropped := C.uint64(0)
+		for range time.Tick(100 * time.Millisecond) {
+			for C.slowlog_take(&c) != 0 {
+				lg.log(levelWarn, "slow call", slowCall(&c), nil)
+			}
+			if d := C.slowlog_dropped(); d != dropped {
+				lg.warn("slow call log full, calls not logged", "count", d-dropped)
+				dropped = d
+			}
+		}
+	}()
+}
+
+//slowCall describes a slow call, where the time went, and on what.
+func slowCall(c *C.struct_slowlog_call) string {
+	program := "nfs"
+	if c.proc >= C.METRICS_MOUNT {
+		program = "mount"
+	}
+	client := (*[4]byte)(unsafe.Pointer(&c.client))
+	var b strings.Builder
+	fmt.Fprintf(&b, "Slow %s %s from %v xid %#x %q: %v; decode %v, run %v (resolving handles %v",
+		program, C.GoString(C.metrics_proc_name(c.proc)), net.IP(client[:]), uint32(c.xid),
+		C.GoString(&c.path[0]), time.Duration(c.total_ns),
+		time.Duration(c.ns[C.SLOWLOG_DECODE]), time.Duration(c.ns[C.SLOWLOG_RUN]),
+		time.Duration(c.resolve_ns))
+	for i := 0; i < int(c.go_calls) && i < C.SLOWLOG_GO_CALLS; i++ {
+		fmt.Fprintf(&b, ", %s %v", C.GoString(c._go[i].export), time.Duration(c._go[i].ns))
+	}
+	if c.go_calls > C.SLOWLOG_GO_CALLS {
+		fmt.Fprintf(&b, ", %d more Go calls", c.go_calls-C.SLOWLOG_GO_CALLS)
+	}
+	fmt.Fprintf(&b, "), encode %v, send %v",
+		time.Duration(c.ns[C.SLOWLOG_ENCODE]), time.Duration(c.ns[C.SLOWLOG_SEND]))
+	return b.String()
+}
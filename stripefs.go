@@ -0,0 +1,143 @@
+package main
+
+import (
+	"errors"
+	"github.com/Zilog8/minfs"
+	"strconv"
+	"sync"
+	"sync/atomic"
+)
+
+//stripeChunk is the size large reads and writes are cut into; it matches
+//the 32KiB data limit most sftp servers put on a single request.
+const stripeChunk = 32 * 1024
+
+//stripeFS spreads large reads and writes over several connections to the
+//same backend, keeping up to depth chunk requests outstanding at once, so a
+//high-latency link stays busy instead of waiting out one round trip per chunk.
+//Everything else goes to the first connection.
+type stripeFS struct {
+	minfs.MinFS
+	conns []minfs.MinFS
+	depth int
+	rr    uint32 //round robin for calls too small to split
+}
+
+//args example:   4 16 -sftp username:password@example.com:22/
+func stripefsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) < 3 {
+		return nil, errors.New("-stripe needs a connection count, a depth and a bind type")
+	}
+	nconns, err := strconv.Atoi(args[0])
+	if err != nil || nconns < 1 {
+		return nil, errors.New("-stripe connection count must be a positive number: " + args[0])
+	}
+	depth, err := strconv.Atoi(args[1])
+	if err != nil || depth < 1 {
+		return nil, errors.New("-stripe depth must be a positive number: " + args[1])
+	}
+
+	s := &stripeFS{depth: depth}
+	for i := 0; i < nconns; i++ {
+		sub, err := parseArgs(args[2:])
+		if err != nil {
+			s.Close()
+			return nil, err
+		}
+		s.conns = append(s.conns, sub)
+	}
+	s.MinFS = s.conns[0]
+	return s, nil
+}
+
+func (s *stripeFS) next() minfs.MinFS {
+	return s.conns[int(atomic.AddUint32(&s.rr, 1))%len(s.conns)]
+}
+
+type chunkResult struct {
+	n   int
+	err error
+}
+
+//spread runs op over [0, size) in stripeChunk pieces. Each of up to depth
+//workers sticks to one connection, so they share the depth between them.
+func (s *stripeFS) spread(size int, op func(c minfs.MinFS, lo, hi int) (int, error)) []chunkResult {
+	chunks := (size + stripeChunk - 1) / stripeChunk
+	res := make([]chunkResult, chunks)
+	workers := s.depth
+	if workers > chunks {
+		workers = chunks
+	}
+
+	var next int32 = -1
+	var wg sync.WaitGroup
+	wg.Add(workers)
+	for w := 0; w < workers; w++ {
+		go func(c minfs.MinFS) {
+			defer wg.Done()
+			for {
+				i := int(atomic.AddInt32(&next, 1))
+				if i >= chunks {
+					return
+				}
+				lo := i * stripeChunk
+				hi := lo + stripeChunk
+				if hi > size {
+					hi = size
+				}
+				res[i].n, res[i].err = op(c, lo, hi)
+			}
+		}(s.conns[w%len(s.conns)])
+	}
+	wg.Wait()
+	return res
+}
+
+//settle turns chunk results into a single count: everything up to the
+//first chunk that failed or came up short.
+func settle(res []chunkResult, size int) (int, error) {
+	total := 0
+	for i, r := range res {
+		total += r.n
+		want := stripeChunk
+		if i == len(res)-1 {
+			want = size - i*stripeChunk
+		}
+		if r.err != nil || r.n < want {
+			return total, r.err
+		}
+	}
+	return total, nil
+}
+
+func (s *stripeFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	if len(b) <= stripeChunk {
+		return s.next().ReadFile(path, b, off)
+	}
+	return settle(s.spread(len(b), func(c minfs.MinFS, lo, hi int) (int, error) {
+		return c.ReadFile(path, b[lo:hi], off+int64(lo))
+	}), len(b))
+}
+
+func (s *stripeFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	if len(b) <= stripeChunk {
+		return s.next().WriteFile(path, b, off)
+	}
+	return settle(s.spread(len(b), func(c minfs.MinFS, lo, hi int) (int, error) {
+		return c.WriteFile(path, b[lo:hi], off+int64(lo))
+	}), len(b))
+}
+
+func (s *stripeFS) String() string {
+	return "stripe(" + strconv.Itoa(len(s.conns)) + "x" + strconv.Itoa(s.depth) + ", " + s.conns[0].String() + ")"
+}
+
+func (s *stripeFS) Close() error {
+	var cerr error
+	for _, c := range s.conns {
+		if err := c.Close(); err != nil && cerr == nil {
+			cerr = err
+		}
+	}
+	return cerr
+}
@@ -0,0 +1,186 @@
+package main
+
+import (
+	"errors"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+)
+
+//tarFS shares the contents of a tar archive, plain or gzipped, read only,
+//using an index of it that's built once and kept alongside it (see
+//tarindex.go). A plain tar's files are read straight out of the archive. A
+//gzipped one is a single deflate stream holding the whole tar, read through
+//a deflateReader (see deflate.go) with the seek points from the index.
+type tarFS struct {
+	deflateReader //only used for a gzipped archive
+
+	path    string
+	file    *os.File
+	archive os.FileInfo
+	ix      *tarIndex
+}
+
+//config example:   ./build.tar.gz index=/var/cache/build.idx span=4 cache=64
+func tarfsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) < 1 {
+		return nil, errors.New("-tar needs a tar file")
+	}
+	span, cache, index := zipSpan, zipCache, args[0]+".unfsidx"
+	for _, a := range args[1:] {
+		kv := strings.SplitN(a, "=", 2)
+		switch {
+		case len(kv) == 2 && kv[0] == "span":
+			n, err := strconv.Atoi(kv[1])
+			if err != nil || n < 1 {
+				return nil, errors.New("-tar span must be a positive number of MiB: " + kv[1])
+			}
+			span = n
+		case len(kv) == 2 && kv[0] == "cache":
+			n, err := strconv.Atoi(kv[1])
+			if err != nil || n < 1 {
+				return nil, errors.New("-tar cache must be a positive number of MiB: " + kv[1])
+			}
+			cache = n
+		case len(kv) == 2 && kv[0] == "index":
+			index = kv[1]
+		default:
+			return nil, errors.New("Not a recognized -tar argument: " + a)
+		}
+	}
+	return newTarFS(args[0], int64(span)<<20, int64(cache)<<20, index)
+}
+
+func newTarFS(path string, span, cache int64, index string) (*tarFS, error) {
+	if abs, err := filepath.Abs(path); err == nil {
+		path = abs
+	}
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	ix, err := loadTarIndex(f, fi, span, index)
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+
+	t := &tarFS{path: path, file: f, archive: fi, ix: ix}
+	if ix.stream.index != nil {
+		t.init(f, span, cache)
+	}
+	return t, nil
+}
+
+//info makes the os.FileInfo of record i.
+func (t *tarFS) info(i int) os.FileInfo {
+	r := &t.ix.dir.recs[i]
+	if r.hdr == noHeader {
+		return &zipInfo{t.ix.dir.baseName(r), 0, os.ModeDir | 0555, t.archive.ModTime()}
+	}
+	m := &t.ix.metas[r.hdr]
+	return &zipInfo{t.ix.dir.baseName(r), m.size, os.FileMode(m.mode), time.Unix(m.mtime, 0)}
+}
+
+func (t *tarFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	t.mapping.RLock()
+	defer t.mapping.RUnlock()
+	if t.closed {
+		return 0, os.ErrClosed
+	}
+	i := t.ix.dir.find(path[1:])
+	if i < 0 {
+		return 0, os.ErrNotExist
+	}
+	r := &t.ix.dir.recs[i]
+	if r.hdr == noHeader || os.FileMode(t.ix.metas[r.hdr].mode).IsDir() {
+		return 0, os.ErrInvalid
+	}
+	m := &t.ix.metas[r.hdr]
+	if off >= m.size {
+		return 0, io.EOF
+	}
+	want := len(b)
+	if int64(want) > m.size-off {
+		b = b[:m.size-off]
+	}
+
+	var n int
+	var err error
+	if t.cache != nil {
+		n, err = t.inflate(&t.ix.stream, b, m.offset+off)
+	} else {
+		n, err = t.file.ReadAt(b, m.offset+off)
+	}
+	if err == nil && n < want {
+		err = io.EOF
+	}
+	return n, err
+}
+
+func (t *tarFS) Stat(path string) (os.FileInfo, error) {
+	t.mapping.RLock()
+	defer t.mapping.RUnlock()
+	if path == "/" {
+		return &zipInfo{"/", 0, os.ModeDir | 0555, t.archive.ModTime()}, nil
+	}
+	if i := t.ix.dir.find(path[1:]); i >= 0 {
+		return t.info(i), nil
+	}
+	return nil, os.ErrNotExist
+}
+
+func (t *tarFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	t.mapping.RLock()
+	defer t.mapping.RUnlock()
+	name := path[1:]
+	if name != "" {
+		i := t.ix.dir.find(name)
+		if i < 0 {
+			return nil, os.ErrNotExist
+		}
+		if !t.info(i).IsDir() {
+			return nil, os.ErrInvalid
+		}
+	}
+	lo, hi := t.ix.dir.children(name)
+	list := make([]os.FileInfo, 0, hi-lo)
+	for i := lo; i < hi; i++ {
+		list = append(list, t.info(i))
+	}
+	return list, nil
+}
+
+func (t *tarFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	return nil, os.ErrInvalid
+}
+
+func (t *tarFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	return 0, os.ErrPermission
+}
+
+func (t *tarFS) CreateFile(path string) error              { return os.ErrPermission }
+func (t *tarFS) CreateDirectory(path string) error         { return os.ErrPermission }
+func (t *tarFS) Remove(path string) error                  { return os.ErrPermission }
+func (t *tarFS) Move(oldpath string, newpath string) error { return os.ErrPermission }
+func (t *tarFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	return os.ErrPermission
+}
+
+func (t *tarFS) String() string {
+	return "tar(" + t.path + ")"
+}
+
+func (t *tarFS) Close() error {
+	t.close(t.ix.close)
+	return t.file.Close()
+}
@@ -0,0 +1,428 @@
+package main
+
+import (
+	"archive/tar"
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"hash/crc32"
+	"io"
+	"os"
+	pathpkg "path"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+//tarIndex is everything needed to serve a tar archive without reading
+//through it: its directory, sorted the same way as a zip's (see zipdir.go),
+//where each file's data is, and for a gzipped archive the seek points of the
+//deflate stream holding the tar. It's built by one pass over the archive,
+//then saved in a form that's used in place once mapped back into memory, so
+//opening an indexed archive costs the same however big it is.
+type tarIndex struct {
+	dir    zipDir //cd holds the names, and each record's hdr is its place in metas
+	metas  []tarMeta
+	stream deflated //of a gzipped archive, with a complete seek index
+	mapped []byte   //the index file, once it's mapped
+}
+
+//tarMeta is a file or directory in the archive.
+type tarMeta struct {
+	offset int64 //of the data, in the archive or in the gzipped tar
+	size   int64
+	mtime  int64 //unix seconds
+	mode   uint32
+	_      uint32
+}
+
+//tarIndexHeader starts a saved index. The first five fields have to match
+//the archive and the span for it to be used; the rest say how much follows:
+//Recs zipRecs, Metas tarMetas, Names bytes of names and Points tarPoints,
+//each padded to 8 bytes, then the windows of the seek points.
+type tarIndexHeader struct {
+	Magic    [8]byte
+	Order    uint32 //tarIndexOrder, in the byte order the index was written in
+	Points   uint32
+	Archive  int64 //size
+	Modified int64
+	Span     int64
+	Base     int64 //where the deflate data starts, for a gzipped archive
+	CSize    int64
+	Size     int64 //of the tar inside
+	Recs     int64
+	Metas    int64
+	Names    int64
+}
+
+//tarPoint is a saved seek point.
+type tarPoint struct{ Bit, Pos, Window int64 }
+
+var tarIndexMagic = [8]byte{'u', 'n', 'f', 's', 't', 'i', 'x', '1'}
+
+const tarIndexOrder = 0x01020304
+
+var (
+	errTarIndex  = errors.New("bad or stale tar index")
+	errMultiGzip = errors.New("gzip files with more than one member aren't supported")
+)
+
+//rawBytes views the memory of n values of size bytes each at p.
+func rawBytes(p unsafe.Pointer, n, size int) []byte {
+	if n == 0 {
+		return nil
+	}
+	return unsafe.Slice((*byte)(p), n*size)
+}
+
+//buildTarIndex reads through the archive in f to index it.
+func buildTarIndex(f *os.File, fi os.FileInfo, span int64) (*tarIndex, error) {
+	ix := &tarIndex{}
+	var magic [2]byte
+	f.ReadAt(magic[:], 0)
+	gzipped := magic == [2]byte{0x1f, 0x8b}
+
+	var r io.Reader = f
+	var z *inflater
+	var counted *tarStream
+	if gzipped {
+		base, err := gzipStart(f, fi.Size())
+		if err != nil {
+			return nil, err
+		}
+		ix.stream = deflated{offset: base, csize: fi.Size() - base, index: newSeekIndex()}
+		z = newInflater(f, base, fi.Size()-base, 0, 0, nil)
+		z.onBlock = func(z *inflater) { ix.stream.index.mark(z, span) }
+		counted = &tarStream{r: z}
+		r = counted
+	}
+
+	type link struct {
+		meta   int
+		target string
+	}
+	var recs []zipRec
+	var names []byte
+	var links []link
+	tr := tar.NewReader(r)
+	for {
+		h, err := tr.Next()
+		if err == io.EOF {
+			break
+		}
+		if err != nil {
+			return nil, err
+		}
+		m := tarMeta{size: h.Size, mtime: h.ModTime.Unix(), mode: 0444 | uint32(h.Mode)&0555}
+		switch h.Typeflag {
+		case tar.TypeReg:
+		case tar.TypeDir:
+			m.size, m.mode = 0, uint32(os.ModeDir|0555)
+		case tar.TypeLink:
+			m.size = 0
+			links = append(links, link{len(ix.metas), pathpkg.Clean("/" + h.Linkname)[1:]})
+		default:
+			continue //symlinks, devices and sparse files can't be served
+		}
+		if _, ok := h.PAXRecords["GNU.sparse.size"]; ok {
+			continue
+		}
+		if _, ok := h.PAXRecords["GNU.sparse.realsize"]; ok {
+			continue
+		}
+		if gzipped {
+			m.offset = counted.n
+		} else if m.offset, err = f.Seek(0, io.SeekCurrent); err != nil {
+			return nil, err
+		}
+
+		name := pathpkg.Clean("/" + h.Name)[1:]
+		if name == "" {
+			continue
+		}
+		if len(name) > 0xffff || len(names)+len(name) >= int(noHeader) || len(ix.metas) >= int(noHeader) {
+			return nil, errors.New("tar archive has too many entries, or too long names, to index")
+		}
+		recs = append(recs, zipRec{name: uint32(len(names)),
+			nameLen: uint16(len(name)),
+			base:    uint16(strings.LastIndexByte(name, '/') + 1),
+			hdr:     uint32(len(ix.metas))})
+		names = append(names, name...)
+		ix.metas = append(ix.metas, m)
+	}
+
+	if gzipped {
+		if err := finishGzip(f, z, counted); err != nil {
+			return nil, err
+		}
+		ix.stream.size = counted.n
+		ix.stream.index.finish(counted.n)
+	}
+
+	//later copies of a file replace earlier ones, as when it's extracted
+	ix.dir.cd = names
+	ix.dir.build(recs, true)
+	for _, l := range links {
+		if i := ix.dir.find(l.target); i >= 0 && ix.dir.recs[i].hdr != noHeader {
+			ix.metas[l.meta] = ix.metas[ix.dir.recs[i].hdr]
+		}
+	}
+	return ix, nil
+}
+
+//tarStream is what archive/tar reads a gzipped archive through, counting
+//where it's got to in the tar and checksumming it on the way.
+type tarStream struct {
+	r   io.Reader
+	n   int64
+	crc uint32
+}
+
+func (s *tarStream) Read(p []byte) (int, error) {
+	n, err := s.r.Read(p)
+	s.n += int64(n)
+	s.crc = crc32.Update(s.crc, crc32.IEEETable, p[:n])
+	return n, err
+}
+
+//gzipStart skips the gzip header (RFC 1952) to where the deflate data starts.
+func gzipStart(f io.ReaderAt, size int64) (int64, error) {
+	r := bufio.NewReader(io.NewSectionReader(f, 0, size))
+	var h [10]byte
+	if _, err := io.ReadFull(r, h[:]); err != nil || h[2] != 8 {
+		return 0, errors.New("not a gzip file, or not a deflated one")
+	}
+	off := int64(10)
+	if h[3]&4 != 0 { //extra field
+		var x [2]byte
+		if _, err := io.ReadFull(r, x[:]); err != nil {
+			return 0, err
+		}
+		n, err := r.Discard(int(binary.LittleEndian.Uint16(x[:])))
+		if err != nil {
+			return 0, err
+		}
+		off += 2 + int64(n)
+	}
+	for _, flag := range []byte{8, 16} { //name, comment
+		if h[3]&flag != 0 {
+			s, err := r.ReadSlice(0)
+			for err == bufio.ErrBufferFull {
+				off += int64(len(s))
+				s, err = r.ReadSlice(0)
+			}
+			if err != nil {
+				return 0, err
+			}
+			off += int64(len(s))
+		}
+	}
+	if h[3]&2 != 0 { //header crc
+		off += 2
+	}
+	return off, nil
+}
+
+//finishGzip decodes the rest of the gzip member past the end of the tar, and
+//checks it against its trailer.
+func finishGzip(f io.ReaderAt, z *inflater, s *tarStream) error {
+	if _, err := io.Copy(io.Discard, s); err != nil {
+		return err
+	}
+	end := z.base + (z.bitPos()+7)/8
+	var t [10]byte
+	n, _ := f.ReadAt(t[:], end)
+	if n < 8 || binary.LittleEndian.Uint32(t[:]) != s.crc || binary.LittleEndian.Uint32(t[4:]) != uint32(s.n) {
+		return errors.New("gzip data is corrupt")
+	}
+	if n == 10 && t[8] == 0x1f && t[9] == 0x8b {
+		return errMultiGzip
+	}
+	return nil
+}
+
+//write saves the index, in native byte order so it can be used in place.
+func (ix *tarIndex) write(w io.Writer, h tarIndexHeader) error {
+	var points []seekPoint
+	if ix.stream.index != nil {
+		points = ix.stream.index.points
+	}
+	h.Magic, h.Order, h.Points = tarIndexMagic, tarIndexOrder, uint32(len(points))
+	h.Base, h.CSize, h.Size = ix.stream.offset, ix.stream.csize, ix.stream.size
+	h.Recs, h.Metas, h.Names = int64(len(ix.dir.recs)), int64(len(ix.metas)), int64(len(ix.dir.cd))
+
+	saved := make([]tarPoint, len(points))
+	for i, p := range points {
+		saved[i] = tarPoint{p.bit, p.pos, int64(len(p.window))}
+	}
+
+	bw := bufio.NewWriter(w)
+	var pad [8]byte
+	for _, b := range [][]byte{rawBytes(unsafe.Pointer(&h), 1, int(unsafe.Sizeof(h))),
+		rawBytes(unsafe.Pointer(unsafe.SliceData(ix.dir.recs)), len(ix.dir.recs), int(unsafe.Sizeof(zipRec{}))),
+		rawBytes(unsafe.Pointer(unsafe.SliceData(ix.metas)), len(ix.metas), int(unsafe.Sizeof(tarMeta{}))),
+		ix.dir.cd,
+		rawBytes(unsafe.Pointer(unsafe.SliceData(saved)), len(saved), int(unsafe.Sizeof(tarPoint{})))} {
+		bw.Write(b)
+		bw.Write(pad[:(8-len(b)%8)%8])
+	}
+	for _, p := range points {
+		bw.Write(p.window)
+	}
+	return bw.Flush()
+}
+
+//parseTarIndex uses a saved index in place, if it matches want.
+func parseTarIndex(b []byte, want tarIndexHeader) (*tarIndex, error) {
+	var h tarIndexHeader
+	if len(b) < int(unsafe.Sizeof(h)) || uintptr(unsafe.Pointer(&b[0]))%8 != 0 {
+		return nil, errTarIndex
+	}
+	h = *(*tarIndexHeader)(unsafe.Pointer(&b[0]))
+	if h.Magic != tarIndexMagic || h.Order != tarIndexOrder || h.Archive != want.Archive ||
+		h.Modified != want.Modified || h.Span != want.Span {
+		return nil, errTarIndex
+	}
+	rest := b[unsafe.Sizeof(h):]
+	take := func(n, size int64) []byte {
+		if n < 0 || n > int64(len(rest))/size {
+			rest = nil
+			return nil
+		}
+		s := rest[:n*size]
+		rest = rest[(n*size+7)/8*8:]
+		return s
+	}
+
+	ix := &tarIndex{}
+	recs := take(h.Recs, int64(unsafe.Sizeof(zipRec{})))
+	metas := take(h.Metas, int64(unsafe.Sizeof(tarMeta{})))
+	ix.dir.cd = take(h.Names, 1)
+	points := take(int64(h.Points), int64(unsafe.Sizeof(tarPoint{})))
+	if rest == nil {
+		return nil, errTarIndex
+	}
+	ix.dir.recs = unsafe.Slice((*zipRec)(unsafe.Pointer(unsafe.SliceData(recs))), h.Recs)
+	ix.metas = unsafe.Slice((*tarMeta)(unsafe.Pointer(unsafe.SliceData(metas))), h.Metas)
+
+	//check just enough that a damaged index can't send a read out of bounds
+	limit := want.Archive
+	if h.Points > 0 {
+		if h.Base < 0 || h.CSize < 0 || h.Base > want.Archive-h.CSize || h.Size < 0 {
+			return nil, errTarIndex
+		}
+		limit = h.Size
+		ix.stream = deflated{offset: h.Base, csize: h.CSize, size: h.Size,
+			index: &seekIndex{upTo: h.Size, done: true, saved: true}}
+		saved := unsafe.Slice((*tarPoint)(unsafe.Pointer(unsafe.SliceData(points))), h.Points)
+		for i, p := range saved {
+			if p.Window < 0 || p.Window > inflateWindow || p.Window > int64(len(rest)) ||
+				p.Pos < 0 || p.Pos > h.Size || (i == 0) != (p.Pos == 0) {
+				return nil, errTarIndex
+			}
+			ix.stream.index.points = append(ix.stream.index.points, seekPoint{p.Bit, p.Pos, rest[:p.Window]})
+			rest = rest[p.Window:]
+		}
+	}
+	var bad int32
+	parallel(len(ix.dir.recs), func(lo, hi int) {
+		for _, r := range ix.dir.recs[lo:hi] {
+			if int64(r.name)+int64(r.nameLen) > h.Names || int(r.base) > int(r.nameLen) ||
+				(r.hdr != noHeader && int64(r.hdr) >= h.Metas) {
+				atomic.StoreInt32(&bad, 1)
+			}
+		}
+	})
+	parallel(len(ix.metas), func(lo, hi int) {
+		for _, m := range ix.metas[lo:hi] {
+			if m.offset < 0 || m.size < 0 || m.offset > limit-m.size {
+				atomic.StoreInt32(&bad, 1)
+			}
+		}
+	})
+	if bad != 0 {
+		return nil, errTarIndex
+	}
+	return ix, nil
+}
+
+//openTarIndex maps the saved index in file into memory, if it's usable.
+func openTarIndex(file string, want tarIndexHeader) (*tarIndex, error) {
+	f, err := os.Open(file)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	fi, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if fi.Size() == 0 || int64(int(fi.Size())) != fi.Size() {
+		return nil, errTarIndex
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(fi.Size()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	ix, err := parseTarIndex(data, want)
+	if err != nil {
+		syscall.Munmap(data)
+		return nil, err
+	}
+	ix.mapped = data
+	return ix, nil
+}
+
+//loadTarIndex opens the index of the archive in f, building it first if
+//there isn't a usable one in file yet. If it can't be saved there it's kept
+//in memory instead.
+func loadTarIndex(f *os.File, fi os.FileInfo, span int64, file string) (*tarIndex, error) {
+	want := tarIndexHeader{Archive: fi.Size(), Modified: fi.ModTime().UnixNano(), Span: span}
+	if ix, err := openTarIndex(file, want); err == nil {
+		return ix, nil
+	}
+
+	lg.info("indexing", "archive", f.Name())
+	ix, err := buildTarIndex(f, fi, span)
+	if err != nil {
+		return nil, err
+	}
+	if err = saveTarIndex(ix, file, want); err == nil {
+		var saved *tarIndex
+		if saved, err = openTarIndex(file, want); err == nil {
+			return saved, nil
+		}
+	}
+	lg.warn("saving tar index failed, keeping it in memory", "err", err)
+	var buf bytes.Buffer
+	ix.write(&buf, want)
+	return parseTarIndex(buf.Bytes(), want)
+}
+
+func saveTarIndex(ix *tarIndex, file string, h tarIndexHeader) error {
+	tmp := file + ".new"
+	f, err := os.OpenFile(tmp, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0644)
+	if err != nil {
+		return err
+	}
+	err = ix.write(f, h)
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(tmp, file)
+	}
+	if err != nil {
+		os.Remove(tmp)
+	}
+	return err
+}
+
+func (ix *tarIndex) close() {
+	if ix.mapped != nil {
+		syscall.Munmap(ix.mapped)
+	}
+	ix.mapped, ix.dir.cd, ix.dir.recs, ix.metas = nil, nil, nil, nil
+}
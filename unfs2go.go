@@ -12,57 +12,194 @@ import (
 	"github.com/Zilog8/minfs"
 	"github.com/Zilog8/minfs/osfs"
 	"github.com/Zilog8/minfs/sftpfs"
-	"github.com/Zilog8/minfs/shimfs"
-	"github.com/Zilog8/minfs/zipfs"
 	"os"
 	"os/signal"
+	"path/filepath"
 	"strconv"
 	"strings"
+	"time"
 )
 
-var ns minfs.MinFS //filesystem being shared
+var ns minfs.MinFS      //filesystem being shared, timed per call when serving metrics
+var backend minfs.MinFS //the same, untimed, for finding out what it can do
+
+//server-wide options, given as "-o name=value" pairs ahead of the bind type
+type serverOptions struct {
+	gatherKiB int    //write gathering threshold per file, 0 turns it off
+	gatherMs  int    //longest time gathered writes may sit before being flushed
+	ioKiB     int    //TCP rtmax/wtmax, 0 leaves the C default
+	httpAddr  string //metrics and profiling listener, "" for none
+	slowMs    int    //calls taking longer are logged, 0 turns that off
+	capture   string //file every call is recorded to, "" for none
+}
+
+var opts = serverOptions{gatherMs: 100}
 
 func main() {
 
-	args := os.Args[1:]
+	args, err := parseOptions(os.Args[1:])
+	if err != nil {
+		fmt.Println("Error starting:", err)
+		return
+	}
 
 	tfs, err := parseArgs(args)
 
 	if err != nil {
+		lg.flush() //what the backend logged setting up goes first
 		fmt.Println("Error starting:", err)
 	} else {
-	ns = tfs
+		ns, backend = tfs, tfs
+
+		if opts.gatherKiB > 0 {
+			wgather = newWriteGatherer(opts.gatherKiB*1024, time.Duration(opts.gatherMs)*time.Millisecond)
+		}
+		if opts.ioKiB > 0 {
+			C.opt_iosize = C.uint(opts.ioKiB * 1024)
+		}
+		if opts.slowMs > 0 {
+			startSlowLog(time.Duration(opts.slowMs) * time.Millisecond)
+		}
+		if opts.capture != "" {
+			if err := startCapture(opts.capture); err != nil {
+				fmt.Println("Error starting:", err)
+				return
+			}
+		}
+		if opts.httpAddr != "" {
+			if err := serveMetrics(opts.httpAddr); err != nil {
+				fmt.Println("Error starting:", err)
+				return
+			}
+			ns = &timedFS{MinFS: tfs, name: strings.TrimPrefix(args[0], "-")}
+		}
 
-	//Handle Ctrl-C so we can quit nicely
+		//Handle Ctrl-C so we can quit nicely
 
-	cc := make(chan os.Signal, 1)
-	signal.Notify(cc, os.Interrupt)
-	go func() {
-		<-cc
-		shutDown()
-	}()
+		cc := make(chan os.Signal, 1)
+		signal.Notify(cc, os.Interrupt)
+		go func() {
+			<-cc
+			shutDown()
+		}()
 		fmt.Println("Go backend created succesfully. Starting server...")
-	C.start()
-}
+		C.start()
+	}
 }
 
 func shutDown() {
+	lg.flush()
 	fmt.Println("Cleaning up, then quitting.")
+	if err := wgather.flushAll(); err != nil {
+		fmt.Println("Error flushing gathered writes:", err)
+	}
+	if err := capture.close(); err != nil {
+		fmt.Println("Error finishing the capture:", err)
+	}
+	fmt.Println(callStats())
+	fmt.Println(wgather.stats())
+	if bc, ok := backend.(*blockCache); ok {
+		fmt.Println(bc.stats())
+		if mc, ok := bc.MinFS.(*metaCache); ok {
+			fmt.Println(mc.stats())
+		}
+	}
+	if z, ok := backend.(*zipFS); ok {
+		fmt.Println(z.cache.stats())
+	}
+	if o, ok := backend.(*overlayFS); ok {
+		fmt.Println(o.stats())
+	}
+	if t, ok := backend.(*tarFS); ok && t.cache != nil {
+		fmt.Println(t.cache.stats())
+	}
+	readfds.closeAll()
 	ns.Close()
+	if c, ok := backend.(*casFS); ok { //after Close, which seals what's left
+		fmt.Println(c.stats())
+	}
+	lg.flush()
 	fmt.Println("Quitting.")
 	os.Exit(1)
 }
 
+func parseOptions(args []string) ([]string, error) {
+	for len(args) >= 2 && args[0] == "-o" {
+		kv := strings.SplitN(args[1], "=", 2)
+		if len(kv) != 2 {
+			return nil, errors.New("Option not in name=value form: " + args[1])
+		}
+		if err := opts.set(kv[0], kv[1]); err != nil {
+			return nil, err
+		}
+		args = args[2:]
+	}
+	return args, nil
+}
+
+func (o *serverOptions) set(name, value string) error {
+	switch name {
+	case "http":
+		o.httpAddr = value
+		return nil
+	case "loglevel":
+		return lg.setLevel(value)
+	case "capture":
+		o.capture = value
+		return nil
+	}
+	n, err := strconv.Atoi(value)
+	if err != nil {
+		return errors.New("Option " + name + " needs a number: " + value)
+	}
+	switch name {
+	case "wgather":
+		o.gatherKiB = n
+	case "wgatherms":
+		if n < 2 {
+			return errors.New("Option wgatherms must be at least 2")
+		}
+		o.gatherMs = n
+	case "slowms":
+		if n < 0 {
+			return errors.New("Option slowms can't be negative")
+		}
+		o.slowMs = n
+	case "iosize":
+		if n < 4 || n%4 != 0 || n*1024 > C.NFS_MAXDATA_TCP_MAX {
+			return errors.New("Option iosize must be a multiple of 4 between 4 and " +
+				strconv.Itoa(C.NFS_MAXDATA_TCP_MAX/1024))
+		}
+		o.ioKiB = n
+	default:
+		return errors.New("Not a recognized option: " + name)
+	}
+	return nil
+}
+
 func parseArgs(args []string) (minfs.MinFS, error) {
+	if len(args) == 0 {
+		return nil, errors.New("No bind type given")
+	}
 	switch args[0] {
 	case "-zip":
 		return zipfsPrep(args[1:])
+	case "-tar":
+		return tarfsPrep(args[1:])
 	case "-os":
 		return osfsPrep(args[1:])
+	case "-mem":
+		return memfsPrep(args[1:])
 	case "-shim":
 		return shimfsPrep(args[1:])
 	case "-sftp":
 		return sftpfsPrep(args[1:])
+	case "-stripe":
+		return stripefsPrep(args[1:])
+	case "-overlay":
+		return overlayfsPrep(args[1:])
+	case "-cas":
+		return casfsPrep(args[1:])
 	default:
 		return nil, errors.New("Not a recognized argument: " + args[0])
 	}
@@ -82,26 +219,42 @@ func sftpfsPrep(args []string) (minfs.MinFS, error) {
 }
 
 func osfsPrep(args []string) (minfs.MinFS, error) {
-	return osfs.New(args[0])
-}
-
-func zipfsPrep(args []string) (minfs.MinFS, error) {
-	return zipfs.New(args[0])
+	fs, err := osfs.New(args[0])
+	if err != nil {
+		return nil, err
+	}
+	return &localFS{fs, args[0]}, nil
 }
 
+//config example:   /tmp/shimfs 100 dir=10s *.jpg=1h stale=5m -sftp ...
+//any class=duration arguments between the size and the bind type set TTLs
 func shimfsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) < 3 {
+		return nil, errors.New("-shim needs a folder, a size in MiB and a bind type")
+	}
 	tempFolder := args[0]
 	cacheSize, err := strconv.Atoi(args[1])
 	if err != nil {
 		return nil, err
 	}
 
-	sub, err := parseArgs(args[2:])
+	args = args[2:]
+	meta := newMetaCache(nil)
+	for len(args) > 0 && !strings.HasPrefix(args[0], "-") {
+		if err := meta.setTTL(args[0]); err != nil {
+			return nil, err
+		}
+		args = args[1:]
+	}
+
+	sub, err := parseArgs(args)
 	if err != nil {
 		return nil, err
 	}
+	meta.MinFS = sub
 
-	retval, err := shimfs.New(tempFolder, int64(cacheSize*1024*1024), sub)
+	//metadata is cached in memory, file data in blocks on disk
+	retval, err := newBlockCache(filepath.Join(tempFolder, "blocks"), int64(cacheSize*1024*1024), meta)
 	if err != nil {
 		sub.Close()
 		return nil, err
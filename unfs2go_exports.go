@@ -1,4 +1,4 @@
-// Due to a limitation in CGO, exports must be in a separate file from func main
+//Due to a limitation in CGO, exports must be in a separate file from func main
 package main
 
 //#include "unfs3/daemon.h"
@@ -15,9 +15,6 @@ import (
 	"unsafe"
 )
 
-const PTRSIZE = 32 << uintptr(^uintptr(0)>>63) //bit size of pointers (32 or 64)
-const PTRBYTES = PTRSIZE / 8                   //bytes of the above
-
 var fddb fdCache //translator for file descriptors
 
 //export go_init
@@ -36,123 +33,66 @@ func go_accept_mount(addr C.uint32, path *C.char) C.int {
 	gpath := pathpkg.Clean("/" + C.GoString(path))
 	retVal, _ := errTranslator(nil)
 	if strings.EqualFold(hostaddress, "127.0.0.1") { //TODO: Make this configurable
-		fmt.Println("Host allowed to connect:", hostaddress, "path:", gpath)
+		lg.info("mount allowed", "host", hostaddress, "path", gpath)
 	} else {
-		fmt.Println("Host not allowed to connect:", hostaddress, "path:", gpath)
+		lg.warn("mount refused", "host", hostaddress, "path", gpath)
 		retVal, _ = errTranslator(os.ErrPermission)
 	}
 	return retVal
 }
 
-//Readdir results are in the form of two char arrays: One for the entries, and one for the actual file names
-//the names array is just the file names, places at every maxpathlen bytes
-//the entries array is made of entry structs, which are 24-bytes or 32-bytes long:
-//[8-byte inode][4-byte or 8-byte pointer to filename]
-//[8-byte cookie (entry index in directory list)][4-byte or 8-byte pointer to next entry]
-
+//go_readdir_full writes the entries of a directory from cookie on into buf,
+//already in XDR, as they go in a READDIR reply's dirlist3: for each, TRUE
+//for value_follows, then its fileid, name and cookie (its index in the
+//directory, plus one). It stops at the last entry that fits in count
+//bytes, setting used to how many that came to, and returns -1 if that
+//wasn't the end of the directory.
+//
 //export go_readdir_full
-func go_readdir_full(dirpath *C.char, cookie C.uint64, count C.uint32, names unsafe.Pointer,
-	entries unsafe.Pointer, maxpathlen C.int, maxentries C.int) C.int {
-	mp := int(maxpathlen)
-	me := int(maxentries)
-
-	entrySize := 24
-	if PTRSIZE == 64 {
-		entrySize = 32
-	}
-
-	maxByteCount := int(count)
+func go_readdir_full(dirpath *C.char, cookie C.uint64, count C.uint32, buf unsafe.Pointer, used *C.uint32) C.int {
+	*used = 0
 	startCookie := int(cookie)
-
-	nslice := &reflect.SliceHeader{Data: uintptr(names), Len: mp * me, Cap: mp * me}
-	newNames := *(*[]byte)(unsafe.Pointer(nslice))
-
-	eslice := &reflect.SliceHeader{Data: uintptr(entries), Len: entrySize * me, Cap: entrySize * me}
-	newEntries := *(*[]byte)(unsafe.Pointer(eslice))
-
-	//null out everything
-	for i := range newNames {
-		newNames[i] = 0
-	}
-	//null out everything
-	for i := range newEntries {
-		newEntries[i] = 0
-	}
-
 	dirp := pathpkg.Clean("/" + C.GoString(dirpath))
 
 	arr, err := ns.ReadDirectory(dirp)
 	if err != nil {
-	retVal, known := errTranslator(err)
-	if !known {
-			fmt.Println("Error on go_readdir_full of", dirp, ":", err)
+		retVal, known := errTranslator(err)
+		if !known {
+			lg.error("readdir failed", "path", dirp, "err", err)
 		}
 		return retVal
 	}
 
 	if startCookie > len(arr) { //if asked for a higher index than exists in dir
-		fmt.Println("Readdir got a bad cookie (", startCookie, ") for", dirp)
+		lg.warn("readdir got a bad cookie", "path", dirp, "cookie", startCookie)
 		return C.NFS3ERR_BAD_COOKIE
 	}
 
-	nbIndex := 0 //current index in names buffer
-	ebIndex := 0 //current index in entry buffer
-
-	namepointer := uint64(uintptr(names))
-	entriespointer := uint64(uintptr(entries))
-
+	out := unsafe.Slice((*byte)(buf), int(count))
+	n := 0
 	for i := startCookie; i < len(arr); i++ {
-		fi := arr[i]
-		//name string + null terminator + 2 64-bit numbers + 2 pointers
-		maxByteCount -= len(fi.Name()) + 1 + 16 + 2*PTRBYTES
-
-		if maxByteCount < 0 || (i-startCookie) >= me {
-			return -1 //signify that we didn't reach eof
-		}
-
-		if i != startCookie { //only if this isn't the first entry
-			//Put a pointer to this entry as previous entry's Next
-			if PTRSIZE == 32 {
-				binary.LittleEndian.PutUint32(newEntries[ebIndex-PTRBYTES:], uint32(entriespointer)+uint32(ebIndex))
-			} else {
-				binary.LittleEndian.PutUint64(newEntries[ebIndex-PTRBYTES:], entriespointer+uint64(ebIndex))
+		name := arr[i].Name()
+		size := C.ENTRY_SIZE + (len(name)+3)&^3
+		if n+size > len(out) {
+			if i == startCookie {
+				return C.NFS3ERR_TOOSMALL
 			}
+			*used = C.uint32(n)
+			return -1 //signify that we didn't reach eof
 		}
-
-		fp := pathpkg.Clean(dirp + "/" + fi.Name())
-
-		//Put FileID
-		fd := fddb.GetFD(fp)
-		binary.LittleEndian.PutUint64(newEntries[ebIndex:], uint64(fd))
-		ebIndex += 8
-
-		//Put Pointer to Name
-		if PTRSIZE == 32 {
-			binary.LittleEndian.PutUint32(newEntries[ebIndex:], uint32(namepointer)+uint32(nbIndex))
-		} else {
-			binary.LittleEndian.PutUint64(newEntries[ebIndex:], namepointer+uint64(nbIndex))
-		}
-		ebIndex += PTRBYTES
-
-		//Actually write Name to namebuf
-		bytCount := copy(newNames[nbIndex:], []byte(fi.Name()))
-		newNames[nbIndex+bytCount] = byte(0) //null terminate
-		nbIndex += mp
-
-		//Put Cookie
-		binary.LittleEndian.PutUint64(newEntries[ebIndex:], uint64(i+1))
-		ebIndex += 8
-
-		//Null out this pointer to "next" in case we're the last entry
-		if PTRSIZE == 32 {
-		binary.LittleEndian.PutUint32(newEntries[ebIndex:], uint32(0))
-		} else {
-			binary.LittleEndian.PutUint64(newEntries[ebIndex:], uint64(0))
+		fd := fddb.GetFD(pathpkg.Clean(dirp + "/" + name))
+		e := out[n : n+size]
+		binary.BigEndian.PutUint32(e, 1)
+		binary.BigEndian.PutUint64(e[4:], uint64(fd))
+		binary.BigEndian.PutUint32(e[12:], uint32(len(name)))
+		pad := copy(e[16:], name)
+		for ; pad%4 != 0; pad++ {
+			e[16+pad] = 0
 		}
-
-		ebIndex += PTRBYTES
+		binary.BigEndian.PutUint64(e[16+pad:], uint64(i+1))
+		n += size
 	}
-
+	*used = C.uint32(n)
 	return C.NFS3_OK
 }
 
@@ -161,7 +101,7 @@ func go_fgetpath(fd C.int) *C.char {
 	gofd := int(fd)
 	path, err := fddb.GetPath(gofd)
 	if err != nil {
-		fmt.Println("Error on go_fgetpath (fd =", gofd, " of ", fddb.FDcounter, ");", err)
+		lg.error("no path for file id", "id", gofd, "err", err)
 		return nil
 	} else {
 		//fmt.Println("go_fgetpath: Returning '", path, "' for fd:", gofd)
@@ -198,10 +138,13 @@ func go_lstat(path *C.char, buf *C.go_statstruct) C.int {
 	fi, err := ns.Stat(pp)
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on lstat of", pp, "):", err)
+		lg.error("lstat failed", "path", pp, "err", err)
 	}
 	if err == nil {
 		statTranslator(fi, fddb.GetFD(pp), buf)
+		if end := wgather.pendingEnd(pp); end > int64(buf.st_size) {
+			buf.st_size = C.uint64(end)
+		}
 	}
 	return retVal
 }
@@ -226,6 +169,23 @@ func go_shutdown() {
 	shutDown()
 }
 
+//go_log is how C logs (see logmsg in unfs3/daemon.c): a line at a syslog
+//priority, limited by the format it was made from.
+//
+//export go_log
+func go_log(prio C.int, format *C.char, msg *C.char) {
+	level := levelDebug
+	switch {
+	case prio <= C.LOG_ERR:
+		level = levelError
+	case prio == C.LOG_WARNING:
+		level = levelWarn
+	case prio <= C.LOG_INFO:
+		level = levelInfo
+	}
+	lg.log(level, C.GoString(format), C.GoString(msg), nil)
+}
+
 //export go_chmod
 func go_chmod(path *C.char, mode C.mode_t) C.int {
 	pp := pathpkg.Clean("/" + C.GoString(path))
@@ -233,7 +193,7 @@ func go_chmod(path *C.char, mode C.mode_t) C.int {
 
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on chmod of", pp, "(mode =", os.FileMode(int(mode)), "):", err)
+		lg.error("chmod failed", "path", pp, "mode", os.FileMode(int(mode)), "err", err)
 	}
 	return retVal
 }
@@ -242,11 +202,14 @@ func go_chmod(path *C.char, mode C.mode_t) C.int {
 func go_truncate(path *C.char, offset3 C.uint64) C.int {
 	pp := pathpkg.Clean("/" + C.GoString(path))
 	off := int64(offset3)
-	err := ns.SetAttribute(pp, "size", off)
+	err := wgather.flush(pp)
+	if err == nil {
+		err = ns.SetAttribute(pp, "size", off)
+	}
 
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on truncate of", pp, "(size =", off, "):", err)
+		lg.error("truncate failed", "path", pp, "size", off, "err", err)
 	}
 	return retVal
 }
@@ -260,16 +223,29 @@ func go_rename(oldpath *C.char, newpath *C.char) C.int {
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error on rename, stat", op, ":", err)
+			lg.error("rename failed at stat", "from", op, "err", err)
 		}
 		return retVal
 	}
 
-	err = ns.Move(op, np)
+	if fi.IsDir() {
+		err = wgather.flushPrefix(op)
+		readfds.dropPrefix(op)
+	} else {
+		err = wgather.flush(op)
+		readfds.drop(op)
+	}
+	//whatever np is, it's about to be replaced, so nothing gathered for it may
+	//land on what gets moved there
+	wgather.discardPrefix(np)
+	readfds.dropPrefix(np)
+	if err == nil {
+		err = ns.Move(op, np)
+	}
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error on rename, move", op, "to", np, ":", err)
+			lg.error("rename failed at move", "from", op, "to", np, "err", err)
 		}
 		return retVal
 	}
@@ -287,7 +263,7 @@ func go_modtime(path *C.char, modtime C.uint32) C.int {
 
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error setting modtime (", mod, ") on", pp, ":", err)
+		lg.error("setting modtime failed", "path", pp, "modtime", mod, "err", err)
 	}
 	return retVal
 }
@@ -300,7 +276,7 @@ func go_create(pathname *C.char, mode C.mode_t) C.int {
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error go_create file at create: ", pp, " due to: ", err)
+			lg.error("create failed", "path", pp, "err", err)
 		}
 		return retVal
 	}
@@ -308,7 +284,7 @@ func go_create(pathname *C.char, mode C.mode_t) C.int {
 	err = ns.SetAttribute(pp, "mode", os.FileMode(int(mode)))
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on go_create file at setmode:", pp, "(mode =", os.FileMode(int(mode)), "):", err)
+		lg.error("create failed at setmode", "path", pp, "mode", os.FileMode(int(mode)), "err", err)
 	}
 	return retVal
 }
@@ -320,15 +296,17 @@ func go_createover(pathname *C.char, mode C.mode_t) C.int {
 	fi, err := ns.Stat(pp)
 	if err == nil {
 		if fi.IsDir() {
-			fmt.Println("Error go_createover file: ", pp, " due to: Name of a pre-existing directory")
+			lg.warn("createover of a directory", "path", pp)
 			return C.NFS3ERR_ISDIR
 		}
 
+		wgather.discard(pp)
+		readfds.drop(pp)
 		err = ns.Remove(pp)
 		if err != nil {
 			retVal, known := errTranslator(err)
 			if !known {
-				fmt.Println("Error go_createover file at remove: ", pp, " due to: ", err)
+				lg.error("createover failed at remove", "path", pp, "err", err)
 			}
 			return retVal
 		}
@@ -338,7 +316,7 @@ func go_createover(pathname *C.char, mode C.mode_t) C.int {
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error go_createover file at create: ", pp, " due to: ", err)
+			lg.error("createover failed at create", "path", pp, "err", err)
 		}
 		return retVal
 	}
@@ -346,7 +324,7 @@ func go_createover(pathname *C.char, mode C.mode_t) C.int {
 	err = ns.SetAttribute(pp, "mode", os.FileMode(int(mode)))
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on go_createover file at setmode:", pp, "(mode =", os.FileMode(int(mode)), "):", err)
+		lg.error("createover failed at setmode", "path", pp, "mode", os.FileMode(int(mode)), "err", err)
 	}
 	return retVal
 }
@@ -360,7 +338,7 @@ func go_remove(path *C.char) C.int {
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error removing file: ", pp, "\n", err)
+			lg.error("remove failed", "path", pp, "err", err)
 		}
 		return retVal
 	}
@@ -370,10 +348,12 @@ func go_remove(path *C.char) C.int {
 		return C.NFS3ERR_ISDIR
 	}
 
+	wgather.discard(pp)
+	readfds.drop(pp)
 	err = ns.Remove(pp)
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error removing file: ", pp, "\n", err)
+		lg.error("remove failed", "path", pp, "err", err)
 	}
 	return retVal
 }
@@ -387,7 +367,7 @@ func go_rmdir(path *C.char) C.int {
 	if err != nil {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error removing directory: ", pp, "\n", err)
+			lg.error("rmdir failed", "path", pp, "err", err)
 		}
 		return retVal
 	}
@@ -400,7 +380,7 @@ func go_rmdir(path *C.char) C.int {
 	err = ns.Remove(pp)
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error removing directory: ", pp, "\n", err)
+		lg.error("rmdir failed", "path", pp, "err", err)
 	}
 	return retVal
 }
@@ -412,7 +392,7 @@ func go_mkdir(path *C.char, mode C.mode_t) C.int {
 
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error making directory: ", pp, "\n", err)
+		lg.error("mkdir failed", "path", pp, "err", err)
 	}
 	return retVal
 }
@@ -420,12 +400,15 @@ func go_mkdir(path *C.char, mode C.mode_t) C.int {
 //export go_nop
 func go_nop(name *C.char) C.int {
 	pp := C.GoString(name)
-	fmt.Println("Unsupported Command: ", pp)
+	lg.warn("unsupported command", "name", pp)
 	return -1
 }
 
+//stable comes in as the stable_how the client asked for, and goes
+//back out as the one we actually achieved (UNSTABLE if the data was gathered).
+//
 //export go_pwrite
-func go_pwrite(path *C.char, buf unsafe.Pointer, count C.u_int, offset C.uint64) C.int {
+func go_pwrite(path *C.char, buf unsafe.Pointer, count C.u_int, offset C.uint64, stable *C.int) C.int {
 	pp := pathpkg.Clean("/" + C.GoString(path))
 	off := int64(offset)
 	counted := int(count)
@@ -433,11 +416,26 @@ func go_pwrite(path *C.char, buf unsafe.Pointer, count C.u_int, offset C.uint64)
 	//prepare the provided buffer for use
 	slice := &reflect.SliceHeader{Data: uintptr(buf), Len: counted, Cap: counted}
 	cbuf := *(*[]byte)(unsafe.Pointer(slice))
-	copiedBytes, err := ns.WriteFile(pp, cbuf, off)
+
+	var copiedBytes int
+	var err error
+	if wgather != nil && *stable == C.UNSTABLE {
+		err = wgather.write(pp, cbuf, off)
+		if err == nil {
+			copiedBytes = counted
+		}
+	} else {
+		//anything gathered earlier has to land before this stable write does
+		err = wgather.flush(pp)
+		if err == nil {
+			copiedBytes, err = ns.WriteFile(pp, cbuf, off)
+		}
+		*stable = C.FILE_SYNC
+	}
 	if err != nil && !strings.Contains(strings.ToLower(err.Error()), "eof") {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error on pwrite of", pp, "(start =", off, "count =", counted, "copied =", copiedBytes, "):", err)
+			lg.error("pwrite failed", "path", pp, "start", off, "count", counted, "copied", copiedBytes, "err", err)
 		}
 		//because a successful pwrite can return any non-negative number
 		//we can't return standard NF3 errors (which are all positive)
@@ -459,11 +457,18 @@ func go_pread(path *C.char, buf unsafe.Pointer, count C.uint32, offset C.uint64)
 	slice := &reflect.SliceHeader{Data: uintptr(buf), Len: counted, Cap: counted}
 	cbuf := *(*[]byte)(unsafe.Pointer(slice))
 
+	if err := wgather.flush(pp); err != nil {
+		retVal, known := errTranslator(err)
+		if !known {
+			lg.error("pread failed flushing gathered writes", "path", pp, "err", err)
+		}
+		return -retVal
+	}
 	copiedBytes, err := ns.ReadFile(pp, cbuf, off)
 	if err != nil && !strings.Contains(strings.ToLower(err.Error()), "eof") {
 		retVal, known := errTranslator(err)
 		if !known {
-			fmt.Println("Error on pread of", pp, "(start =", off, "count =", counted, "copied =", copiedBytes, "):", err)
+			lg.error("pread failed", "path", pp, "start", off, "count", counted, "copied", copiedBytes, "err", err)
 		}
 		//because a successful pread can return any non-negative number
 		//we can't return standard NF3 errors (which are all positive)
@@ -474,13 +479,46 @@ func go_pread(path *C.char, buf unsafe.Pointer, count C.uint32, offset C.uint64)
 	return C.int(copiedBytes)
 }
 
+//go_read_fd hands C a descriptor it can sendfile path's data from, and the
+//file's size, or returns -1 when the backend can't do that (C then reads the
+//usual way, which also reports any error).
+//
+//export go_read_fd
+func go_read_fd(path *C.char, size *C.uint64) C.int {
+	src, ok := backend.(fdSource)
+	if !ok {
+		return -1
+	}
+	pp := pathpkg.Clean("/" + C.GoString(path))
+	if err := wgather.flush(pp); err != nil {
+		return -1
+	}
+	f, fi, err := readfds.get(src, pp)
+	if err != nil || !fi.Mode().IsRegular() {
+		return -1
+	}
+	*size = C.uint64(fi.Size())
+	return C.int(f.Fd())
+}
+
 //export go_sync
 func go_sync(path *C.char, buf *C.go_statstruct) C.int {
 	pp := pathpkg.Clean("/" + C.GoString(path))
+	err := wgather.flush(pp)
+	if s, ok := backend.(syncer); ok && err == nil {
+		err = s.Sync(pp)
+	}
+	if err != nil {
+		retVal, known := errTranslator(err)
+		if !known {
+			lg.error("sync failed flushing held back writes", "path", pp, "err", err)
+		}
+		return retVal
+	}
 	fi, err := ns.Stat(pp)
 	retVal, known := errTranslator(err)
 	if !known {
-		fmt.Println("Error on sync of", pp, ":", err)
+		lg.error("sync failed", "path", pp, "err", err)
 	}
 	if err == nil {
 		statTranslator(fi, fddb.GetFD(pp), buf)
@@ -20,7 +20,7 @@ static post_op_attr error_attr = { FALSE };
 post_op_attr get_post(const char *path, struct svc_req * req)
 {
 	go_statstruct buf;
-    if (go_lstat(path, &buf) != NFS3_OK) {
+    if (GO_TIMED(go_lstat, (path, &buf)) != NFS3_OK) {
 		return error_attr;
     }
 	
@@ -57,7 +57,7 @@ pre_op_attr get_pre(const char *path)
     pre_op_attr result;
 	go_statstruct buf;
 	
-    if (go_lstat(path, &buf) != NFS3_OK) {
+    if (GO_TIMED(go_lstat, (path, &buf)) != NFS3_OK) {
 	result.attributes_follow = FALSE;
 	return result;
     }
@@ -0,0 +1,227 @@
+/*
+ * UNFS3 call capture
+ *
+ * With capture on, every call the dispatchers handle is recorded: when it
+ * came, counted from when capture began, over which connection, its
+ * program, version and procedure, its arguments as XDR (without the RPC
+ * header and credentials), the status it got and how long it took. File
+ * handles only mean something to the server that gave them out, so each
+ * time one resolves to a path it hasn't been recorded with, a record
+ * saying so goes ahead of the call's, and a replay can look the same path
+ * up on another server.
+ *
+ * Records are copied into a byte ring that a Go goroutine drains to the
+ * capture file. As with the slow call log, the dispatching thread is the
+ * only producer and the drainer the only consumer; a call that doesn't fit
+ * while the ring is full is counted and dropped, along with its handles.
+ *
+ * All numbers are big-endian. A call record is its type, the offset and
+ * duration in ns (64 bits each), connection, flags, program, version,
+ * procedure, status and argument length, then the arguments; a handle
+ * record is its type, the handle's length and bytes, and the path's.
+ *
+ * see file LICENSE for license details
+ */
+
+#define CAPTURE_CALL_HEAD 48
+
+static char *capture_ring;
+static uint64 capture_size;
+static uint64 capture_head, capture_tail;	/* head written by the dispatcher, tail by the drainer */
+static uint64 capture_drops;
+static uint64 capture_start;
+
+/* handles resolved during the current call */
+static struct {
+    char fh[NFS3_FHSIZE];
+    u_int fh_len;
+    uint64 ino;
+    uint32 hash;
+    char path[NFS_MAXPATHLEN];
+} capture_maps[CAPTURE_MAPS];
+static int capture_nmaps;
+
+/* by file ID, a hash of the path it was last recorded with, 0 for none */
+static uint32 *capture_seen;
+static uint64 capture_seen_len;
+
+/* where arguments are encoded */
+static char *capture_args;
+static u_int capture_args_len;
+
+bool_t capture_init(uint64 size)
+{
+    capture_ring = malloc(size);
+    if (!capture_ring)
+	return FALSE;
+    capture_size = size;
+    capture_start = metrics_now();
+    return TRUE;
+}
+
+static uint32 capture_hash(const char *path)
+{
+    uint32 h = 2166136261U;
+
+    while (*path)
+	h = (h ^ (unsigned char) *path++) * 16777619U;
+    return h ? h : 1;
+}
+
+void capture_handle(nfs_fh3 fh, uint64 ino, const char *path)
+{
+    uint32 hash;
+    int i;
+
+    if (!capture_ring || !path || capture_nmaps == CAPTURE_MAPS ||
+	fh.data.data_len > NFS3_FHSIZE || strlen(path) >= NFS_MAXPATHLEN)
+	return;
+    hash = capture_hash(path);
+    if (ino < capture_seen_len && capture_seen[ino] == hash)
+	return;
+    for (i = 0; i < capture_nmaps; i++)
+	if (capture_maps[i].ino == ino && capture_maps[i].hash == hash)
+	    return;
+    memcpy(capture_maps[i].fh, fh.data.data_val, fh.data.data_len);
+    capture_maps[i].fh_len = fh.data.data_len;
+    capture_maps[i].ino = ino;
+    capture_maps[i].hash = hash;
+    strcpy(capture_maps[i].path, path);
+    capture_nmaps++;
+}
+
+/* mark ino as recorded with hash, growing the table to take it */
+static void capture_saw(uint64 ino, uint32 hash)
+{
+    uint64 len = capture_seen_len ? capture_seen_len : 4096;
+    uint32 *seen;
+
+    while (len <= ino)
+	len *= 2;
+    if (len != capture_seen_len) {
+	seen = realloc(capture_seen, len * sizeof(uint32));
+	if (!seen)
+	    return;
+	memset(seen + capture_seen_len, 0,
+	       (len - capture_seen_len) * sizeof(uint32));
+	capture_seen = seen;
+	capture_seen_len = len;
+    }
+    capture_seen[ino] = hash;
+}
+
+static void capture_put(uint64 * head, const void *p, u_int len)
+{
+    uint64 at = *head % capture_size;
+    u_int first = len;
+
+    if (first > capture_size - at)
+	first = capture_size - at;
+    memcpy(capture_ring + at, p, first);
+    memcpy(capture_ring, (const char *) p + first, len - first);
+    *head += len;
+}
+
+static void capture_put32(uint64 * head, uint32 v)
+{
+    v = htonl(v);
+    capture_put(head, &v, 4);
+}
+
+static void capture_put64(uint64 * head, uint64 v)
+{
+    capture_put32(head, v >> 32);
+    capture_put32(head, (uint32) v);
+}
+
+void capture_call(struct svc_req *rqstp, xdrproc_t xdr_args, void *args,
+		  int status, uint64 start)
+{
+    SVCXPRT *xprt = rqstp->rq_xprt;
+    uint64 head, total, end = metrics_now();
+    u_int len, conn, flags = 0;
+    uint32 xid;
+    char *grown;
+    XDR xdrs;
+    int i;
+
+    if (!capture_ring)
+	return;
+
+    len = xdr_sizeof(xdr_args, args);
+    if (len > capture_args_len) {
+	grown = realloc(capture_args, len);
+	if (!grown)
+	    goto drop;
+	capture_args = grown;
+	capture_args_len = len;
+    }
+    xdrmem_create(&xdrs, capture_args, len, XDR_ENCODE);
+    if (!xdr_args(&xdrs, args))
+	goto drop;
+
+    if (svcstream_xid(xprt, &xid))
+	conn = xprt->xp_sock;
+    else {
+	conn = ntohs(((struct sockaddr_in *) svc_getcaller(xprt))->sin_port);
+	flags = CAPTURE_UDP;
+    }
+
+    total = CAPTURE_CALL_HEAD + len;
+    for (i = 0; i < capture_nmaps; i++)
+	total += 12 + capture_maps[i].fh_len + strlen(capture_maps[i].path);
+    head = capture_head;
+    if (total > capture_size -
+	(head - __atomic_load_n(&capture_tail, __ATOMIC_ACQUIRE)))
+	goto drop;
+
+    for (i = 0; i < capture_nmaps; i++) {
+	capture_put32(&head, CAPTURE_MAP);
+	capture_put32(&head, capture_maps[i].fh_len);
+	capture_put(&head, capture_maps[i].fh, capture_maps[i].fh_len);
+	capture_put32(&head, strlen(capture_maps[i].path));
+	capture_put(&head, capture_maps[i].path, strlen(capture_maps[i].path));
+	capture_saw(capture_maps[i].ino, capture_maps[i].hash);
+    }
+    capture_put32(&head, CAPTURE_CALL);
+    capture_put64(&head, start - capture_start);
+    capture_put64(&head, end - start);
+    capture_put32(&head, conn);
+    capture_put32(&head, flags);
+    capture_put32(&head, rqstp->rq_prog);
+    capture_put32(&head, rqstp->rq_vers);
+    capture_put32(&head, rqstp->rq_proc);
+    capture_put32(&head, status);
+    capture_put32(&head, len);
+    capture_put(&head, capture_args, len);
+    __atomic_store_n(&capture_head, head, __ATOMIC_RELEASE);
+    capture_nmaps = 0;
+    return;
+
+  drop:
+    __atomic_store_n(&capture_drops, capture_drops + 1, __ATOMIC_RELAXED);
+    capture_nmaps = 0;
+}
+
+u_int capture_take(char *buf, u_int len)
+{
+    uint64 tail = capture_tail;
+    uint64 avail = __atomic_load_n(&capture_head, __ATOMIC_ACQUIRE) - tail;
+    uint64 at = tail % capture_size;
+    u_int first;
+
+    if (avail < len)
+	len = avail;
+    first = len;
+    if (first > capture_size - at)
+	first = capture_size - at;
+    memcpy(buf, capture_ring + at, first);
+    memcpy(buf + first, capture_ring, len - first);
+    __atomic_store_n(&capture_tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+uint64 capture_dropped(void)
+{
+    return __atomic_load_n(&capture_drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,33 @@
+/*
+ * UNFS3 call capture
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_CAPTURE_H
+#define UNFS3_CAPTURE_H
+
+/* record types, and call flags */
+#define CAPTURE_CALL 1
+#define CAPTURE_MAP 2
+#define CAPTURE_UDP 1
+
+/* handles resolved in one call that get recorded with it, at most */
+#define CAPTURE_MAPS 4
+
+/* turn capture on, with a ring of size bytes; set once before the server starts */
+bool_t capture_init(uint64 size);
+
+/* note that fh, for file ID ino, was resolved to path */
+void capture_handle(nfs_fh3 fh, uint64 ino, const char *path);
+
+/* record a call begun at start, with status -1 if its result has none */
+void capture_call(struct svc_req *rqstp, xdrproc_t xdr_args, void *args,
+		  int status, uint64 start);
+
+/* move up to len bytes of records out of the ring into buf */
+u_int capture_take(char *buf, u_int len);
+
+/* calls that were dropped because the ring was full */
+uint64 capture_dropped(void);
+
+#endif
@@ -10,12 +10,22 @@
 #include <stdio.h>
 #include <rpc/rpc.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include "daemon.h"
 #include "fh.c"
 #include "xdr.c"
 #include "attr.c"
 #include "nfs.c"
 #include "mount.c"
+#include "xprt.c"
+#include "iobuf.c"
+#include "metrics.c"
+#include "slowlog.c"
+#include "capture.c"
 
 #define UNFS_NAME "UNFS3 to Golang Backend\n"
 
@@ -32,6 +42,7 @@ int opt_brute_force = FALSE;
 int opt_testconfig = FALSE;
 struct in_addr opt_bind_addr;
 int opt_readable_executables = FALSE;
+unsigned int opt_iosize = NFS_MAXDATA_TCP;	/* TCP rtmax and wtmax */
 char *opt_pid_file = NULL;
 
 /* Register with portmapper? */
@@ -63,13 +74,28 @@ int get_socket_type(struct svc_req *rqstp)
 #endif
 
     if (res < 0) {
-	fprintf(stderr, "unable to determine socket type\n");
+	logmsg(LOG_ERR, "unable to determine socket type");
 	return -1;
     }
 
     return v;
 }
 
+/*
+ * log a line through the Go side's logger, which only queues it; lines
+ * are rate limited by the format they were made from
+ */
+void logmsg(int prio, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    go_log(prio, (char *) fmt, buf);
+}
+
 /*
  * signal handler and error exit function
  */
@@ -88,6 +114,7 @@ void daemon_exit(int error)
 	svc_unregister(NFS3_PROGRAM, NFS_V3);
     }
 
+    /* not logmsg, which is no place to be going from a SIGSEGV */
     if (error == SIGSEGV)
 	fprintf(stderr, "segmentation fault\n");
 
@@ -99,6 +126,20 @@ void daemon_exit(int error)
     exit(1);
 }
 
+/*
+ * bytes of the current call and its reply, for metrics: whole records on
+ * TCP, and just the arguments and results on UDP, whose transport doesn't
+ * tell us its datagram sizes
+ */
+static void call_sizes(SVCXPRT * transp, xdrproc_t xdr_args, void *args,
+		       xdrproc_t xdr_res, void *res, u_int * in, u_int * out)
+{
+    if (svcstream_sizes(transp, in, out))
+	return;
+    *in = xdr_sizeof(xdr_args, args);
+    *out = res ? xdr_sizeof(xdr_res, res) : 0;
+}
+
 /*
  * NFS service dispatch function
  * generated by rpcgen
@@ -131,6 +172,9 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
     char *(*local) (char *, struct svc_req *);
+    uint64 start, go_start;
+    u_int in, out;
+    int status;
 		
 	//fprintf(stderr,  "NFS command %i\n", rqstp->rq_proc);
 	
@@ -246,7 +290,7 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 
 	case NFSPROC3_READDIR:
 	    _xdr_argument = (xdrproc_t) xdr_READDIR3args;
-	    _xdr_result = (xdrproc_t) xdr_READDIR3res;
+	    _xdr_result = (xdrproc_t) xdr_READDIR3res_direct;
 	    local =
 		(char *(*)(char *, struct svc_req *)) nfsproc3_readdir_3_svc;
 	    break;
@@ -290,20 +334,34 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	    svcerr_noproc(transp);
 	    return;
     }
+    start = metrics_begin();
+    go_start = metrics_go_ns;
+    slowlog_begin(rqstp, METRICS_NFS + rqstp->rq_proc, start);
     memset((char *) &argument, 0, sizeof(argument));
     if (!svc_getargs(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	svcerr_decode(transp);
+	metrics_garbage(METRICS_NFS + rqstp->rq_proc);
 	return;
     }
+    slowlog_phase(SLOWLOG_DECODE);
     result = (*local) ((char *) &argument, rqstp);
+    slowlog_phase(SLOWLOG_RUN);
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 		svcerr_systemerr(transp);
-		fprintf(stderr, "%s\n", "unable to send NFS RPC reply");
+		logmsg(LOG_ERR, "unable to send NFS RPC reply");
 	}
+    slowlog_phase(SLOWLOG_SEND);
+    /* every result but NULL's starts with its nfsstat3 */
+    status = result && rqstp->rq_proc != NFSPROC3_NULL ? *(int *) result : -1;
+    call_sizes(transp, _xdr_argument, &argument, _xdr_result, result, &in, &out);
+    metrics_call(METRICS_NFS + rqstp->rq_proc, start, go_start, status, in, out);
+    slowlog_end();
+    capture_call(rqstp, _xdr_argument, &argument, status, start);
     if (!svc_freeargs (transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
-		fprintf(stderr, "%s\n", "unable to free NFS XDR arguments");
+		logmsg(LOG_ERR, "unable to free NFS XDR arguments");
 	}
+    iobuf_reply_done();
     return;
 }
  
@@ -320,6 +378,9 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
     char *(*local) (char *, struct svc_req *);
+    uint64 start, go_start;
+    u_int in, out;
+    int status;
 
 	//fprintf(stderr,  "Mount command %i\n", rqstp->rq_proc);
 	
@@ -368,19 +429,34 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
 	    svcerr_noproc(transp);
 	    return;
     }
+    start = metrics_begin();
+    go_start = metrics_go_ns;
+    slowlog_begin(rqstp, METRICS_MOUNT + rqstp->rq_proc, start);
     memset((char *) &argument, 0, sizeof(argument));
     if (!svc_getargs(transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
 	svcerr_decode(transp);
+	metrics_garbage(METRICS_MOUNT + rqstp->rq_proc);
 	return;
     }
+    slowlog_phase(SLOWLOG_DECODE);
+    if (rqstp->rq_proc == MOUNTPROC_MNT)
+	slowlog_path(argument.mountproc_mnt_3_arg);
     result = (*local) ((char *) &argument, rqstp);
+    slowlog_phase(SLOWLOG_RUN);
     if (result != NULL &&
 	!svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
 		svcerr_systemerr(transp);
-		fprintf(stderr, "unable to send Mount RPC reply\n");
+		logmsg(LOG_ERR, "unable to send Mount RPC reply");
     }
+    slowlog_phase(SLOWLOG_SEND);
+    /* of the results, only MNT's has a status */
+    status = result && rqstp->rq_proc == MOUNTPROC_MNT ? *(int *) result : -1;
+    call_sizes(transp, _xdr_argument, &argument, _xdr_result, result, &in, &out);
+    metrics_call(METRICS_MOUNT + rqstp->rq_proc, start, go_start, status, in, out);
+    slowlog_end();
+    capture_call(rqstp, _xdr_argument, &argument, status, start);
     if (!svc_freeargs (transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
-		fprintf(stderr, "unable to free Mount XDR arguments\n");
+		logmsg(LOG_ERR, "unable to free Mount XDR arguments");
     }
     return;
 }
@@ -396,8 +472,7 @@ static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (udptransp, NFS3_PROGRAM, NFS_V3, nfs3_program_3,
 	     opt_portmapper ? IPPROTO_UDP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (NFS3_PROGRAM, NFS_V3, udp).");
+	    logmsg(LOG_ERR, "unable to register (NFS3_PROGRAM, NFS_V3, udp)");
 	    daemon_exit(0);
 	}
     }
@@ -407,8 +482,7 @@ static void register_nfs_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (tcptransp, NFS3_PROGRAM, NFS_V3, nfs3_program_3,
 	     opt_portmapper ? IPPROTO_TCP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (NFS3_PROGRAM, NFS_V3, tcp).");
+	    logmsg(LOG_ERR, "unable to register (NFS3_PROGRAM, NFS_V3, tcp)");
 	    daemon_exit(0);
 	}
     }
@@ -426,8 +500,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (udptransp, MOUNTPROG, MOUNTVERS1, mountprog_3,
 	     opt_portmapper ? IPPROTO_UDP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (MOUNTPROG, MOUNTVERS1, udp).");
+	    logmsg(LOG_ERR, "unable to register (MOUNTPROG, MOUNTVERS1, udp)");
 	    daemon_exit(0);
 	}
 
@@ -435,8 +508,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (udptransp, MOUNTPROG, MOUNTVERS3, mountprog_3,
 	     opt_portmapper ? IPPROTO_UDP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (MOUNTPROG, MOUNTVERS3, udp).");
+	    logmsg(LOG_ERR, "unable to register (MOUNTPROG, MOUNTVERS3, udp)");
 	    daemon_exit(0);
 	}
     }
@@ -446,8 +518,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (tcptransp, MOUNTPROG, MOUNTVERS1, mountprog_3,
 	     opt_portmapper ? IPPROTO_TCP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (MOUNTPROG, MOUNTVERS1, tcp).");
+	    logmsg(LOG_ERR, "unable to register (MOUNTPROG, MOUNTVERS1, tcp)");
 	    daemon_exit(0);
 	}
 
@@ -455,8 +526,7 @@ static void register_mount_service(SVCXPRT * udptransp, SVCXPRT * tcptransp)
 	if (!svc_register
 	    (tcptransp, MOUNTPROG, MOUNTVERS3, mountprog_3,
 	     opt_portmapper ? IPPROTO_TCP : 0)) {
-	    fprintf(stderr, "%s\n",
-		    "unable to register (MOUNTPROG, MOUNTVERS3, tcp).");
+	    logmsg(LOG_ERR, "unable to register (MOUNTPROG, MOUNTVERS3, tcp)");
 	    daemon_exit(0);
 	}
     }
@@ -481,16 +551,16 @@ static SVCXPRT *create_udp_transport(unsigned int port)
 	sock = socket(PF_INET, SOCK_DGRAM, 0);
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
 	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
-	    perror("bind");
-	    fprintf(stderr, "Couldn't bind to udp port %d\n", port);
-	    exit(1);
+	    logmsg(LOG_ERR, "Couldn't bind to udp port %d: %s", port,
+		   strerror(errno));
+	    daemon_exit(0);
 	}
     }
 
     transp = svcudp_bufcreate(sock, NFS_MAX_UDP_PACKET, NFS_MAX_UDP_PACKET);
 
     if (transp == NULL) {
-	fprintf(stderr, "%s\n", "cannot create udp service.");
+	logmsg(LOG_ERR, "cannot create udp service");
 	daemon_exit(0);
     }
 
@@ -516,16 +586,16 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
 	sock = socket(PF_INET, SOCK_STREAM, 0);
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
 	if (bind(sock, (struct sockaddr *) &sin, sizeof(struct sockaddr))) {
-	    perror("bind");
-	    fprintf(stderr, "Couldn't bind to tcp port %d\n", port);
-	    exit(1);
+	    logmsg(LOG_ERR, "Couldn't bind to tcp port %d: %s", port,
+		   strerror(errno));
+	    daemon_exit(0);
 	}
     }
 
-    transp = svctcp_create(sock, 0, 0);
+    transp = svcstream_create(sock);
 
     if (transp == NULL) {
-	fprintf(stderr, "%s\n", "cannot create tcp service.");
+	logmsg(LOG_ERR, "cannot create tcp service");
 	daemon_exit(0);
     }
 
@@ -551,7 +621,7 @@ static void unfs3_svc_run(void)
 		if (errno == EINTR) {
 		    continue;
 		}
-		perror("unfs3_svc_run: poll failed");
+		logmsg(LOG_ERR, "unfs3_svc_run: poll failed: %s", strerror(errno));
 		return;
 	}
 	else if (r)
@@ -571,7 +641,7 @@ static void unfs3_svc_run(void)
 		if (errno == EINTR) {
 		    continue;
 		}
-		perror("unfs3_svc_run: select failed");
+		logmsg(LOG_ERR, "unfs3_svc_run: select failed: %s", strerror(errno));
 		return;
 	    case 0:
 		/* timeout */
@@ -587,8 +657,10 @@ static void start(void) {
 	//printf("start\n");
 	register SVCXPRT *tcptransp = NULL, *udptransp = NULL;
     go_init();
+	regen_write_verf();
 	//printf("backend inited\n");
 	setvbuf(stdout, NULL, _IOLBF, 0);
+	iobuf_init(opt_iosize);
 	udptransp = create_udp_transport(2049);
     tcptransp = create_tcp_transport(2049);
 	//printf("transports created\n");
@@ -7,6 +7,7 @@
 #ifndef UNFS3_DAEMON_H
 #define UNFS3_DAEMON_H
 
+#include <syslog.h>
 #include "nfs.h"
 #include "../gosupport.h"
 #include "mount.h"
@@ -14,6 +15,11 @@
 #include "xdr.h"
 #include "attr.h"
 #include "mount.h"
+#include "xprt.h"
+#include "iobuf.h"
+#include "metrics.h"
+#include "slowlog.h"
+#include "capture.h"
 
 /* exit status for internal errors */
 #define CRISIS	99
@@ -21,6 +27,9 @@
 /* error handling */
 void daemon_exit(int);
 
+/* log at a syslog priority, through the Go side's queued logger */
+void logmsg(int prio, const char *fmt, ...);
+
 /* remote address */
 struct in_addr get_remote(struct svc_req *);
 int get_socket_type(struct svc_req *rqstp);
@@ -33,5 +42,6 @@ extern char	*opt_cluster_path;
 extern int	opt_singleuser;
 extern int	opt_brute_force;
 extern int	opt_readable_executables;
+extern unsigned int opt_iosize;
 
 #endif
@@ -44,6 +44,9 @@ char *go_fgetpath(int inode);
  */
 char *fh_decomp(nfs_fh3 fh)
 {
+    uint64 start = slowlog_clock();
+    char *path;
+
     if (!nfh_valid(fh)) {
 		return NULL;
     }
@@ -51,9 +54,13 @@ char *fh_decomp(nfs_fh3 fh)
     unfs3_fh_t *obj = (void *) fh.data.data_val;
 	
 	if (obj->len == 0)   //root
-		return "/";
-	
-	return go_fgetpath(obj->ino);
+		path = "/";
+	else
+		path = GO_TIMED(go_fgetpath, (obj->ino));
+
+	slowlog_resolved(start, path);
+	capture_handle(fh, obj->ino, path);
+	return path;
 }
 
 //Create new filehandle
@@ -94,7 +101,7 @@ post_op_fh3 fh_comp_type(const char *path, unsigned int type)
     post_op_fh3 result;
     go_statstruct buf;
 
-    if (go_lstat(path, &buf) != NFS3_OK || (buf.st_mode & type) != type) {
+    if (GO_TIMED(go_lstat, (path, &buf)) != NFS3_OK || (buf.st_mode & type) != type) {
 		result.handle_follows = FALSE;
 		return result;
     }
@@ -0,0 +1,101 @@
+
+/*
+ * UNFS3 I/O buffer pool
+ *
+ * READ data and large call records need buffers the size of a whole
+ * transfer, up to several MiB. Rather than malloc and free those per
+ * call, a few are carved out of one region that is aligned and advised
+ * for transparent huge pages, which keeps the page faults and TLB misses
+ * of touching them down. The server handles one call at a time, so a
+ * small pool is plenty; if it ever runs dry, plain malloc takes over.
+ *
+ * see file LICENSE for license details
+ */
+#include <sys/mman.h>
+
+#define IOBUF_COUNT 4
+#define IOBUF_ALIGN (2 * 1024 * 1024)
+
+/* at most one READ buffer per reply, but leave room */
+#define IOBUF_REPLY_MAX 4
+
+unsigned int iobuf_size;
+
+static char *iobuf_region;
+static char *iobuf_free[IOBUF_COUNT];
+static int iobuf_nfree;
+
+static char *iobuf_held[IOBUF_REPLY_MAX];
+static int iobuf_nheld;
+
+/*
+ * set up the pool for transfers of up to iosize bytes
+ */
+void iobuf_init(unsigned int iosize)
+{
+    size_t len;
+    int i;
+
+    /* whole pages, so every buffer starts page aligned */
+    iobuf_size = (iosize + IOBUF_SLACK + 4095) & ~4095U;
+    len = (size_t) iobuf_size * IOBUF_COUNT;
+    len = (len + IOBUF_ALIGN - 1) & ~((size_t) IOBUF_ALIGN - 1);
+
+    if (posix_memalign((void **) &iobuf_region, IOBUF_ALIGN, len) != 0) {
+	/* not fatal, iobuf_get falls back to malloc */
+	logmsg(LOG_WARNING, "unable to allocate I/O buffer pool");
+	iobuf_region = NULL;
+	return;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(iobuf_region, len, MADV_HUGEPAGE);
+#endif
+
+    for (i = 0; i < IOBUF_COUNT; i++)
+	iobuf_free[i] = iobuf_region + (size_t) i * iobuf_size;
+    iobuf_nfree = IOBUF_COUNT;
+}
+
+static int iobuf_pooled(char *buf)
+{
+    return iobuf_region && buf >= iobuf_region &&
+	buf < iobuf_region + (size_t) iobuf_size * IOBUF_COUNT;
+}
+
+/*
+ * get a buffer of iobuf_size bytes, or NULL if memory ran out
+ */
+char *iobuf_get(void)
+{
+    if (iobuf_nfree > 0)
+	return iobuf_free[--iobuf_nfree];
+    return malloc(iobuf_size);
+}
+
+void iobuf_put(char *buf)
+{
+    if (!buf)
+	return;
+    if (iobuf_pooled(buf))
+	iobuf_free[iobuf_nfree++] = buf;
+    else
+	free(buf);
+}
+
+char *iobuf_reply(void)
+{
+    char *buf;
+
+    if (iobuf_nheld == IOBUF_REPLY_MAX)
+	return NULL;
+    buf = iobuf_get();
+    if (buf)
+	iobuf_held[iobuf_nheld++] = buf;
+    return buf;
+}
+
+void iobuf_reply_done(void)
+{
+    while (iobuf_nheld > 0)
+	iobuf_put(iobuf_held[--iobuf_nheld]);
+}
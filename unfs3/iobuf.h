@@ -0,0 +1,26 @@
+/*
+ * UNFS3 I/O buffer pool
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_IOBUF_H
+#define UNFS3_IOBUF_H
+
+/* room beyond the data for RPC and NFS headers of a whole call or reply */
+#define IOBUF_SLACK 65536
+
+/* size of every buffer, a whole transfer plus IOBUF_SLACK */
+extern unsigned int iobuf_size;
+
+void iobuf_init(unsigned int iosize);
+char *iobuf_get(void);
+void iobuf_put(char *buf);
+
+/*
+ * buffers that only have to live until the current reply is sent; the
+ * dispatcher hands them all back with iobuf_reply_done
+ */
+char *iobuf_reply(void);
+void iobuf_reply_done(void);
+
+#endif
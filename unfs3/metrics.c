@@ -0,0 +1,198 @@
+/*
+ * UNFS3 call metrics
+ *
+ * Every call through the NFS and MOUNT dispatchers is counted by
+ * procedure: how many, how they ended, bytes each way, and a histogram of
+ * how long they took, with the part spent in Go exports (the cgo crossing
+ * and the backend) kept apart from the rest. Each thread that dispatches
+ * counts into a block of its own, which only it writes, with plain
+ * relaxed stores, so counting never takes a lock or shares a cache line;
+ * metrics_read adds the blocks up for whoever asks.
+ *
+ * see file LICENSE for license details
+ */
+
+struct metrics_block {
+    struct metrics_proc procs[METRICS_PROCS];
+    uint64 busy;		/* begun less finished, wrapping below zero */
+    struct metrics_block *next;
+};
+
+/* every thread's block, newest first; only ever added to */
+static struct metrics_block *metrics_blocks;
+static __thread struct metrics_block *metrics_mine;
+
+uint64 metrics_go_ns;
+
+#define METRICS_ADD(counter, n) \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define METRICS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#define METRICS_NAME(x) { x, #x }
+
+static const struct {
+    int status;
+    const char *name;
+} metrics_statuses[METRICS_STATS - 1] = {
+    METRICS_NAME(NFS3_OK), METRICS_NAME(NFS3ERR_PERM),
+    METRICS_NAME(NFS3ERR_NOENT), METRICS_NAME(NFS3ERR_IO),
+    METRICS_NAME(NFS3ERR_NXIO), METRICS_NAME(NFS3ERR_ACCES),
+    METRICS_NAME(NFS3ERR_EXIST), METRICS_NAME(NFS3ERR_XDEV),
+    METRICS_NAME(NFS3ERR_NODEV), METRICS_NAME(NFS3ERR_NOTDIR),
+    METRICS_NAME(NFS3ERR_ISDIR), METRICS_NAME(NFS3ERR_INVAL),
+    METRICS_NAME(NFS3ERR_FBIG), METRICS_NAME(NFS3ERR_NOSPC),
+    METRICS_NAME(NFS3ERR_ROFS), METRICS_NAME(NFS3ERR_MLINK),
+    METRICS_NAME(NFS3ERR_NAMETOOLONG), METRICS_NAME(NFS3ERR_NOTEMPTY),
+    METRICS_NAME(NFS3ERR_DQUOT), METRICS_NAME(NFS3ERR_STALE),
+    METRICS_NAME(NFS3ERR_REMOTE), METRICS_NAME(NFS3ERR_BADHANDLE),
+    METRICS_NAME(NFS3ERR_NOT_SYNC), METRICS_NAME(NFS3ERR_BAD_COOKIE),
+    METRICS_NAME(NFS3ERR_NOTSUPP), METRICS_NAME(NFS3ERR_TOOSMALL),
+    METRICS_NAME(NFS3ERR_SERVERFAULT), METRICS_NAME(NFS3ERR_BADTYPE),
+    METRICS_NAME(NFS3ERR_JUKEBOX)
+};
+
+static const char *metrics_procs[METRICS_PROCS] = {
+    "NULL", "GETATTR", "SETATTR", "LOOKUP", "ACCESS", "READLINK", "READ",
+    "WRITE", "CREATE", "MKDIR", "SYMLINK", "MKNOD", "REMOVE", "RMDIR",
+    "RENAME", "LINK", "READDIR", "READDIRPLUS", "FSSTAT", "FSINFO",
+    "PATHCONF", "COMMIT",
+    "NULL", "MNT", "DUMP", "UMNT", "UMNTALL", "EXPORT"
+};
+
+uint64 metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_go_call(const char *export, uint64 start)
+{
+    uint64 ns = metrics_now() - start;
+
+    metrics_go_ns += ns;
+    slowlog_go(export, ns);
+}
+
+static struct metrics_block *metrics_block(void)
+{
+    struct metrics_block *b = metrics_mine;
+
+    if (b)
+	return b;
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+	logmsg(LOG_ERR, "unable to allocate metrics");
+	daemon_exit(CRISIS);
+    }
+    b->next = __atomic_load_n(&metrics_blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_blocks, &b->next, b, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED)) ;
+    metrics_mine = b;
+    return b;
+}
+
+uint64 metrics_begin(void)
+{
+    struct metrics_block *b = metrics_block();
+
+    METRICS_ADD(b->busy, 1);
+    return metrics_now();
+}
+
+static int metrics_bucket(uint64 ns)
+{
+    int e;
+
+    if (ns < 1 << METRICS_SUB_BITS)
+	return ns;
+    e = 63 - __builtin_clzll(ns);
+    if (e >= 40)
+	return METRICS_BUCKETS - 1;
+    return ((e - METRICS_SUB_BITS) << METRICS_SUB_BITS) +
+	(ns >> (e - METRICS_SUB_BITS));
+}
+
+uint64 metrics_bucket_low(int bucket)
+{
+    int e = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+
+    if (bucket < 1 << METRICS_SUB_BITS)
+	return bucket;
+    return (uint64) ((bucket & ((1 << METRICS_SUB_BITS) - 1)) |
+		     1 << METRICS_SUB_BITS) << (e - METRICS_SUB_BITS);
+}
+
+void metrics_call(int proc, uint64 start, uint64 go_start, int status,
+		  u_int in, u_int out)
+{
+    struct metrics_block *b = metrics_block();
+    struct metrics_proc *p = &b->procs[proc];
+    uint64 ns = metrics_now() - start;
+    int i;
+
+    METRICS_ADD(b->busy, -1);
+    METRICS_ADD(p->calls, 1);
+    METRICS_ADD(p->bytes_in, in);
+    METRICS_ADD(p->bytes_out, out);
+    METRICS_ADD(p->ns, ns);
+    METRICS_ADD(p->go_ns, metrics_go_ns - go_start);
+    METRICS_ADD(p->hist[metrics_bucket(ns)], 1);
+    if (status < 0)
+	return;
+    for (i = 0; i < METRICS_STATS - 1; i++)
+	if (metrics_statuses[i].status == status)
+	    break;
+    METRICS_ADD(p->status[i], 1);
+}
+
+void metrics_garbage(int proc)
+{
+    struct metrics_block *b = metrics_block();
+
+    METRICS_ADD(b->busy, -1);
+    METRICS_ADD(b->procs[proc].garbage, 1);
+}
+
+void metrics_read(struct metrics_proc *procs)
+{
+    struct metrics_block *b;
+    uint64 *from, *to;
+    size_t i;
+
+    memset(procs, 0, sizeof(struct metrics_proc) * METRICS_PROCS);
+    for (b = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE); b;
+	 b = b->next) {
+	/* nothing but uint64 counters, so add them up as an array */
+	from = (uint64 *) b->procs;
+	to = (uint64 *) procs;
+	for (i = 0;
+	     i < METRICS_PROCS * (sizeof(struct metrics_proc) / sizeof(uint64));
+	     i++)
+	    to[i] += METRICS_GET(from[i]);
+    }
+}
+
+uint64 metrics_in_flight(void)
+{
+    struct metrics_block *b;
+    uint64 n = 0;
+
+    for (b = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE); b;
+	 b = b->next)
+	n += METRICS_GET(b->busy);
+    return n;
+}
+
+const char *metrics_proc_name(int proc)
+{
+    return metrics_procs[proc];
+}
+
+const char *metrics_status_name(int slot)
+{
+    if (slot < METRICS_STATS - 1)
+	return metrics_statuses[slot].name;
+    return "other";
+}
@@ -0,0 +1,77 @@
+/*
+ * UNFS3 call metrics
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_METRICS_H
+#define UNFS3_METRICS_H
+
+/* where each program's procedures start among the counters */
+#define METRICS_NFS 0
+#define METRICS_MOUNT 22
+#define METRICS_PROCS 28
+
+/* the nfsstat3 (and mountstat3) values there are, plus one for others */
+#define METRICS_STATS 30
+
+/*
+ * latency histogram: exact below 8ns, then 8 buckets per power of two,
+ * so each is within 12.5% of what it holds, up to 2^40ns (about 18 min)
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_BUCKETS ((40 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+struct metrics_proc {
+    uint64 calls;
+    uint64 garbage;		/* calls whose arguments wouldn't decode */
+    uint64 bytes_in;
+    uint64 bytes_out;
+    uint64 ns;			/* from decoding the call to sending the reply */
+    uint64 go_ns;		/* of which inside Go exports */
+    uint64 status[METRICS_STATS];
+    uint64 hist[METRICS_BUCKETS];
+};
+
+/*
+ * time spent in Go exports so far, counted by GO_TIMED on the dispatching
+ * thread, which is the only one that calls them
+ */
+extern uint64 metrics_go_ns;
+
+/*
+ * call Go export fn with args, adding the time from here until it has
+ * returned, so the cgo crossing both ways as well as the export itself, to
+ * the Go share of the call being dispatched and to its slow call record
+ */
+#define GO_TIMED(fn, args) __extension__ ({ \
+    uint64 go_timed_start_ = metrics_now(); \
+    __typeof__(fn args) go_timed_res_ = fn args; \
+    metrics_go_call(#fn, go_timed_start_); \
+    go_timed_res_; })
+
+void metrics_go_call(const char *export, uint64 start);
+
+uint64 metrics_now(void);
+
+/* note a call has started, returning the time it did */
+uint64 metrics_begin(void);
+
+/*
+ * count a call to proc, begun at start, with status -1 if it has none;
+ * every metrics_begin is followed by this or metrics_garbage
+ */
+void metrics_call(int proc, uint64 start, uint64 go_start, int status,
+		  u_int in, u_int out);
+void metrics_garbage(int proc);
+
+/* add up every thread's counters into procs[METRICS_PROCS] */
+void metrics_read(struct metrics_proc *procs);
+
+/* calls begun but not yet counted */
+uint64 metrics_in_flight(void);
+
+const char *metrics_proc_name(int proc);
+const char *metrics_status_name(int slot);
+uint64 metrics_bucket_low(int bucket);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * UNFS3 XDR microbenchmarks
+ *
+ * microbench_test.go times these, through microbench.go, which builds this
+ * file into its own cgo preamble, and only with the microbench tag. Each
+ * runs one of the XDR routines the dispatchers spend their time in n times
+ * over, on a memory stream, so that what's timed is the routine rather than
+ * a cgo call per run. Decoding benchmarks first encode what they then decode, and give
+ * the decoder buffers of its own to decode into, as the dispatchers do.
+ *
+ * see file LICENSE for license details
+ */
+
+static void microbench_fattr(fattr3 * attr, uint64 fileid)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->type = NF3REG;
+    attr->mode = 0644;
+    attr->nlink = 1;
+    attr->uid = 1000;
+    attr->gid = 1000;
+    attr->size = attr->used = 123456789;
+    attr->fsid = 1;
+    attr->fileid = fileid;
+    attr->atime.seconds = attr->mtime.seconds = attr->ctime.seconds =
+	1700000000;
+}
+
+/*
+ * run the routine which says n times, returning the bytes each run
+ * encodes or decodes, or -1 if one fails
+ */
+int microbench_xdr(int which, int n, u_int size)
+{
+    static char fh[NFS3_FHSIZE], name[NFS_MAXNAMLEN + 1];
+    union {
+	fattr3 fattr;
+	READ3res read;
+	READDIR3res_direct readdir;
+	WRITE3args write;
+	LOOKUP3args lookup;
+    } obj;
+    xdrproc_t proc;
+    enum xdr_op op = XDR_ENCODE;
+    char *buf, *data, *entries = NULL;
+    int32_t *entry;
+    u_int buf_len, len = 0, i;
+    XDR xdrs;
+    bool_t ok = TRUE;
+
+    memset(&obj, 0, sizeof(obj));
+    /* READDIR entries here take 36 bytes, names being 11 or 12 long */
+    buf_len = (which == MICROBENCH_READDIR3RES ? size * 40 : size) + 4096;
+    buf = malloc(buf_len);
+    data = malloc(size + 1);
+    if (!buf || !data) {
+	free(buf);
+	free(data);
+	return -1;
+    }
+    memset(data, 'x', size + 1);
+
+    switch (which) {
+	case MICROBENCH_FATTR3:
+	    microbench_fattr(&obj.fattr, 12345);
+	    proc = (xdrproc_t) xdr_fattr3;
+	    break;
+	case MICROBENCH_READ3RES:
+	    obj.read.status = NFS3_OK;
+	    obj.read.READ3res_u.resok.file_attributes.attributes_follow = TRUE;
+	    microbench_fattr(&obj.read.READ3res_u.resok.file_attributes.
+			     post_op_attr_u.attributes, 12345);
+	    obj.read.READ3res_u.resok.count = size;
+	    obj.read.READ3res_u.resok.data.data_len = size;
+	    obj.read.READ3res_u.resok.data.data_val = data;
+	    proc = (xdrproc_t) xdr_READ3res;
+	    break;
+	case MICROBENCH_READDIR3RES:
+	    /* encoded, as go_readdir_full leaves them */
+	    entries = malloc((size_t) size * 36 + 1);
+	    if (!entries) {
+		ok = FALSE;
+		break;
+	    }
+	    for (i = 0; i < size; i++) {
+		entry = (int32_t *) (entries + i * 36);
+		IXDR_PUT_BOOL(entry, TRUE);
+		IXDR_PUT_UINT64(entry, 100 + i);
+		IXDR_PUT_U_INT32(entry, 11);
+		sprintf((char *) entry, "entry%06u", i);
+		entry += 3;
+		IXDR_PUT_UINT64(entry, i + 1);
+	    }
+	    obj.readdir.res.status = NFS3_OK;
+	    obj.readdir.res.READDIR3res_u.resok.dir_attributes.attributes_follow =
+		TRUE;
+	    microbench_fattr(&obj.readdir.res.READDIR3res_u.resok.dir_attributes.
+			     post_op_attr_u.attributes, 100);
+	    obj.readdir.res.READDIR3res_u.resok.reply.eof = TRUE;
+	    obj.readdir.entries = entries;
+	    obj.readdir.entries_len = size * 36;
+	    proc = (xdrproc_t) xdr_READDIR3res_direct;
+	    break;
+	case MICROBENCH_WRITE3ARGS:
+	    obj.write.file.data.data_len = NFS3_FHSIZE;
+	    obj.write.file.data.data_val = fh;
+	    obj.write.offset = 1 << 20;
+	    obj.write.count = size;
+	    obj.write.stable = UNSTABLE;
+	    obj.write.data.data_len = size;
+	    obj.write.data.data_val = data;
+	    proc = (xdrproc_t) xdr_WRITE3args;
+	    op = XDR_DECODE;
+	    break;
+	case MICROBENCH_LOOKUP3ARGS:
+	    obj.lookup.what.dir.data.data_len = NFS3_FHSIZE;
+	    obj.lookup.what.dir.data.data_val = fh;
+	    strcpy(name, "a-file-name.txt");
+	    obj.lookup.what.name = name;
+	    proc = (xdrproc_t) xdr_LOOKUP3args;
+	    op = XDR_DECODE;
+	    break;
+	default:
+	    ok = FALSE;
+    }
+
+    if (ok && op == XDR_DECODE) {
+	xdrmem_create(&xdrs, buf, buf_len, XDR_ENCODE);
+	ok = proc(&xdrs, &obj);
+	len = xdr_getpos(&xdrs);
+    }
+    for (i = 0; ok && i < (u_int) n; i++) {
+	xdrmem_create(&xdrs, buf, op == XDR_DECODE ? len : buf_len, op);
+	ok = proc(&xdrs, &obj);
+	len = xdr_getpos(&xdrs);
+    }
+
+    free(entries);
+    free(data);
+    free(buf);
+    return ok ? (int) len : -1;
+}
@@ -0,0 +1,18 @@
+/*
+ * UNFS3 XDR microbenchmarks
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_MICROBENCH_H
+#define UNFS3_MICROBENCH_H
+
+/* what microbench_xdr runs */
+#define MICROBENCH_FATTR3 0		/* encode a fattr3 */
+#define MICROBENCH_READ3RES 1		/* encode a READ3res of size bytes */
+#define MICROBENCH_READDIR3RES 2	/* encode a READDIR3res of size entries */
+#define MICROBENCH_WRITE3ARGS 3		/* decode WRITE3args of size bytes */
+#define MICROBENCH_LOOKUP3ARGS 4	/* decode LOOKUP3args */
+
+int microbench_xdr(int which, int n, u_int size);
+
+#endif
@@ -35,21 +35,21 @@ static void add_mount(const char *path, struct svc_req *rqstp)
 
     new = malloc(sizeof(struct mountbody));
     if (!new) {
-	fprintf(stderr, "%s\n", "add_mount: Unable to allocate memory");
+	logmsg(LOG_ERR, "add_mount: Unable to allocate memory");
 	return;
     }
 
     host = inet_ntoa(get_remote(rqstp));
     new->ml_hostname = malloc(strlen(host) + 1);
     if (!new->ml_hostname) {
-	fprintf(stderr, "%s\n", "add_mount: Unable to allocate memory");
+	logmsg(LOG_ERR, "add_mount: Unable to allocate memory");
 	free(new);
 	return;
     }
 
     new->ml_directory = malloc(strlen(path) + 1);
     if (!new->ml_directory) {
-	fprintf(stderr, "%s\n", "add_mount: Unable to allocate memory");
+	logmsg(LOG_ERR, "add_mount: Unable to allocate memory");
 	free(new->ml_hostname);
 	free(new);
 	return;
@@ -129,8 +129,8 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 
     /* error out if not version 3 */
     if (rqstp->rq_vers != 3) {
-	fprintf(stderr,
-	       "%s attempted mount with unsupported protocol version\n",
+	logmsg(LOG_WARNING,
+	       "%s attempted mount with unsupported protocol version",
 	       inet_ntoa(get_remote(rqstp)));
 	result.fhs_status = MNT3ERR_INVAL;
 	return &result;
@@ -139,30 +139,30 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
 	strcpy(buf, dpath);
 	go_statstruct stbuf;
 	
-    if (go_lstat(buf, &stbuf)!=NFS3_OK) {
+    if (GO_TIMED(go_lstat, (buf, &stbuf))!=NFS3_OK) {
 	/* the given path does not exist */
-	fprintf(stderr, "Mount svc: Given path does not exist\n");
+	logmsg(LOG_INFO, "Mount svc: Given path does not exist");
 	result.fhs_status = MNT3ERR_NOENT;
 	return &result;
     }
 
     if (strlen(buf) + 1 > NFS_MAXPATHLEN) {
-	fprintf(stderr, "%s attempted to mount jumbo path\n",
+	logmsg(LOG_WARNING, "%s attempted to mount jumbo path",
 	       inet_ntoa(get_remote(rqstp)));
 	result.fhs_status = MNT3ERR_NAMETOOLONG;
 	return &result;
     }
 	
-    if (go_accept_mount((svc_getcaller(rqstp->rq_xprt))->sin_addr, buf) != NFS3_OK) {
+    if (GO_TIMED(go_accept_mount, ((svc_getcaller(rqstp->rq_xprt))->sin_addr, buf)) != NFS3_OK) {
 		/* not exported to this host*/
-	fprintf(stderr, "Mount svc: Not exported to this host at all\n");
+	logmsg(LOG_INFO, "Mount svc: Not exported to this host at all");
 	result.fhs_status = MNT3ERR_ACCES;
 	return &result;
     }
 		
 
     if (!S_ISDIR(stbuf.st_mode)) {
-		fprintf(stderr, "%s attempted to mount non-directory\n", inet_ntoa(get_remote(rqstp)));
+		logmsg(LOG_INFO, "%s attempted to mount non-directory", inet_ntoa(get_remote(rqstp)));
 		result.fhs_status = MNT3ERR_NOTDIR;
 		return &result;
     }
@@ -34,6 +34,55 @@ nfsstat3 cat_name(const char *path, const char *name, char *result)
     return NFS3_OK;
 }
 
+/*
+ * the write verifier, kept as one word so a regeneration from the Go side
+ * (a failed gathered flush) can't be seen half-written by the dispatch thread
+ */
+static uint64 write_verf;
+
+/*
+ * make a fresh write verifier from the boot time and some randomness,
+ * never handing out the same one twice in a row
+ */
+void regen_write_verf(void)
+{
+    static uint32 boot = 0;
+    uint32 v[2];
+    uint64 w;
+    FILE *f;
+
+    if (boot == 0)
+	boot = (uint32) time(NULL);
+
+    v[0] = boot;
+    v[1] = 0;
+    f = fopen("/dev/urandom", "rb");
+    if (f) {
+	if (fread(&v[1], sizeof(v[1]), 1, f) != 1)
+	    v[1] = 0;
+	fclose(f);
+    }
+    if (v[1] == 0)
+	v[1] = (uint32) getpid() ^ (uint32) clock() ^ (uint32) rand();
+
+    memcpy(&w, v, sizeof(w));
+    if (w == __atomic_load_n(&write_verf, __ATOMIC_RELAXED)) {
+	v[1]++;
+	memcpy(&w, v, sizeof(w));
+    }
+    __atomic_store_n(&write_verf, w, __ATOMIC_RELAXED);
+}
+
+/*
+ * copy the current write verifier into a WRITE or COMMIT reply
+ */
+void get_write_verf(writeverf3 verf)
+{
+    uint64 w = __atomic_load_n(&write_verf, __ATOMIC_RELAXED);
+
+    memcpy(verf, &w, NFS3_WRITEVERFSIZE);
+}
+
 void *nfsproc3_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
 {
     static void *result = NULL;
@@ -69,20 +118,20 @@ SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp, struct svc_req * rqstp)
 
     /* set file size? */
     if (new.size.set_it == TRUE) {
-		sres = go_truncate(path, new.size.set_size3_u.size);
+		sres = GO_TIMED(go_truncate, (path, new.size.set_size3_u.size));
     } 
 	
     /* set file mode? */
 	if (new.mode.set_it == TRUE) {
-		mres = go_chmod(path, new.mode.set_mode3_u.mode);
+		mres = GO_TIMED(go_chmod, (path, new.mode.set_mode3_u.mode));
     }
 	
     /* set file modtime? */
 	if (new.mtime.set_it != DONT_CHANGE) {
 		if (new.mtime.set_it == SET_TO_SERVER_TIME)
-			mtres = go_modtime(path, time(NULL));
+			mtres = GO_TIMED(go_modtime, (path, time(NULL)));
 		else			       /* SET_TO_CLIENT_TIME */
-			mtres = go_modtime(path, new.mtime.set_mtime_u.mtime.seconds);
+			mtres = GO_TIMED(go_modtime, (path, new.mtime.set_mtime_u.mtime.seconds));
 	}
 		
 	result.status = (sres != NFS3_OK) ? sres : (mres != NFS3_OK) ? mres : mtres;
@@ -104,7 +153,7 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 	path = fh_decomp(argp->what.dir);
     result.status = cat_name(path, argp->what.name, obj);
     if (result.status == NFS3_OK) {
-		result.status = go_lstat(obj, &buf);
+		result.status = GO_TIMED(go_lstat, (obj, &buf));
 		if (result.status == NFS3_OK) {
 			fh = fh_comp(buf.st_ino, obj);
 			if (fh) {
@@ -132,7 +181,7 @@ ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
     path = fh_decomp(argp->object);
 	
 	go_statstruct buf;
-	result.status = go_lstat(path, &buf);
+	result.status = GO_TIMED(go_lstat, (path, &buf));
     if (result.status==NFS3_OK) {
 		post = get_post_buf(buf, rqstp);
 		//TODO: Fill this out based on the stated info in 'buf'
@@ -172,11 +221,14 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
     static READ3res result;
     char *path;
     int res;
-    static char buf[NFS_MAXDATA_TCP + 1];
+    char *buf;
     unsigned int maxdata;
+    uint64 size;
+    int fd, stream;
 
-    if (get_socket_type(rqstp) == SOCK_STREAM)
-	maxdata = NFS_MAXDATA_TCP;
+    stream = (get_socket_type(rqstp) == SOCK_STREAM);
+    if (stream)
+	maxdata = opt_iosize;
     else
 	maxdata = NFS_MAXDATA_UDP;
 
@@ -186,8 +238,41 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
     if (argp->count > maxdata)
 	argp->count = maxdata;
 
+    /*
+     * on TCP, large reads of real files are sent by the transport with
+     * sendfile, straight from the page cache
+     */
+    if (stream && argp->count >= STREAM_SENDFILE_MIN &&
+	path && (fd = GO_TIMED(go_read_fd, (path, &size))) >= 0) {
+	if (argp->offset >= size)
+	    res = 0;
+	else if (size - argp->offset > argp->count)
+	    res = argp->count;
+	else
+	    res = size - argp->offset;
+
+	result.status = NFS3_OK;
+	result.READ3res_u.resok.eof = (argp->offset + res >= size);
+	result.READ3res_u.resok.count = res;
+	result.READ3res_u.resok.data.data_len = res;
+	result.READ3res_u.resok.data.data_val = NULL;
+	if (res > 0)
+	    svcstream_sendfile(fd, argp->offset);
+
+	result.READ3res_u.resok.file_attributes = get_post(path, rqstp);
+	return &result;
+    }
+
+    /* the pool hands it back once the reply has gone out */
+    buf = iobuf_reply();
+    if (!buf) {
+	result.status = NFS3ERR_IO;
+	result.READ3res_u.resfail.file_attributes = get_post(path, rqstp);
+	return &result;
+    }
+
 	/* read one more to check for eof */
-    res = go_pread(path, buf, argp->count + 1, argp->offset);
+    res = GO_TIMED(go_pread, (path, buf, argp->count + 1, argp->offset));
 	if (res > -1) {
 		result.status = NFS3_OK;
 
@@ -220,18 +305,20 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
     static WRITE3res result;
     char *path;
     int res;
+    int stable;
 	pre_op_attr pre;
 	
 	path = fh_decomp(argp->file);
 	
 	pre = get_pre(path);
-	res = go_pwrite(path, argp->data.data_val, argp->data.data_len, argp->offset);
+	/* the backend may gather UNSTABLE writes; it tells us what it achieved */
+	stable = argp->stable;
+	res = GO_TIMED(go_pwrite, (path, argp->data.data_val, argp->data.data_len, argp->offset, &stable));
     if (res > -1) {
 		result.status = NFS3_OK;
 		result.WRITE3res_u.resok.count = res;
-		result.WRITE3res_u.resok.committed = FILE_SYNC;
-		uint64 zero = (uint64) 0;
-		memcpy(result.WRITE3res_u.resok.verf, &zero, NFS3_WRITEVERFSIZE);
+		result.WRITE3res_u.resok.committed = stable;
+		get_write_verf(result.WRITE3res_u.resok.verf);
     } else {
 		//because a successful pwrite can return any non-negative number
 		//it can't return standard NF3 errors (which are all positive)
@@ -266,13 +353,13 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
     }
 
 	if (argp->how.mode == UNCHECKED) { //overwrite already if exists
-		result.status = go_createover(obj, create_mode(new_attr));
+		result.status = GO_TIMED(go_createover, (obj, create_mode(new_attr)));
 	} else {
-		result.status = go_create(obj, create_mode(new_attr));
+		result.status = GO_TIMED(go_create, (obj, create_mode(new_attr)));
 	    }
 
 	if (result.status ==  NFS3_OK) {
-			result.status = go_lstat(obj, &buf);
+			result.status = GO_TIMED(go_lstat, (obj, &buf));
 			result.CREATE3res_u.resok.obj = fh_comp_post(buf.st_ino, obj);
 			result.CREATE3res_u.resok.obj_attributes = get_post_buf(buf, rqstp);
     }
@@ -296,7 +383,7 @@ MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
     result.status = cat_name(path, argp->where.name, obj);
 
     if (result.status == NFS3_OK) {
-		result.status = go_mkdir(obj, create_mode(argp->attributes));
+		result.status = GO_TIMED(go_mkdir, (obj, create_mode(argp->attributes)));
 		if (result.status == NFS3_OK){
 			result.MKDIR3res_u.resok.obj = fh_comp_type(obj, S_IFDIR);
 			result.MKDIR3res_u.resok.obj_attributes = get_post(obj, rqstp);
@@ -345,7 +432,7 @@ REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
     result.status = cat_name(path, argp->object.name, obj);
 
     if (result.status == NFS3_OK) {
-		result.status = go_remove(obj);
+		result.status = GO_TIMED(go_remove, (obj));
     }
 
     /* overlaps with resfail */
@@ -367,7 +454,7 @@ RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
     result.status = cat_name(path, argp->object.name, obj);
 
     if (result.status == NFS3_OK) {
-	    result.status = go_rmdir(obj);
+	    result.status = GO_TIMED(go_rmdir, (obj));
     }
 
     /* overlaps with resfail */
@@ -402,7 +489,7 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 		result.status = cat_name(to, argp->to.name, to_obj);
 
 	if (result.status == NFS3_OK) {
-			result.status = go_rename(from_obj, to_obj);
+			result.status = GO_TIMED(go_rename, (from_obj, to_obj));
 	}
     }
 
@@ -429,16 +516,16 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
     return &result;
 }
 
-READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp, struct svc_req * rqstp)
+READDIR3res_direct *nfsproc3_readdir_3_svc(READDIR3args * argp, struct svc_req * rqstp)
 {
-    static READDIR3res result;
+    static READDIR3res_direct result;
+    static char entries[4096];
     char *path;	
     path = fh_decomp(argp->dir);
 	int res;
 	READDIR3resok resok;
-    static entry3 entries[MAX_ENTRIES];
     count3 count;
-    static char names[NFS_MAXPATHLEN * MAX_ENTRIES];
+    uint32 used;
 
 	count = (argp->count);
     /* we refuse to return more than 4k from READDIR */
@@ -446,9 +533,10 @@ READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp, struct svc_req * rqstp)
 	count = 4096;
 
     /* account for size of information heading resok structure */
-    count -= RESOK_SIZE;
-	
-	res = go_readdir_full(path, argp->cookie, count, names, entries, NFS_MAXPATHLEN, MAX_ENTRIES);
+    if (count < RESOK_SIZE)
+	res = NFS3ERR_TOOSMALL;
+    else
+	res = GO_TIMED(go_readdir_full, (path, argp->cookie, count - RESOK_SIZE, entries, &used));
 	
 	//if OK, but didn't read the end of the directory, we get back a negative signal
 	if (res<0) {
@@ -458,18 +546,16 @@ READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp, struct svc_req * rqstp)
 		resok.reply.eof = TRUE;	
 	}
 	
-	result.status = res;
-	
-	if (entries[0].name)
-		resok.reply.entries = &entries[0];
-    else
-		resok.reply.entries = NULL;
+	result.res.status = res;
+	result.entries = entries;
+	result.entries_len = res == NFS3_OK ? used : 0;
+	resok.reply.entries = NULL;
 
     uint64 zero = (uint64) 0;
 	memcpy(resok.cookieverf, &zero, NFS3_COOKIEVERFSIZE);
 
-    result.READDIR3res_u.resok = resok;	
-    result.READDIR3res_u.resok.dir_attributes = get_post(path, rqstp);
+    result.res.READDIR3res_u.resok = resok;	
+    result.res.READDIR3res_u.resok.dir_attributes = get_post(path, rqstp);
 
     return &result;
 }
@@ -518,7 +604,7 @@ FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
     unsigned int maxdata;
 
     if (get_socket_type(rqstp) == SOCK_STREAM)
-	maxdata = NFS_MAXDATA_TCP;
+	maxdata = opt_iosize;
     else
 	maxdata = NFS_MAXDATA_UDP;
 
@@ -570,11 +656,10 @@ COMMIT3res *nfsproc3_commit_3_svc(COMMIT3args * argp, struct svc_req * rqstp)
 	pre_op_attr poa;
     path = fh_decomp(argp->file);
 	
-	result.status = go_sync(path, &buf);
+	result.status = GO_TIMED(go_sync, (path, &buf));
 		
     if (result.status == NFS3_OK) {
-		uint64 zero = (uint64) 0;
-		memcpy(result.COMMIT3res_u.resok.verf, &zero, NFS3_WRITEVERFSIZE);
+		get_write_verf(result.COMMIT3res_u.resok.verf);
     /* overlaps with resfail */
     result.COMMIT3res_u.resfail.file_wcc.before = get_pre_buf(buf);
     result.COMMIT3res_u.resfail.file_wcc.after = get_post_buf(buf, rqstp);
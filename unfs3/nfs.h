@@ -19,7 +19,8 @@
 #define UNIX_PATH_MAX 108
 
 #define NFS_PORT 2049
-#define NFS_MAXDATA_TCP 524288
+#define NFS_MAXDATA_TCP 1048576 /* default transfer size, see opt_iosize */
+#define NFS_MAXDATA_TCP_MAX 4194304
 #define NFS_MAXDATA_UDP 32768
 #define NFS_MAX_UDP_PACKET (NFS_MAXDATA_UDP + 4096) /* The extra 4096 bytes are for the RPC header */
 #define NFS_MAXPATHLEN 1024
@@ -781,6 +782,18 @@ struct READDIR3res {
 };
 typedef struct READDIR3res READDIR3res;
 
+/*
+ * READDIR3res as nfsproc3_readdir_3_svc returns it, its entries encoded
+ * by go_readdir_full: all of dirlist3 but the FALSE ending the list, and
+ * eof, which is in res
+ */
+struct READDIR3res_direct {
+	READDIR3res res;
+	char *entries;
+	u_int entries_len;
+};
+typedef struct READDIR3res_direct READDIR3res_direct;
+
 struct READDIRPLUS3args {
 	nfs_fh3 dir;
 	cookie3 cookie;
@@ -989,7 +1002,7 @@ extern  RENAME3res * nfsproc3_rename_3_svc(RENAME3args *, struct svc_req *);
 #define NFSPROC3_LINK 15
 extern  LINK3res * nfsproc3_link_3_svc(LINK3args *, struct svc_req *);
 #define NFSPROC3_READDIR 16
-extern  READDIR3res * nfsproc3_readdir_3_svc(READDIR3args *, struct svc_req *);
+extern  READDIR3res_direct * nfsproc3_readdir_3_svc(READDIR3args *, struct svc_req *);
 #define NFSPROC3_READDIRPLUS 17
 extern  READDIRPLUS3res * nfsproc3_readdirplus_3_svc(READDIRPLUS3args *, struct svc_req *);
 #define NFSPROC3_FSSTAT 18
@@ -1009,13 +1022,6 @@ extern int nfs3_program_3_freeresult (SVCXPRT *, xdrproc_t, caddr_t);
 #define	R_OK		0x04	/* test for read permission */
 
 
-/*
- * maximum number of entries in readdir results
- *
- * this is 4096 / 24 (the minimum size of an entry3)
- */
-#define MAX_ENTRIES 170
-
 /*
  * static READDIR3resok size with XDR overhead
  *
@@ -1038,4 +1044,13 @@ extern int nfs3_program_3_freeresult (SVCXPRT *, xdrproc_t, caddr_t);
  */
 #define NAME_SIZE(x) (((strlen((x))+3)/4)*4)
 
+/*
+ * write verifier handed out by WRITE and COMMIT
+ *
+ * regenerated at start and whenever acknowledged UNSTABLE data is lost,
+ * so clients notice and resend it
+ */
+void regen_write_verf(void);
+void get_write_verf(writeverf3 verf);
+
 #endif /* !_NFS_PROT_H_RPCGEN */
@@ -0,0 +1,123 @@
+/*
+ * UNFS3 slow call log
+ *
+ * While a call is dispatched, its timings are noted in slowlog_current:
+ * decoding the arguments, resolving file handles, each Go export, and
+ * encoding and sending the reply. If the whole took longer than the
+ * threshold, the record is copied into a ring that a Go goroutine drains
+ * and prints, so the dispatcher never waits on stdout. The dispatching
+ * thread is the ring's only producer and the drainer its only consumer,
+ * which is all a ring of head and tail counters needs to stay lock free;
+ * if the drainer falls behind, slow calls are counted and dropped.
+ *
+ * see file LICENSE for license details
+ */
+
+#define SLOWLOG_RING 256
+
+uint64 slowlog_threshold;
+static struct slowlog_call slowlog_current;	/* only touched by the dispatcher */
+
+static struct slowlog_call slowlog_ring[SLOWLOG_RING];
+static uint64 slowlog_head, slowlog_tail;	/* head written by the dispatcher, tail by the drainer */
+static uint64 slowlog_drops;
+
+void slowlog_begin(struct svc_req *rqstp, int proc, uint64 start)
+{
+    struct slowlog_call *c = &slowlog_current;
+
+    if (!slowlog_threshold)
+	return;
+    c->start = c->mark = start;
+    memset(c->ns, 0, sizeof(c->ns));
+    c->resolve_ns = 0;
+    c->proc = proc;
+    c->go_calls = 0;
+    c->path[0] = 0;
+    c->client = get_remote(rqstp).s_addr;
+    if (!svcstream_xid(rqstp->rq_xprt, &c->xid))
+	/* svcudp and svc_dg both keep the datagram they got in xp_p1 */
+	c->xid = ntohl(*(uint32 *) rqstp->rq_xprt->xp_p1);
+}
+
+void slowlog_phase(int phase)
+{
+    struct slowlog_call *c = &slowlog_current;
+    uint64 now;
+
+    if (!slowlog_threshold)
+	return;
+    now = metrics_now();
+    c->ns[phase] += now - c->mark;
+    c->mark = now;
+}
+
+void slowlog_path(const char *path)
+{
+    if (slowlog_threshold && path && !slowlog_current.path[0]) {
+	strncpy(slowlog_current.path, path, SLOWLOG_PATH - 1);
+	slowlog_current.path[SLOWLOG_PATH - 1] = 0;
+    }
+}
+
+uint64 slowlog_clock(void)
+{
+    return slowlog_threshold ? metrics_now() : 0;
+}
+
+void slowlog_resolved(uint64 start, const char *path)
+{
+    if (!start)
+	return;
+    slowlog_current.resolve_ns += metrics_now() - start;
+    slowlog_path(path);
+}
+
+void slowlog_go(const char *export, uint64 ns)
+{
+    struct slowlog_call *c = &slowlog_current;
+
+    if (!slowlog_threshold)
+	return;
+    if (c->go_calls < SLOWLOG_GO_CALLS) {
+	c->go[c->go_calls].export = export;
+	c->go[c->go_calls].ns = ns;
+    }
+    c->go_calls++;
+}
+
+void slowlog_end(void)
+{
+    struct slowlog_call *c = &slowlog_current;
+    uint64 head;
+
+    if (!slowlog_threshold)
+	return;
+    c->total_ns = c->mark - c->start;
+    if (c->total_ns < slowlog_threshold)
+	return;
+
+    head = slowlog_head;
+    if (head - __atomic_load_n(&slowlog_tail, __ATOMIC_ACQUIRE) >= SLOWLOG_RING) {
+	__atomic_store_n(&slowlog_drops, slowlog_drops + 1, __ATOMIC_RELAXED);
+	return;
+    }
+    slowlog_ring[head % SLOWLOG_RING] = *c;
+    __atomic_store_n(&slowlog_head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool_t slowlog_take(struct slowlog_call *call)
+{
+    uint64 tail = slowlog_tail;
+
+    if (tail == __atomic_load_n(&slowlog_head, __ATOMIC_ACQUIRE))
+	return FALSE;
+    *call = slowlog_ring[tail % SLOWLOG_RING];
+    __atomic_store_n(&slowlog_tail, tail + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+uint64 slowlog_dropped(void)
+{
+    return __atomic_load_n(&slowlog_drops, __ATOMIC_RELAXED);
+}
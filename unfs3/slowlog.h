@@ -0,0 +1,61 @@
+/*
+ * UNFS3 slow call log
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_SLOWLOG_H
+#define UNFS3_SLOWLOG_H
+
+/* where a call's time went, in order */
+#define SLOWLOG_DECODE 0
+#define SLOWLOG_RUN 1		/* the procedure, including resolves and Go */
+#define SLOWLOG_ENCODE 2	/* TCP only; on UDP it's part of SEND */
+#define SLOWLOG_SEND 3
+#define SLOWLOG_PHASES 4
+
+/* Go exports kept per call, and room for its first path */
+#define SLOWLOG_GO_CALLS 8
+#define SLOWLOG_PATH 256
+
+struct slowlog_call {
+    uint64 start;
+    uint64 mark;		/* end of the last phase */
+    uint64 ns[SLOWLOG_PHASES];
+    uint64 resolve_ns;		/* in fh_decomp, during RUN */
+    uint64 total_ns;
+    uint32 xid;
+    uint32 client;		/* IPv4 address, network order */
+    int proc;			/* as counted in metrics */
+    int go_calls;		/* made, even past SLOWLOG_GO_CALLS */
+    struct {
+	const char *export;	/* its name */
+	uint64 ns;
+    } go[SLOWLOG_GO_CALLS];
+    char path[SLOWLOG_PATH];
+};
+
+/*
+ * calls taking at least this many ns are logged, 0 turns logging off;
+ * set once before the server starts
+ */
+extern uint64 slowlog_threshold;
+
+void slowlog_begin(struct svc_req *rqstp, int proc, uint64 start);
+void slowlog_phase(int phase);
+void slowlog_path(const char *path);
+void slowlog_end(void);
+
+/* the time, if the log is on, for a resolve that slowlog_resolved ends */
+uint64 slowlog_clock(void);
+void slowlog_resolved(uint64 start, const char *path);
+
+/* note a call into Go export, as GO_TIMED makes them */
+void slowlog_go(const char *export, uint64 ns);
+
+/* take the oldest logged call into call, returning FALSE if none is */
+bool_t slowlog_take(struct slowlog_call *call);
+
+/* calls that were slow while the log was full */
+uint64 slowlog_dropped(void);
+
+#endif
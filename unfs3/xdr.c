@@ -150,32 +150,30 @@ bool_t xdr_uint64(XDR * xdrs, uint64 * objp)
 #else
 bool_t xdr_uint64(XDR * xdrs, uint64 * objp)
 {
-    char buf[8];
+    int32_t *buf;
+    uint32 top, bottom;
 
     if (xdrs->x_op == XDR_ENCODE) {
-	buf[0] = (*objp >> 56) & 0xFF;
-	buf[1] = (*objp >> 48) & 0xFF;
-	buf[2] = (*objp >> 40) & 0xFF;
-	buf[3] = (*objp >> 32) & 0xFF;
-	buf[4] = (*objp >> 24) & 0xFF;
-	buf[5] = (*objp >> 16) & 0xFF;
-	buf[6] = (*objp >> 8) & 0xFF;
-	buf[7] = *objp & 0xFF;
-	if (!xdr_opaque(xdrs, buf, 8))
+	buf = XDR_INLINE(xdrs, 8);
+	if (buf) {
+	    IXDR_PUT_UINT64(buf, *objp);
+	    return TRUE;
+	}
+	top = *objp >> 32;
+	bottom = *objp;
+	if (!xdr_uint32(xdrs, &top) || !xdr_uint32(xdrs, &bottom))
 	    return FALSE;
 	return TRUE;
     } else if (xdrs->x_op == XDR_DECODE) {
-	uint32 *top = (void *) &buf[0];
-	uint32 *bottom = (void *) &buf[4];
-
-	if (!xdr_opaque(xdrs, buf, 8))
+	buf = XDR_INLINE(xdrs, 8);
+	if (buf) {
+	    top = IXDR_GET_U_INT32(buf);
+	    bottom = IXDR_GET_U_INT32(buf);
+	} else if (!xdr_uint32(xdrs, &top) || !xdr_uint32(xdrs, &bottom))
 	    return FALSE;
-	*objp = (uint64) (ntohl(*top)) << 32 | ntohl(*bottom);
+	*objp = (uint64) top << 32 | bottom;
 	return TRUE;
     }
-
-    if (!xdr_opaque(xdrs, buf, 8))
-	return FALSE;
     return TRUE;
 }
 #endif
@@ -338,8 +336,43 @@ bool_t xdr_nfstime3(XDR * xdrs, nfstime3 * objp)
     return TRUE;
 }
 
+/*
+ * store fattr3 straight into FATTR3_SIZE bytes of the stream, a word at a
+ * time, rather than through a routine per field; every reply that has
+ * attributes carries at least one
+ */
+static void xdr_put_fattr3(int32_t * buf, const fattr3 * objp)
+{
+    IXDR_PUT_U_INT32(buf, objp->type);
+    IXDR_PUT_U_INT32(buf, objp->mode);
+    IXDR_PUT_U_INT32(buf, objp->nlink);
+    IXDR_PUT_U_INT32(buf, objp->uid);
+    IXDR_PUT_U_INT32(buf, objp->gid);
+    IXDR_PUT_UINT64(buf, objp->size);
+    IXDR_PUT_UINT64(buf, objp->used);
+    IXDR_PUT_U_INT32(buf, objp->rdev.specdata1);
+    IXDR_PUT_U_INT32(buf, objp->rdev.specdata2);
+    IXDR_PUT_UINT64(buf, objp->fsid);
+    IXDR_PUT_UINT64(buf, objp->fileid);
+    IXDR_PUT_U_INT32(buf, objp->atime.seconds);
+    IXDR_PUT_U_INT32(buf, objp->atime.nseconds);
+    IXDR_PUT_U_INT32(buf, objp->mtime.seconds);
+    IXDR_PUT_U_INT32(buf, objp->mtime.nseconds);
+    IXDR_PUT_U_INT32(buf, objp->ctime.seconds);
+    IXDR_PUT_U_INT32(buf, objp->ctime.nseconds);
+}
+
 bool_t xdr_fattr3(XDR * xdrs, fattr3 * objp)
 {
+    int32_t *buf;
+
+    if (xdrs->x_op == XDR_ENCODE) {
+	buf = XDR_INLINE(xdrs, FATTR3_SIZE);
+	if (buf) {
+	    xdr_put_fattr3(buf, objp);
+	    return TRUE;
+	}
+    }
     if (!xdr_ftype3(xdrs, &objp->type))
 	return FALSE;
     if (!xdr_mode3(xdrs, &objp->mode))
@@ -371,6 +404,16 @@ bool_t xdr_fattr3(XDR * xdrs, fattr3 * objp)
 
 bool_t xdr_post_op_attr(XDR * xdrs, post_op_attr * objp)
 {
+    int32_t *buf;
+
+    if (xdrs->x_op == XDR_ENCODE && objp->attributes_follow == TRUE) {
+	buf = XDR_INLINE(xdrs, BYTES_PER_XDR_UNIT + FATTR3_SIZE);
+	if (buf) {
+	    IXDR_PUT_BOOL(buf, TRUE);
+	    xdr_put_fattr3(buf, &objp->post_op_attr_u.attributes);
+	    return TRUE;
+	}
+    }
     if (!xdr_bool(xdrs, &objp->attributes_follow))
 	return FALSE;
     switch (objp->attributes_follow) {
@@ -1366,6 +1409,34 @@ bool_t xdr_READDIR3res(XDR * xdrs, READDIR3res * objp)
     return TRUE;
 }
 
+/*
+ * encode a READDIR reply whose entries are already in XDR; their length is
+ * a multiple of 4, so xdr_opaque copies them as they are
+ */
+bool_t xdr_READDIR3res_direct(XDR * xdrs, READDIR3res_direct * objp)
+{
+    READDIR3resok *resok = &objp->res.READDIR3res_u.resok;
+    bool_t more = FALSE;
+
+    if (xdrs->x_op != XDR_ENCODE)
+	return xdrs->x_op == XDR_FREE;
+    if (objp->res.status != NFS3_OK)
+	return xdr_READDIR3res(xdrs, &objp->res);
+    if (!xdr_nfsstat3(xdrs, &objp->res.status))
+	return FALSE;
+    if (!xdr_post_op_attr(xdrs, &resok->dir_attributes))
+	return FALSE;
+    if (!xdr_cookieverf3(xdrs, resok->cookieverf))
+	return FALSE;
+    if (!xdr_opaque(xdrs, objp->entries, objp->entries_len))
+	return FALSE;
+    if (!xdr_bool(xdrs, &more))
+	return FALSE;
+    if (!xdr_bool(xdrs, &resok->reply.eof))
+	return FALSE;
+    return TRUE;
+}
+
 bool_t xdr_READDIRPLUS3args(XDR * xdrs, READDIRPLUS3args * objp)
 {
     if (!xdr_nfs_fh3(xdrs, &objp->dir))
@@ -23,6 +23,12 @@ extern bool_t xdr_exportnode (XDR *, exportnode*);
 
 /* NFS protocol */
 
+/* encoded fattr3 */
+#define FATTR3_SIZE 84
+
+#define IXDR_PUT_UINT64(buf, v) \
+	(IXDR_PUT_U_INT32(buf, (uint64) (v) >> 32), IXDR_PUT_U_INT32(buf, v))
+
 extern bool_t xdr_filename (XDR *, filename*);
 extern bool_t xdr_nfspath (XDR *, nfspath*);
 #ifndef HAVE_XDR_UINT64
@@ -139,6 +145,7 @@ extern bool_t xdr_dirlist3 (XDR *, dirlist3*);
 extern bool_t xdr_READDIR3resok (XDR *, READDIR3resok*);
 extern bool_t xdr_READDIR3resfail (XDR *, READDIR3resfail*);
 extern bool_t xdr_READDIR3res (XDR *, READDIR3res*);
+extern bool_t xdr_READDIR3res_direct (XDR *, READDIR3res_direct*);
 extern bool_t xdr_READDIRPLUS3args (XDR *, READDIRPLUS3args*);
 extern bool_t xdr_entryplus3 (XDR *, entryplus3*);
 extern bool_t xdr_dirlistplus3 (XDR *, dirlistplus3*);
@@ -0,0 +1,571 @@
+
+/*
+ * UNFS3 TCP transport
+ *
+ * Stands in for svctcp. Calls are read a whole record at a time, and
+ * replies are written as a gather list, so READ data goes to the socket
+ * straight from the buffer the backend filled instead of being copied
+ * through an xdrrec stream in small chunks. When the backend has the data
+ * in a real file, it doesn't even pass through that buffer: the READ
+ * procedure hands over a descriptor and the data goes out with sendfile.
+ *
+ * see file LICENSE for license details
+ */
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef _TIRPC_SVC_H
+#include <rpc/svc_mt.h>
+#endif
+
+/* seconds to wait for the rest of a record, as svctcp does */
+#define STREAM_WAIT 35
+
+/* first size of the buffer ordinary replies are encoded in */
+#define STREAM_OUTSIZE 8192
+
+/*
+ * calls up to this size are read into the connection's own buffer; bigger
+ * ones, up to a whole WRITE in an iobuf_size buffer, borrow from the pool
+ */
+#define STREAM_INSIZE 8192
+
+#define LAST_FRAG 0x80000000U
+
+#ifdef _TIRPC_SVC_H
+typedef void *stream_args_t;
+#else
+typedef caddr_t stream_args_t;
+#endif
+
+/* file the next READ reply's data comes from, see svcstream_sendfile */
+static int sendfile_fd = -1;
+static off_t sendfile_off;
+
+struct stream_conn {
+    enum xprt_stat stat;
+    uint32 xid;			/* of the call being served */
+    XDR xdrs;			/* decodes the call out of in */
+    char *in;			/* current call record, small or from the pool */
+    u_int in_len;
+    char *small;
+    char *out;			/* ordinary replies, after a 4 byte record mark */
+    u_int out_size;
+    u_int out_len;		/* of the last reply, data and record mark too */
+};
+
+static bool_t stream_recv(SVCXPRT *, struct rpc_msg *);
+static enum xprt_stat stream_stat(SVCXPRT *);
+static bool_t stream_getargs(SVCXPRT *, xdrproc_t, stream_args_t);
+static bool_t stream_reply(SVCXPRT *, struct rpc_msg *);
+static bool_t stream_freeargs(SVCXPRT *, xdrproc_t, stream_args_t);
+static void stream_destroy(SVCXPRT *);
+
+static bool_t rendezvous_request(SVCXPRT *, struct rpc_msg *);
+static enum xprt_stat rendezvous_stat(SVCXPRT *);
+static bool_t rendezvous_getargs(SVCXPRT *, xdrproc_t, stream_args_t);
+static bool_t rendezvous_reply(SVCXPRT *, struct rpc_msg *);
+
+static struct xp_ops stream_ops = {
+    stream_recv, stream_stat, stream_getargs,
+    stream_reply, stream_freeargs, stream_destroy
+};
+
+static struct xp_ops rendezvous_ops = {
+    rendezvous_request, rendezvous_stat, rendezvous_getargs,
+    rendezvous_reply, rendezvous_getargs, stream_destroy
+};
+
+/*
+ * allocate a transport handle for a socket
+ */
+static SVCXPRT *stream_xprt_alloc(int sock, struct xp_ops *ops)
+{
+    SVCXPRT *xprt;
+
+    xprt = calloc(1, sizeof(SVCXPRT));
+    if (!xprt)
+	return NULL;
+
+#ifdef _TIRPC_SVC_H
+    /* tirpc keeps per-transport auth and flags behind xp_p3 */
+    xprt->xp_p3 = calloc(1, sizeof(SVCXPRT_EXT));
+    if (!xprt->xp_p3) {
+	free(xprt);
+	return NULL;
+    }
+#endif
+
+    xprt->xp_sock = sock;
+    xprt->xp_ops = ops;
+    return xprt;
+}
+
+/*
+ * read exactly len bytes, giving up on errors, EOF or a stalled peer
+ */
+static bool_t read_full(int fd, char *buf, u_int len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	n = read(fd, buf, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return FALSE;
+	buf += n;
+	len -= n;
+    }
+    return TRUE;
+}
+
+/*
+ * give back a pool buffer borrowed for a large call
+ */
+static void release_record(struct stream_conn *cd)
+{
+    if (cd->in != cd->small) {
+	iobuf_put(cd->in);
+	cd->in = cd->small;
+    }
+}
+
+/*
+ * read one call record, which may come in several fragments
+ */
+static bool_t read_record(int fd, struct stream_conn *cd)
+{
+    uint32 mark;
+    u_int len;
+    char *big;
+
+    release_record(cd);
+    cd->in_len = 0;
+    do {
+	if (!read_full(fd, (char *) &mark, sizeof(mark)))
+	    return FALSE;
+	mark = ntohl(mark);
+	len = mark & ~LAST_FRAG;
+
+	if (len > iobuf_size - cd->in_len) {
+	    logmsg(LOG_WARNING, "dropping connection sending oversized record");
+	    return FALSE;
+	}
+
+	if (cd->in_len + len > STREAM_INSIZE && cd->in == cd->small) {
+	    big = iobuf_get();
+	    if (!big)
+		return FALSE;
+	    memcpy(big, cd->small, cd->in_len);
+	    cd->in = big;
+	}
+
+	if (!read_full(fd, cd->in + cd->in_len, len))
+	    return FALSE;
+	cd->in_len += len;
+    } while (!(mark & LAST_FRAG));
+
+    return TRUE;
+}
+
+/*
+ * write out a set of buffers completely
+ */
+static bool_t write_all(int fd, struct iovec *iov, int cnt, int flags)
+{
+    struct msghdr mh;
+    ssize_t n;
+
+    while (cnt > 0) {
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = cnt;
+	n = sendmsg(fd, &mh, flags | MSG_NOSIGNAL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return FALSE;
+	}
+
+	/* skip what went out, resume mid-buffer if need be */
+	while (cnt > 0 && (size_t) n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    cnt--;
+	}
+	if (cnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return TRUE;
+}
+
+/*
+ * send len bytes of a file; running short means the file shrank after
+ * the reply header promised the data, and the connection can't recover
+ */
+static bool_t sendfile_all(int sock, int fd, off_t off, u_int len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	n = sendfile(sock, fd, &off, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return FALSE;
+	len -= n;
+    }
+    return TRUE;
+}
+
+void svcstream_sendfile(int fd, uint64 offset)
+{
+    sendfile_fd = fd;
+    sendfile_off = offset;
+}
+
+bool_t svcstream_sizes(SVCXPRT *xprt, u_int *in, u_int *out)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    if (xprt->xp_ops != &stream_ops)
+	return FALSE;
+    *in = cd->in_len + 4;
+    *out = cd->out_len;
+    return TRUE;
+}
+
+bool_t svcstream_xid(SVCXPRT *xprt, uint32 *xid)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    if (xprt->xp_ops != &stream_ops)
+	return FALSE;
+    *xid = cd->xid;
+    return TRUE;
+}
+
+static bool_t stream_recv(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    cd->out_len = 0;
+    if (read_record(xprt->xp_sock, cd)) {
+	xdrmem_create(&cd->xdrs, cd->in, cd->in_len, XDR_DECODE);
+	if (xdr_callmsg(&cd->xdrs, msg)) {
+	    cd->xid = msg->rm_xid;
+	    return TRUE;
+	}
+    }
+
+    cd->stat = XPRT_DIED;
+    return FALSE;
+}
+
+static enum xprt_stat stream_stat(SVCXPRT *xprt)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    return cd->stat;
+}
+
+/*
+ * decode WRITE arguments, leaving the data where it is in the record
+ * instead of having xdr_bytes copy it out; the record stays until freeargs
+ */
+static bool_t decode_write(struct stream_conn *cd, WRITE3args *args)
+{
+    XDR *xdrs = &cd->xdrs;
+    u_int len, pos;
+
+    if (!xdr_nfs_fh3(xdrs, &args->file) ||
+	!xdr_offset3(xdrs, &args->offset) ||
+	!xdr_count3(xdrs, &args->count) ||
+	!xdr_stable_how(xdrs, &args->stable) || !xdr_u_int(xdrs, &len))
+	return FALSE;
+
+    pos = xdr_getpos(xdrs);
+    if (len > cd->in_len - pos)
+	return FALSE;
+
+    args->data.data_len = len;
+    args->data.data_val = cd->in + pos;
+    return TRUE;
+}
+
+static bool_t stream_getargs(SVCXPRT *xprt, xdrproc_t xdr_args,
+			     stream_args_t args_ptr)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    if (xdr_args == (xdrproc_t) xdr_WRITE3args)
+	return decode_write(cd, (WRITE3args *) args_ptr);
+    return (*xdr_args) (&cd->xdrs, args_ptr);
+}
+
+static bool_t stream_freeargs(SVCXPRT *xprt, xdrproc_t xdr_args,
+			      stream_args_t args_ptr)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+    bool_t res;
+
+    /* WRITE data points into the record, it isn't ours to free */
+    if (xdr_args == (xdrproc_t) xdr_WRITE3args)
+	((WRITE3args *) args_ptr)->data.data_val = NULL;
+
+    cd->xdrs.x_op = XDR_FREE;
+    res = (*xdr_args) (&cd->xdrs, args_ptr);
+    release_record(cd);
+    return res;
+}
+
+/*
+ * encode a reply into the output buffer, growing it if needed
+ */
+static bool_t encode_reply(struct stream_conn *cd, struct rpc_msg *msg,
+			   u_int *len)
+{
+    XDR xdrs;
+    char *grown;
+
+    for (;;) {
+	xdrmem_create(&xdrs, cd->out + 4, cd->out_size - 4, XDR_ENCODE);
+	if (xdr_replymsg(&xdrs, msg)) {
+	    *len = xdr_getpos(&xdrs);
+	    xdr_destroy(&xdrs);
+	    return TRUE;
+	}
+	xdr_destroy(&xdrs);
+
+	if (cd->out_size >= iobuf_size)
+	    return FALSE;
+	grown = realloc(cd->out, cd->out_size * 2);
+	if (!grown)
+	    return FALSE;
+	cd->out = grown;
+	cd->out_size *= 2;
+    }
+}
+
+static bool_t stream_reply(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+    READ3res *rres = NULL;
+    READ3res head;
+    static char pad[4];
+    struct iovec iov[3];
+    u_int len, data_len = 0;
+    uint32 word;
+    int fd = sendfile_fd;
+    bool_t ok;
+
+    msg->rm_xid = cd->xid;
+    sendfile_fd = -1;
+
+    /*
+     * successful READs are encoded without their data, which then goes
+     * out as its own iovec from wherever the READ procedure left it
+     */
+    if (msg->rm_reply.rp_stat == MSG_ACCEPTED &&
+	msg->acpted_rply.ar_stat == SUCCESS &&
+	msg->acpted_rply.ar_results.proc == (xdrproc_t) xdr_READ3res) {
+	rres = (READ3res *) msg->acpted_rply.ar_results.where;
+	if (rres->status == NFS3_OK &&
+	    rres->READ3res_u.resok.data.data_len > 0) {
+	    head = *rres;
+	    data_len = rres->READ3res_u.resok.data.data_len;
+	    head.READ3res_u.resok.data.data_len = 0;
+	    msg->acpted_rply.ar_results.where = (caddr_t) & head;
+	} else
+	    rres = NULL;
+    }
+
+    if (!encode_reply(cd, msg, &len)) {
+	logmsg(LOG_ERR, "unable to encode RPC reply");
+	return FALSE;
+    }
+    slowlog_phase(SLOWLOG_ENCODE);
+
+    iov[0].iov_base = cd->out;
+    iov[0].iov_len = len + 4;
+    iov[1].iov_base = iov[2].iov_base = NULL;
+    iov[1].iov_len = iov[2].iov_len = 0;
+
+    if (rres) {
+	/* the data length was encoded as zero, it's the last word */
+	word = htonl(data_len);
+	memcpy(cd->out + 4 + len - 4, &word, 4);
+
+	iov[1].iov_base = rres->READ3res_u.resok.data.data_val;
+	iov[1].iov_len = data_len;
+	iov[2].iov_base = pad;
+	iov[2].iov_len = (4 - (data_len & 3)) & 3;
+	len += data_len + iov[2].iov_len;
+    }
+
+    word = htonl(LAST_FRAG | len);
+    memcpy(cd->out, &word, 4);
+    cd->out_len = len + 4;
+
+    if (rres && !rres->READ3res_u.resok.data.data_val) {
+	/* data comes from a file: header, then sendfile, then the pad */
+	ok = fd >= 0 &&
+	    write_all(xprt->xp_sock, iov, 1, MSG_MORE) &&
+	    sendfile_all(xprt->xp_sock, fd, sendfile_off, data_len) &&
+	    write_all(xprt->xp_sock, iov + 2, 1, 0);
+    } else
+	ok = write_all(xprt->xp_sock, iov, 3, 0);
+
+    if (!ok) {
+	cd->stat = XPRT_DIED;
+	return FALSE;
+    }
+    return TRUE;
+}
+
+static void stream_destroy(SVCXPRT *xprt)
+{
+    struct stream_conn *cd = xprt->xp_p1;
+
+    xprt_unregister(xprt);
+    close(xprt->xp_sock);
+    if (cd) {
+	release_record(cd);
+	free(cd->small);
+	free(cd->out);
+	free(cd);
+    }
+#ifdef _TIRPC_SVC_H
+    free(xprt->xp_p3);
+#endif
+    free(xprt);
+}
+
+/*
+ * set up a transport for a freshly accepted connection
+ */
+static SVCXPRT *stream_conn_create(int sock, struct sockaddr_in *addr,
+				   socklen_t addrlen)
+{
+    SVCXPRT *xprt;
+    struct stream_conn *cd;
+    struct timeval tv;
+
+    cd = calloc(1, sizeof(struct stream_conn));
+    if (!cd)
+	return NULL;
+    cd->stat = XPRT_IDLE;
+    cd->out_size = STREAM_OUTSIZE;
+    cd->out = malloc(cd->out_size);
+    cd->in = cd->small = malloc(STREAM_INSIZE);
+
+    xprt = stream_xprt_alloc(sock, &stream_ops);
+    if (!xprt || !cd->out || !cd->small) {
+	free(cd->out);
+	free(cd->small);
+	free(cd);
+	free(xprt);
+	return NULL;
+    }
+
+    /* don't let a peer stall us forever in the middle of a record */
+    tv.tv_sec = STREAM_WAIT;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    xprt->xp_p1 = cd;
+    memcpy(&xprt->xp_raddr, addr, addrlen);
+    xprt->xp_addrlen = addrlen;
+#ifdef _TIRPC_SVC_H
+    xprt->xp_rtaddr.buf = &xprt->xp_raddr;
+    xprt->xp_rtaddr.len = addrlen;
+    xprt->xp_rtaddr.maxlen = sizeof(xprt->xp_raddr);
+#endif
+
+    xprt_register(xprt);
+    return xprt;
+}
+
+static bool_t rendezvous_request(SVCXPRT *xprt, U(struct rpc_msg *msg))
+{
+    struct sockaddr_in addr;
+    socklen_t len;
+    int sock;
+
+    do {
+	len = sizeof(addr);
+	sock = accept(xprt->xp_sock, (struct sockaddr *) &addr, &len);
+    } while (sock < 0 && errno == EINTR);
+
+    if (sock < 0)
+	return FALSE;
+
+    if (!stream_conn_create(sock, &addr, len)) {
+	logmsg(LOG_ERR, "unable to set up tcp connection");
+	close(sock);
+    }
+
+    /* there is never an rpc message to handle on the listening socket */
+    return FALSE;
+}
+
+static enum xprt_stat rendezvous_stat(U(SVCXPRT *xprt))
+{
+    return XPRT_IDLE;
+}
+
+static bool_t rendezvous_getargs(U(SVCXPRT *xprt), U(xdrproc_t xdr_args),
+				 U(stream_args_t args_ptr))
+{
+    return FALSE;
+}
+
+static bool_t rendezvous_reply(U(SVCXPRT *xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+/*
+ * create a listening TCP transport on a bound socket, or on any port
+ * if sock is RPC_ANYSOCK
+ */
+SVCXPRT *svcstream_create(int sock)
+{
+    SVCXPRT *xprt;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (sock == RPC_ANYSOCK) {
+	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0)
+	    return NULL;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+	    close(sock);
+	    return NULL;
+	}
+    }
+
+    if (getsockname(sock, (struct sockaddr *) &addr, &len) ||
+	listen(sock, SOMAXCONN)) {
+	logmsg(LOG_ERR, "svcstream_create: %s", strerror(errno));
+	close(sock);
+	return NULL;
+    }
+
+    xprt = stream_xprt_alloc(sock, &rendezvous_ops);
+    if (!xprt) {
+	close(sock);
+	return NULL;
+    }
+    xprt->xp_port = ntohs(addr.sin_port);
+
+    xprt_register(xprt);
+    return xprt;
+}
@@ -0,0 +1,28 @@
+/*
+ * UNFS3 TCP transport
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_XPRT_H
+#define UNFS3_XPRT_H
+
+/* smallest READ worth sending with sendfile rather than from a buffer */
+#define STREAM_SENDFILE_MIN 16384
+
+SVCXPRT *svcstream_create(int sock);
+
+/*
+ * have the next READ reply take its data from fd at offset, via
+ * sendfile, instead of from the reply's data buffer
+ */
+void svcstream_sendfile(int fd, uint64 offset);
+
+/*
+ * sizes of the call record last read on xprt and the reply to it, if xprt
+ * is one of ours
+ */
+bool_t svcstream_sizes(SVCXPRT *xprt, u_int *in, u_int *out);
+
+/* xid of the call being served on xprt, if xprt is one of ours */
+bool_t svcstream_xid(SVCXPRT *xprt, uint32 *xid);
+#endif
@@ -0,0 +1,374 @@
+package main
+
+//#include "unfs3/daemon.h"
+import "C"
+import (
+	"fmt"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+//Write gathering: UNSTABLE writes are buffered per file as sorted, merged
+//dirty extents instead of going straight to the backend. Extents get pushed
+//out as large aligned writes when a file's buffered data passes the size
+//threshold, when it's been dirty for longer than maxAge, or on COMMIT.
+//A nil *writeGatherer is valid and means gathering is turned off.
+//
+//Gathered data has been acknowledged to the client as UNSTABLE, so if a
+//flush fails it's gone. When that happens the write verifier is regenerated:
+//the client sees the new verifier on its next WRITE or COMMIT and resends
+//everything it hasn't had committed yet. The lost ranges are remembered so
+//those resends can be counted.
+type writeGatherer struct {
+	threshold int           //bytes buffered per file before it gets flushed
+	maxAge    time.Duration //how long data may sit before the timer flushes it
+	lock      *sync.Mutex
+	files     map[string]*gatherFile
+
+	writesIn  int64 //client writes taken in
+	bytesIn   int64
+	writesOut int64 //backend writes issued
+	bytesOut  int64
+	verfRegen int64 //times the write verifier was changed because data was lost
+	resends   int64 //client writes that landed on previously lost ranges
+}
+
+type gatherFile struct {
+	lock    sync.Mutex
+	extents []dirtyExtent //sorted by offset, never overlapping or touching
+	pending int           //bytes held in extents
+	since   time.Time     //when the oldest buffered data came in
+	lost    []lostRange   //ranges dropped by a failed flush, awaiting resends
+	gone    bool          //out of the map, so whoever's holding it has to look again
+}
+
+type lostRange struct {
+	off, end int64
+}
+
+type dirtyExtent struct {
+	off  int64
+	data []byte
+}
+
+func (e dirtyExtent) end() int64 {
+	return e.off + int64(len(e.data))
+}
+
+var wgather *writeGatherer //nil unless turned on with -o wgather=KiB
+
+func newWriteGatherer(threshold int, maxAge time.Duration) *writeGatherer {
+	w := &writeGatherer{threshold: threshold,
+		maxAge: maxAge,
+		lock:   new(sync.Mutex),
+		files:  make(map[string]*gatherFile)}
+	go w.run()
+	return w
+}
+
+//write buffers a copy of b (which usually aliases C memory) at off.
+func (w *writeGatherer) write(path string, b []byte, off int64) error {
+	atomic.AddInt64(&w.writesIn, 1)
+	atomic.AddInt64(&w.bytesIn, int64(len(b)))
+
+	var gf *gatherFile
+	for {
+		w.lock.Lock()
+		var ok bool
+		gf, ok = w.files[path]
+		if !ok {
+			gf = new(gatherFile)
+			w.files[path] = gf
+		}
+		w.lock.Unlock()
+		gf.lock.Lock()
+		if !gf.gone {
+			break
+		}
+		gf.lock.Unlock()
+	}
+	defer gf.lock.Unlock()
+	if gf.pending == 0 {
+		gf.since = time.Now()
+	}
+	if gf.resent(off, off+int64(len(b))) {
+		atomic.AddInt64(&w.resends, 1)
+	}
+	gf.insert(b, off)
+	if gf.pending >= w.threshold {
+		return w.flushLocked(path, gf)
+	}
+	return nil
+}
+
+//insert merges [off, off+len(b)) into the extent list, absorbing any extents
+//it overlaps or touches. The newest data wins where they overlap.
+func (gf *gatherFile) insert(b []byte, off int64) {
+	end := off + int64(len(b))
+	i := sort.Search(len(gf.extents), func(n int) bool { return gf.extents[n].end() >= off })
+	j := i
+	for j < len(gf.extents) && gf.extents[j].off <= end {
+		j++
+	}
+
+	if i == j { //nothing to merge with
+		data := make([]byte, len(b))
+		copy(data, b)
+		gf.extents = append(gf.extents, dirtyExtent{})
+		copy(gf.extents[i+1:], gf.extents[i:])
+		gf.extents[i] = dirtyExtent{off, data}
+		gf.pending += len(data)
+		return
+	}
+
+	first, last := gf.extents[i], gf.extents[j-1]
+	start, stop := first.off, last.end()
+	if off < start {
+		start = off
+	}
+	if end > stop {
+		stop = end
+	}
+
+	//reuse the first extent's buffer when it already starts at the right
+	//place; that keeps sequential appends amortized like a plain append
+	merged := first.data
+	if start < first.off {
+		merged = make([]byte, first.end()-start)
+		copy(merged[first.off-start:], first.data)
+	}
+	if grow := int(stop-start) - len(merged); grow > 0 {
+		merged = append(merged, make([]byte, grow)...)
+	}
+	for _, e := range gf.extents[i+1 : j] {
+		copy(merged[e.off-start:], e.data)
+	}
+	copy(merged[off-start:], b)
+
+	for _, e := range gf.extents[i:j] {
+		gf.pending -= len(e.data)
+	}
+	gf.pending += len(merged)
+	gf.extents[i] = dirtyExtent{start, merged}
+	gf.extents = append(gf.extents[:i+1], gf.extents[j:]...)
+}
+
+//resent trims [off, end) out of the lost ranges, reporting whether it hit any.
+func (gf *gatherFile) resent(off, end int64) bool {
+	hit := false
+	kept := gf.lost[:0]
+	for _, l := range gf.lost {
+		if l.end <= off || l.off >= end {
+			kept = append(kept, l)
+			continue
+		}
+		hit = true
+		if l.off < off {
+			kept = append(kept, lostRange{l.off, off})
+		}
+		if l.end > end {
+			kept = append(kept, lostRange{end, l.end})
+		}
+	}
+	gf.lost = kept
+	return hit
+}
+
+//flushLocked writes out everything buffered for gf. Caller holds gf.lock.
+//Whatever fails to make it out is lost, and the write verifier changes.
+func (w *writeGatherer) flushLocked(path string, gf *gatherFile) error {
+	var ferr error
+	for _, e := range gf.extents {
+		if err := w.writeExtent(path, e); err != nil {
+			gf.lost = append(gf.lost, lostRange{e.off, e.end()})
+			if ferr == nil {
+				ferr = err
+			}
+		}
+	}
+	gf.extents = nil
+	gf.pending = 0
+	if ferr != nil {
+		atomic.AddInt64(&w.verfRegen, 1)
+		C.regen_write_verf()
+	}
+	return ferr
+}
+
+//writeExtent pushes one extent to the backend, split on threshold-aligned
+//boundaries so backend writes stay large and aligned.
+func (w *writeGatherer) writeExtent(path string, e dirtyExtent) error {
+	align := int64(w.threshold)
+	for pos := e.off; pos < e.end(); {
+		next := (pos/align + 1) * align
+		if next > e.end() {
+			next = e.end()
+		}
+		n, err := ns.WriteFile(path, e.data[pos-e.off:next-e.off], pos)
+		atomic.AddInt64(&w.writesOut, 1)
+		atomic.AddInt64(&w.bytesOut, int64(n))
+		if err != nil && !strings.Contains(strings.ToLower(err.Error()), "eof") {
+			return err
+		}
+		pos = next
+	}
+	return nil
+}
+
+//flush makes everything buffered for path durable in the backend.
+func (w *writeGatherer) flush(path string) error {
+	if w == nil {
+		return nil
+	}
+	w.lock.Lock()
+	gf, ok := w.files[path]
+	w.lock.Unlock()
+	if !ok {
+		return nil
+	}
+	gf.lock.Lock()
+	if gf.gone { //discarded, or forgotten since it was clean
+		gf.lock.Unlock()
+		return nil
+	}
+	err := w.flushLocked(path, gf)
+	gf.lock.Unlock()
+	w.forget(path, gf)
+	return err
+}
+
+//flushPrefix flushes every file at or under dirpath.
+func (w *writeGatherer) flushPrefix(dirpath string) error {
+	if w == nil {
+		return nil
+	}
+	var ferr error
+	for _, p := range w.paths() {
+		if p == dirpath || strings.HasPrefix(p, dirpath+"/") || dirpath == "/" {
+			if err := w.flush(p); err != nil && ferr == nil {
+				ferr = err
+			}
+		}
+	}
+	return ferr
+}
+
+func (w *writeGatherer) flushAll() error {
+	return w.flushPrefix("/")
+}
+
+//discard drops buffered data for a file that's about to be removed or
+//replaced, so that nothing holding on to its entry, like run, writes it out
+//after all.
+func (w *writeGatherer) discard(path string) {
+	if w == nil {
+		return
+	}
+	w.lock.Lock()
+	if gf, ok := w.files[path]; ok {
+		gf.lock.Lock()
+		gf.extents, gf.pending, gf.lost = nil, 0, nil
+		gf.gone = true
+		gf.lock.Unlock()
+		delete(w.files, path)
+	}
+	w.lock.Unlock()
+}
+
+//discardPrefix discards every file at or under dirpath, for a rename that
+//replaces it.
+func (w *writeGatherer) discardPrefix(dirpath string) {
+	if w == nil {
+		return
+	}
+	for _, p := range w.paths() {
+		if p == dirpath || strings.HasPrefix(p, dirpath+"/") || dirpath == "/" {
+			w.discard(p)
+		}
+	}
+}
+
+//pendingEnd is the end of the furthest buffered byte for path, or 0.
+//Stats use it so the size clients see includes data not yet written out.
+func (w *writeGatherer) pendingEnd(path string) int64 {
+	if w == nil {
+		return 0
+	}
+	w.lock.Lock()
+	gf, ok := w.files[path]
+	w.lock.Unlock()
+	if !ok {
+		return 0
+	}
+	gf.lock.Lock()
+	defer gf.lock.Unlock()
+	if len(gf.extents) == 0 {
+		return 0
+	}
+	return gf.extents[len(gf.extents)-1].end()
+}
+
+//forget removes an idle, clean entry so the map doesn't grow without bound.
+func (w *writeGatherer) forget(path string, gf *gatherFile) {
+	w.lock.Lock()
+	gf.lock.Lock()
+	if gf.pending == 0 && len(gf.lost) == 0 && w.files[path] == gf {
+		gf.gone = true
+		delete(w.files, path)
+	}
+	gf.lock.Unlock()
+	w.lock.Unlock()
+}
+
+func (w *writeGatherer) paths() []string {
+	w.lock.Lock()
+	ps := make([]string, 0, len(w.files))
+	for p := range w.files {
+		ps = append(ps, p)
+	}
+	w.lock.Unlock()
+	return ps
+}
+
+//run is the timer side: anything dirty for longer than maxAge gets flushed.
+//A failure here only shows up to clients as a changed write verifier.
+func (w *writeGatherer) run() {
+	tick := time.NewTicker(w.maxAge / 2)
+	for range tick.C {
+		for _, p := range w.paths() {
+			w.lock.Lock()
+			gf, ok := w.files[p]
+			w.lock.Unlock()
+			if !ok {
+				continue
+			}
+			gf.lock.Lock()
+			if !gf.gone && gf.pending > 0 && time.Since(gf.since) >= w.maxAge {
+				if err := w.flushLocked(p, gf); err != nil {
+					lg.error("gathered write failed, write verifier changed", "path", p, "err", err)
+				}
+			}
+			gf.lock.Unlock()
+		}
+	}
+}
+
+//stats reports how well writes are being merged.
+func (w *writeGatherer) stats() string {
+	if w == nil {
+		return "Write gathering: off"
+	}
+	in := atomic.LoadInt64(&w.writesIn)
+	out := atomic.LoadInt64(&w.writesOut)
+	ratio := 0.0
+	if out > 0 {
+		ratio = float64(in) / float64(out)
+	}
+	return fmt.Sprintf("Write gathering: %d writes (%d bytes) merged into %d backend writes (%d bytes), ratio %.2f; "+
+		"verifier changed %d times, %d writes resent",
+		in, atomic.LoadInt64(&w.bytesIn), out, atomic.LoadInt64(&w.bytesOut), ratio,
+		atomic.LoadInt64(&w.verfRegen), atomic.LoadInt64(&w.resends))
+}
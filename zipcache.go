@@ -0,0 +1,109 @@
+package main
+
+import (
+	"container/list"
+	"fmt"
+	"sync"
+)
+
+//chunkCache holds decompressed pieces of deflated zip entries, shared by
+//every read, so clients reading the same entry only pay to inflate it once.
+//It's kept under budget bytes by dropping the least recently used chunks.
+//A chunk being decoded is claimed, and anyone else wanting it waits for it
+//rather than decoding it a second time.
+type chunkCache struct {
+	lock     sync.Mutex
+	budget   int64
+	used     int64
+	chunks   map[chunkKey]*list.Element
+	lru      *list.List //of *cachedChunk, most recently used at the front
+	inflight map[chunkKey]chan bool
+
+	hits, misses, ahead, evictions int64
+}
+
+//chunkKey names chunk idx of the entry whose data starts at entry.
+type chunkKey struct {
+	entry int64
+	idx   int64
+}
+
+type cachedChunk struct {
+	key  chunkKey
+	data []byte
+}
+
+const (
+	zipChunk   = 256 * 1024
+	zipAhead   = 4 * 1024 * 1024 //how far past a sequential read to decode
+	zipWorkers = 4
+)
+
+func newChunkCache(budget int64) *chunkCache {
+	return &chunkCache{budget: budget,
+		chunks:   make(map[chunkKey]*list.Element),
+		lru:      list.New(),
+		inflight: make(map[chunkKey]chan bool)}
+}
+
+//claim returns the chunk's data if it's cached. Otherwise it returns a
+//channel that's closed when whoever is decoding it is done, or, when nobody
+//is, nil for both and the chunk is now the caller's to decode and put.
+func (c *chunkCache) claim(key chunkKey) ([]byte, chan bool) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	if el, ok := c.chunks[key]; ok {
+		c.lru.MoveToFront(el)
+		return el.Value.(*cachedChunk).data, nil
+	}
+	if wait, ok := c.inflight[key]; ok {
+		return nil, wait
+	}
+	c.inflight[key] = make(chan bool)
+	return nil, nil
+}
+
+//put stores a claimed chunk, or just releases the claim if data is nil.
+func (c *chunkCache) put(key chunkKey, data []byte) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	close(c.inflight[key])
+	delete(c.inflight, key)
+	if data == nil || int64(len(data)) > c.budget {
+		return
+	}
+	c.chunks[key] = c.lru.PushFront(&cachedChunk{key, data})
+	c.used += int64(len(data))
+	for c.used > c.budget {
+		ch := c.lru.Remove(c.lru.Back()).(*cachedChunk)
+		delete(c.chunks, ch.key)
+		c.used -= int64(len(ch.data))
+		c.evictions++
+	}
+}
+
+func (c *chunkCache) count(hit bool, ahead bool) {
+	c.lock.Lock()
+	switch {
+	case hit:
+		c.hits++
+	case ahead:
+		c.ahead++
+	default:
+		c.misses++
+	}
+	c.lock.Unlock()
+}
+
+func (c *chunkCache) stats() string {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	return fmt.Sprintf("Chunk cache: %d of %d bytes used, %d hits, %d misses, %d decoded ahead, %d evictions",
+		c.used, c.budget, c.hits, c.misses, c.ahead, c.evictions)
+}
+
+func (c *chunkCache) lookups() (hits, misses int64) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+	return c.hits, c.misses
+}
@@ -0,0 +1,445 @@
+package main
+
+import (
+	"archive/zip"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"os"
+	pathpkg "path"
+	"runtime"
+	"sort"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+//zipDir is a zip archive's central directory, read out of the archive
+//mapped into memory. Each entry is a 12 byte record pointing back into the
+//mapping, kept sorted by parent directory and then name, so finding an
+//entry is a binary search and a directory's entries sit next to each other.
+//Everything else about an entry is read from its central directory record
+//when it's needed. Records are parsed and sorted in parallel, which matters
+//for archives with millions of entries.
+//
+//The mapping is shared with the file, so an archive that's truncated while
+//it's being served will crash the server; zip files aren't usually edited
+//in place.
+type zipDir struct {
+	data  []byte //the whole archive
+	cd    []byte //its central directory
+	extra []byte //names that had to be cleaned up
+	recs  []zipRec
+}
+
+//zipRec is one entry. Its name is an offset into cd, or past the end of cd
+//into extra, and has no leading or trailing slash; the root has no record.
+type zipRec struct {
+	name    uint32
+	nameLen uint16
+	base    uint16 //where the last element of the name starts
+	hdr     uint32 //offset of the central directory record, or noHeader; in a tarIndex, which tarMeta
+}
+
+//noHeader marks directories the archive only implies, by having entries in them.
+const noHeader = ^uint32(0)
+
+var errNotZip = errors.New("not a zip file, or a damaged one")
+
+func le16(b []byte) int    { return int(binary.LittleEndian.Uint16(b)) }
+func le32(b []byte) uint32 { return binary.LittleEndian.Uint32(b) }
+func le64(b []byte) uint64 { return binary.LittleEndian.Uint64(b) }
+
+//bytesString views b as a string without copying it.
+func bytesString(b []byte) string {
+	if len(b) == 0 {
+		return ""
+	}
+	return *(*string)(unsafe.Pointer(&b))
+}
+
+func openZipDir(f *os.File, size int64) (*zipDir, error) {
+	if size < 22 || int64(int(size)) != size {
+		return nil, errNotZip
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(size), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	d := &zipDir{data: data}
+	if err := d.load(); err != nil {
+		d.close()
+		return nil, err
+	}
+	return d, nil
+}
+
+func (d *zipDir) close() {
+	if d.data != nil {
+		syscall.Munmap(d.data)
+	}
+	d.data, d.cd, d.recs = nil, nil, nil
+}
+
+//findEnd locates the central directory from the end of central directory
+//record, or its zip64 version.
+func (d *zipDir) findEnd() (off, size, count uint64, err error) {
+	b := d.data
+	lo := len(b) - 22 - 65535
+	if lo < 0 {
+		lo = 0
+	}
+	for i := len(b) - 22; i >= lo; i-- {
+		if le32(b[i:]) != 0x06054b50 || i+22+le16(b[i+20:]) > len(b) {
+			continue
+		}
+		count, size, off = uint64(le16(b[i+10:])), uint64(le32(b[i+12:])), uint64(le32(b[i+16:]))
+		if count == 0xffff || size == 0xffffffff || off == 0xffffffff {
+			if i < 20 || le32(b[i-20:]) != 0x07064b50 {
+				return 0, 0, 0, errNotZip
+			}
+			r := le64(b[i-12:])
+			if r > uint64(i) || uint64(i)-r < 56 || le32(b[r:]) != 0x06064b50 {
+				return 0, 0, 0, errNotZip
+			}
+			count, size, off = le64(b[r+32:]), le64(b[r+40:]), le64(b[r+48:])
+		}
+		if off > uint64(i) || size > uint64(i)-off {
+			return 0, 0, 0, errNotZip
+		}
+		return off, size, count, nil
+	}
+	return 0, 0, 0, errNotZip
+}
+
+func (d *zipDir) load() error {
+	off, size, count, err := d.findEnd()
+	if err != nil {
+		return err
+	}
+	if size >= uint64(noHeader)/2 {
+		return errors.New("zip central directory too big")
+	}
+	d.cd = d.data[off : off+size]
+
+	//record boundaries can only be found one after another, but that's cheap
+	if count > size/46 {
+		count = size / 46
+	}
+	recs := make([]zipRec, 0, count)
+	for p := 0; p+46 <= len(d.cd) && le32(d.cd[p:]) == 0x02014b50; {
+		n := 46 + le16(d.cd[p+28:]) + le16(d.cd[p+30:]) + le16(d.cd[p+32:])
+		if p+n > len(d.cd) {
+			return errNotZip
+		}
+		recs = append(recs, zipRec{hdr: uint32(p)})
+		p += n
+	}
+
+	parallel(len(recs), func(lo, hi int) {
+		for i := lo; i < hi; i++ {
+			d.parseName(&recs[i])
+		}
+	})
+	//the few names that need cleaning up get copies
+	kept := recs[:0]
+	for _, r := range recs {
+		if r.nameLen == 0 {
+			name := pathpkg.Clean("/" + d.storedName(r.hdr))[1:]
+			if name == "" {
+				continue
+			}
+			r.name = uint32(len(d.cd) + len(d.extra))
+			r.nameLen = uint16(len(name))
+			r.base = uint16(strings.LastIndexByte(name, '/') + 1)
+			d.extra = append(d.extra, name...)
+		}
+		kept = append(kept, r)
+	}
+	d.build(kept, false)
+	return nil
+}
+
+//build sorts recs into d.recs, keeping the first or the last in the archive
+//of any duplicates, and adds the directories they imply.
+func (d *zipDir) build(recs []zipRec, lastWins bool) {
+	d.recs = d.sortRecs(recs)
+	kept := d.recs[:0]
+	for i, r := range d.recs {
+		switch {
+		case i == 0 || d.compare(&d.recs[i-1], &r) != 0:
+			kept = append(kept, r)
+		case lastWins:
+			kept[len(kept)-1] = r
+		}
+	}
+	d.recs = kept
+
+	//add directories that are only implied
+	var implied []zipRec
+	seen := make(map[string]bool)
+	for i := range d.recs {
+		if i > 0 && d.parent(&d.recs[i]) == d.parent(&d.recs[i-1]) {
+			continue
+		}
+		for r := d.recs[i]; r.base > 0; {
+			r.nameLen, r.hdr = r.base-1, noHeader
+			name := d.name(&r)
+			r.base = uint16(strings.LastIndexByte(name, '/') + 1)
+			if seen[name] || d.find(name) >= 0 {
+				break
+			}
+			seen[name] = true
+			implied = append(implied, r)
+		}
+	}
+	if len(implied) > 0 {
+		implied = d.sortRecs(implied)
+		all := make([]zipRec, len(d.recs)+len(implied))
+		d.merge(all, d.recs, implied)
+		d.recs = all
+	}
+}
+
+//storedName is the name in the central directory record at hdr.
+func (d *zipDir) storedName(hdr uint32) string {
+	n := le16(d.cd[hdr+28:])
+	return bytesString(d.cd[hdr+46 : int(hdr)+46+n])
+}
+
+//parseName points r at its name, or leaves nameLen 0 if it needs cleaning.
+func (d *zipDir) parseName(r *zipRec) {
+	name := strings.TrimSuffix(d.storedName(r.hdr), "/")
+	if name == "" || name[0] == '/' || name == "." || name == ".." ||
+		strings.HasPrefix(name, "../") || pathpkg.Clean(name) != name {
+		return
+	}
+	r.name = r.hdr + 46
+	r.nameLen = uint16(len(name))
+	r.base = uint16(strings.LastIndexByte(name, '/') + 1)
+}
+
+func (d *zipDir) name(r *zipRec) string {
+	return bytesString(d.nameBytes(r))
+}
+
+func (d *zipDir) nameBytes(r *zipRec) []byte {
+	if int(r.name) < len(d.cd) {
+		return d.cd[r.name : r.name+uint32(r.nameLen)]
+	}
+	o := int(r.name) - len(d.cd)
+	return d.extra[o : o+int(r.nameLen)]
+}
+
+func (d *zipDir) parent(r *zipRec) string {
+	if r.base == 0 {
+		return ""
+	}
+	return d.name(r)[:r.base-1]
+}
+
+func (d *zipDir) baseName(r *zipRec) string {
+	return d.name(r)[r.base:]
+}
+
+//compare orders records by parent, then name. It works on bytes because
+//bytes.Compare takes one pass where strings.Compare takes two.
+func (d *zipDir) compare(a, b *zipRec) int {
+	na, nb := d.nameBytes(a), d.nameBytes(b)
+	pa, pb := 0, 0
+	if a.base > 0 {
+		pa = int(a.base) - 1
+	}
+	if b.base > 0 {
+		pb = int(b.base) - 1
+	}
+	if c := bytes.Compare(na[:pa], nb[:pb]); c != 0 {
+		return c
+	}
+	return bytes.Compare(na[a.base:], nb[b.base:])
+}
+
+//before orders records by parent, name, and then position in the archive.
+func (d *zipDir) before(a, b *zipRec) bool {
+	if c := d.compare(a, b); c != 0 {
+		return c < 0
+	}
+	return a.hdr < b.hdr
+}
+
+//sortRecs sorts pieces of recs in parallel and merges them, returning the
+//result, which may be in a different slice.
+func (d *zipDir) sortRecs(recs []zipRec) []zipRec {
+	parallel(len(recs), func(lo, hi int) {
+		part := recs[lo:hi]
+		sort.Slice(part, func(i, j int) bool { return d.before(&part[i], &part[j]) })
+	})
+	bounds := pieces(len(recs))
+
+	tmp := make([]zipRec, len(recs))
+	for len(bounds) > 2 {
+		var next []int
+		var wg sync.WaitGroup
+		for i := 0; i+1 < len(bounds); i += 2 {
+			next = append(next, bounds[i])
+			if i+2 >= len(bounds) {
+				copy(tmp[bounds[i]:bounds[i+1]], recs[bounds[i]:bounds[i+1]])
+				continue
+			}
+			wg.Add(1)
+			go func(lo, mid, hi int) {
+				d.merge(tmp[lo:hi], recs[lo:mid], recs[mid:hi])
+				wg.Done()
+			}(bounds[i], bounds[i+1], bounds[i+2])
+		}
+		wg.Wait()
+		bounds = append(next, len(recs))
+		recs, tmp = tmp, recs
+	}
+	return recs
+}
+
+func (d *zipDir) merge(dst, a, b []zipRec) {
+	i, j := 0, 0
+	for k := range dst {
+		if j == len(b) || (i < len(a) && !d.before(&b[j], &a[i])) {
+			dst[k] = a[i]
+			i++
+		} else {
+			dst[k] = b[j]
+			j++
+		}
+	}
+}
+
+//pieces splits n items into one run per CPU, returning the boundaries.
+func pieces(n int) []int {
+	p := runtime.GOMAXPROCS(0)
+	if p > n/1024 {
+		p = n/1024 + 1
+	}
+	bounds := make([]int, p+1)
+	for i := range bounds {
+		bounds[i] = n * i / p
+	}
+	return bounds
+}
+
+//parallel runs f over the pieces of n items at once.
+func parallel(n int, f func(lo, hi int)) {
+	bounds := pieces(n)
+	var wg sync.WaitGroup
+	wg.Add(len(bounds) - 1)
+	for i := 0; i+1 < len(bounds); i++ {
+		go func(lo, hi int) {
+			f(lo, hi)
+			wg.Done()
+		}(bounds[i], bounds[i+1])
+	}
+	wg.Wait()
+}
+
+//find returns the index of the record for name, or -1.
+func (d *zipDir) find(name string) int {
+	parent, base := "", name
+	if i := strings.LastIndexByte(name, '/'); i >= 0 {
+		parent, base = name[:i], name[i+1:]
+	}
+	i := sort.Search(len(d.recs), func(i int) bool {
+		r := &d.recs[i]
+		if c := strings.Compare(d.parent(r), parent); c != 0 {
+			return c > 0
+		}
+		return d.baseName(r) >= base
+	})
+	if i < len(d.recs) && d.parent(&d.recs[i]) == parent && d.baseName(&d.recs[i]) == base {
+		return i
+	}
+	return -1
+}
+
+//children returns the range of records in directory name.
+func (d *zipDir) children(name string) (int, int) {
+	lo := sort.Search(len(d.recs), func(i int) bool { return d.parent(&d.recs[i]) >= name })
+	hi := lo + sort.Search(len(d.recs)-lo, func(i int) bool { return d.parent(&d.recs[lo+i]) > name })
+	return lo, hi
+}
+
+//zipHeader is what the central directory says about an entry.
+type zipHeader struct {
+	method uint16
+	crc    uint32
+	csize  int64
+	size   int64
+	local  int64 //offset of the local header
+	mtime  time.Time
+	mode   os.FileMode
+}
+
+func (d *zipDir) header(r *zipRec) zipHeader {
+	b := d.cd[r.hdr:]
+	h := zipHeader{method: uint16(le16(b[10:])),
+		crc:   le32(b[16:]),
+		csize: int64(le32(b[20:])),
+		size:  int64(le32(b[24:])),
+		local: int64(le32(b[42:])),
+		mtime: msdosTime(le16(b[14:]), le16(b[12:]))}
+	nameLen, extraLen := le16(b[28:]), le16(b[30:])
+
+	for x := b[46+nameLen : 46+nameLen+extraLen]; len(x) >= 4; {
+		tag, n := le16(x), le16(x[2:])
+		if 4+n > len(x) {
+			break
+		}
+		f := x[4 : 4+n]
+		switch tag {
+		case 0x0001: //zip64 sizes and offset, for the ones that didn't fit
+			for _, v := range []*int64{&h.size, &h.csize, &h.local} {
+				if *v == 0xffffffff && len(f) >= 8 {
+					*v = int64(le64(f))
+					f = f[8:]
+				}
+			}
+		case 0x5455: //unix modification time
+			if len(f) >= 5 && f[0]&1 != 0 {
+				h.mtime = time.Unix(int64(int32(le32(f[1:]))), 0)
+			}
+		}
+		x = x[4+n:]
+	}
+
+	if nameLen > 0 && b[46+nameLen-1] == '/' {
+		h.mode = os.ModeDir | 0555
+	} else {
+		h.mode = 0444
+		if creator := b[5]; creator == 3 || creator == 19 { //unix, osx
+			h.mode |= os.FileMode(le32(b[38:])>>16) & 0555
+		}
+	}
+	return h
+}
+
+func msdosTime(date, tm int) time.Time {
+	return time.Date(date>>9+1980, time.Month(date>>5&0xf), date&0x1f,
+		tm>>11, tm>>5&0x3f, tm&0x1f*2, 0, time.UTC)
+}
+
+//dataOffset finds where an entry's data starts, from its local header,
+//making sure it's all in the archive. A stored entry's data is the file,
+//so its sizes must agree too.
+func (d *zipDir) dataOffset(h zipHeader) (int64, error) {
+	l := h.local
+	if l < 0 || l > int64(len(d.data))-30 || le32(d.data[l:]) != 0x04034b50 {
+		return 0, errNotZip
+	}
+	if h.method == zip.Store && h.size != h.csize {
+		return 0, errNotZip
+	}
+	off := l + 30 + int64(le16(d.data[l+26:])) + int64(le16(d.data[l+28:]))
+	if h.csize < 0 || off > int64(len(d.data))-h.csize {
+		return 0, errNotZip
+	}
+	return off, nil
+}
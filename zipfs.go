@@ -0,0 +1,279 @@
+package main
+
+import (
+	"archive/zip"
+	"bytes"
+	"errors"
+	"github.com/Zilog8/minfs"
+	"io"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+)
+
+//zipFS shares the contents of a zip archive, read only. Stored entries are
+//read straight out of the archive. Deflated ones are read through a
+//deflateReader (see deflate.go), whose seek indexes can be kept in indexDir
+//once they're complete (see zipindex.go).
+type zipFS struct {
+	deflateReader //over dir.data
+
+	path     string
+	file     *os.File
+	archive  os.FileInfo
+	indexDir string //where complete seek indexes are kept, "" for nowhere
+
+	dir     *zipDir
+	entries map[uint32]*zipEntry //files being read, by header offset
+}
+
+type zipEntry struct {
+	deflated //offset is of the entry's data in the archive
+	name     string
+	info     os.FileInfo
+	method   uint16
+	crc      uint32
+}
+
+const (
+	zipSpan  = 4  //MiB of output between seek points, by default
+	zipCache = 64 //MiB of decompressed chunks, by default
+)
+
+var errZipMethod = errors.New("zip entry uses an unsupported compression method")
+
+//config example:   ./archive.zip span=4 cache=64 index=/var/cache/unfs2go
+func zipfsPrep(args []string) (minfs.MinFS, error) {
+	if len(args) < 1 {
+		return nil, errors.New("-zip needs a zip file")
+	}
+	span, cache, indexDir := zipSpan, zipCache, ""
+	for _, a := range args[1:] {
+		kv := strings.SplitN(a, "=", 2)
+		switch {
+		case len(kv) == 2 && kv[0] == "span":
+			n, err := strconv.Atoi(kv[1])
+			if err != nil || n < 1 {
+				return nil, errors.New("-zip span must be a positive number of MiB: " + kv[1])
+			}
+			span = n
+		case len(kv) == 2 && kv[0] == "cache":
+			n, err := strconv.Atoi(kv[1])
+			if err != nil || n < 1 {
+				return nil, errors.New("-zip cache must be a positive number of MiB: " + kv[1])
+			}
+			cache = n
+		case len(kv) == 2 && kv[0] == "index":
+			if err := os.MkdirAll(kv[1], 0700); err != nil {
+				return nil, err
+			}
+			indexDir = kv[1]
+		default:
+			return nil, errors.New("Not a recognized -zip argument: " + a)
+		}
+	}
+	return newZipFS(args[0], int64(span)<<20, int64(cache)<<20, indexDir)
+}
+
+func newZipFS(path string, span, cache int64, indexDir string) (*zipFS, error) {
+	if abs, err := filepath.Abs(path); err == nil {
+		path = abs
+	}
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	fi, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	dir, err := openZipDir(f, fi.Size())
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+
+	z := &zipFS{path: path,
+		file:     f,
+		archive:  fi,
+		indexDir: indexDir,
+		dir:      dir,
+		entries:  make(map[uint32]*zipEntry)}
+	z.init(bytes.NewReader(dir.data), span, cache)
+	return z, nil
+}
+
+//info makes the os.FileInfo of record i.
+func (z *zipFS) info(i int) os.FileInfo {
+	r := &z.dir.recs[i]
+	if r.hdr == noHeader {
+		return &zipInfo{z.dir.baseName(r), 0, os.ModeDir | 0555, z.archive.ModTime()}
+	}
+	h := z.dir.header(r)
+	if h.mode.IsDir() {
+		h.size = 0
+	}
+	return &zipInfo{z.dir.baseName(r), h.size, h.mode, h.mtime}
+}
+
+//entry returns what's needed to read the file at path.
+func (z *zipFS) entry(path string) (*zipEntry, error) {
+	i := z.dir.find(path[1:])
+	if i < 0 {
+		return nil, os.ErrNotExist
+	}
+	r := &z.dir.recs[i]
+	if r.hdr == noHeader {
+		return nil, os.ErrInvalid
+	}
+
+	z.lock.Lock()
+	defer z.lock.Unlock()
+	if e, ok := z.entries[r.hdr]; ok {
+		return e, nil
+	}
+	h := z.dir.header(r)
+	if h.mode.IsDir() {
+		return nil, os.ErrInvalid
+	}
+	off, err := z.dir.dataOffset(h)
+	if err != nil {
+		return nil, err
+	}
+	e := &zipEntry{deflated: deflated{offset: off, csize: h.csize, size: h.size},
+		name:   path,
+		info:   &zipInfo{z.dir.baseName(r), h.size, h.mode, h.mtime},
+		method: h.method,
+		crc:    h.crc}
+	if e.method == zip.Deflate && z.indexDir != "" {
+		file := indexFile(z.indexDir, z.path, e.name)
+		e.index = newSeekIndex()
+		e.index.load(file, z.indexHeader(e))
+		e.atEnd = func() {
+			if err := e.index.save(file, z.indexHeader(e)); err != nil {
+				lg.error("saving zip index failed", "path", e.name, "err", err)
+			}
+		}
+	}
+	z.entries[r.hdr] = e
+	return e, nil
+}
+
+func (z *zipFS) indexHeader(e *zipEntry) indexHeader {
+	return indexHeader{Archive: z.archive.Size(),
+		Modified: z.archive.ModTime().UnixNano(),
+		CRC:      e.crc,
+		CSize:    e.csize,
+		Size:     e.size,
+		Span:     z.span}
+}
+
+//zipInfo is the os.FileInfo of an entry.
+type zipInfo struct {
+	name  string
+	size  int64
+	mode  os.FileMode
+	mtime time.Time
+}
+
+func (i *zipInfo) Name() string       { return i.name }
+func (i *zipInfo) Size() int64        { return i.size }
+func (i *zipInfo) Mode() os.FileMode  { return i.mode }
+func (i *zipInfo) ModTime() time.Time { return i.mtime }
+func (i *zipInfo) IsDir() bool        { return i.mode.IsDir() }
+func (i *zipInfo) Sys() interface{}   { return nil }
+
+func (z *zipFS) ReadFile(path string, b []byte, off int64) (int, error) {
+	z.mapping.RLock()
+	defer z.mapping.RUnlock()
+	if z.closed {
+		return 0, os.ErrClosed
+	}
+	e, err := z.entry(path)
+	if err != nil {
+		return 0, err
+	}
+	size := e.info.Size()
+	if off >= size {
+		return 0, io.EOF
+	}
+	want := len(b)
+	if int64(want) > size-off {
+		b = b[:size-off]
+	}
+
+	var n int
+	switch e.method {
+	case zip.Store:
+		n = copy(b, z.dir.data[e.offset+off:e.offset+e.csize])
+	case zip.Deflate:
+		n, err = z.inflate(&e.deflated, b, off)
+	default:
+		return 0, errZipMethod
+	}
+	if err == nil && n < want {
+		err = io.EOF
+	}
+	return n, err
+}
+
+func (z *zipFS) Stat(path string) (os.FileInfo, error) {
+	z.mapping.RLock()
+	defer z.mapping.RUnlock()
+	if path == "/" {
+		return &zipInfo{"/", 0, os.ModeDir | 0555, z.archive.ModTime()}, nil
+	}
+	if i := z.dir.find(path[1:]); i >= 0 {
+		return z.info(i), nil
+	}
+	return nil, os.ErrNotExist
+}
+
+func (z *zipFS) ReadDirectory(path string) ([]os.FileInfo, error) {
+	z.mapping.RLock()
+	defer z.mapping.RUnlock()
+	name := path[1:]
+	if name != "" {
+		i := z.dir.find(name)
+		if i < 0 {
+			return nil, os.ErrNotExist
+		}
+		if !z.info(i).IsDir() {
+			return nil, os.ErrInvalid
+		}
+	}
+	lo, hi := z.dir.children(name)
+	list := make([]os.FileInfo, 0, hi-lo)
+	for i := lo; i < hi; i++ {
+		list = append(list, z.info(i))
+	}
+	return list, nil
+}
+
+func (z *zipFS) GetAttribute(path string, attribute string) (interface{}, error) {
+	return nil, os.ErrInvalid
+}
+
+func (z *zipFS) WriteFile(path string, b []byte, off int64) (int, error) {
+	return 0, os.ErrPermission
+}
+
+func (z *zipFS) CreateFile(path string) error              { return os.ErrPermission }
+func (z *zipFS) CreateDirectory(path string) error         { return os.ErrPermission }
+func (z *zipFS) Remove(path string) error                  { return os.ErrPermission }
+func (z *zipFS) Move(oldpath string, newpath string) error { return os.ErrPermission }
+func (z *zipFS) SetAttribute(path string, attribute string, newvalue interface{}) error {
+	return os.ErrPermission
+}
+
+func (z *zipFS) String() string {
+	return "zip(" + z.path + ")"
+}
+
+func (z *zipFS) Close() error {
+	z.close(z.dir.close)
+	return z.file.Close()
+}
@@ -0,0 +1,174 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha1"
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"sync"
+)
+
+//seekPoint is somewhere a deflated entry can be decoded from.
+type seekPoint struct {
+	bit    int64  //in the compressed data
+	pos    int64  //in the uncompressed data
+	window []byte //up to 32KiB of output before pos
+}
+
+//seekIndex holds the seek points of one deflated entry: its start, and the
+//first block boundary past every span bytes of output after that. Any decode
+//that runs past the end of what's indexed extends it, so it fills in with
+//use rather than costing a pass over the whole entry up front. Once the
+//entry has been decoded to the end the index can be kept on disk.
+type seekIndex struct {
+	lock   sync.Mutex
+	points []seekPoint
+	upTo   int64 //output covered so far
+	done   bool  //covers the whole entry
+	saved  bool
+}
+
+func newSeekIndex() *seekIndex {
+	return &seekIndex{points: []seekPoint{{}}}
+}
+
+//find returns the last seek point at or before off.
+func (ix *seekIndex) find(off int64) seekPoint {
+	ix.lock.Lock()
+	defer ix.lock.Unlock()
+	lo, hi := 0, len(ix.points)
+	for hi-lo > 1 {
+		mid := (lo + hi) / 2
+		if ix.points[mid].pos <= off {
+			lo = mid
+		} else {
+			hi = mid
+		}
+	}
+	return ix.points[lo]
+}
+
+//mark is an inflater's onBlock hook. Inflaters only ever start from seek
+//points, so one that gets past upTo has seen every block on the way.
+func (ix *seekIndex) mark(z *inflater, span int64) {
+	ix.lock.Lock()
+	defer ix.lock.Unlock()
+	if z.pos <= ix.upTo {
+		return
+	}
+	if z.pos-ix.points[len(ix.points)-1].pos >= span {
+		ix.points = append(ix.points, seekPoint{z.bitPos(), z.pos, z.window()})
+	}
+	ix.upTo = z.pos
+}
+
+func (ix *seekIndex) finish(size int64) {
+	ix.lock.Lock()
+	if ix.upTo < size {
+		ix.upTo = size
+	}
+	ix.done = true
+	ix.lock.Unlock()
+}
+
+//indexHeader is what a saved index has to match to be used: the archive,
+//the entry and the span it was built with.
+type indexHeader struct {
+	Magic    [8]byte
+	Archive  int64 //size
+	Modified int64
+	CRC      uint32
+	CSize    int64
+	Size     int64
+	Span     int64
+	Points   uint32
+}
+
+var indexMagic = [8]byte{'u', 'n', 'f', 's', 'z', 'i', 'x', '1'}
+
+//indexFile names the saved index for entry name of the archive at path.
+func indexFile(dir, path, name string) string {
+	h := sha1.Sum([]byte(path + "\x00" + name))
+	return filepath.Join(dir, hex.EncodeToString(h[:])+".idx")
+}
+
+//load reads a saved index, if there's one matching want.
+func (ix *seekIndex) load(file string, want indexHeader) error {
+	f, err := os.Open(file)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	r := bufio.NewReader(f)
+
+	var h indexHeader
+	if err := binary.Read(r, binary.LittleEndian, &h); err != nil {
+		return err
+	}
+	want.Magic, want.Points = indexMagic, h.Points
+	if h != want {
+		return errors.New("stale zip index " + file)
+	}
+	//points sit at least a span apart from 0, so a count past that is corrupt
+	if h.Span <= 0 || int64(h.Points) > h.Size/h.Span+1 {
+		return errors.New("bad zip index " + file)
+	}
+	points := make([]seekPoint, h.Points)
+	for i := range points {
+		var p struct{ Bit, Pos, Window int64 }
+		if err := binary.Read(r, binary.LittleEndian, &p); err != nil {
+			return err
+		}
+		if p.Window < 0 || p.Window > inflateWindow || p.Pos < 0 || p.Pos > h.Size ||
+			(i == 0) != (p.Pos == 0) {
+			return errors.New("bad zip index " + file)
+		}
+		points[i] = seekPoint{p.Bit, p.Pos, make([]byte, p.Window)}
+		if _, err := io.ReadFull(r, points[i].window); err != nil {
+			return err
+		}
+	}
+
+	ix.lock.Lock()
+	ix.points, ix.upTo, ix.done, ix.saved = points, h.Size, true, true
+	ix.lock.Unlock()
+	return nil
+}
+
+//save writes a complete index out for next time.
+func (ix *seekIndex) save(file string, h indexHeader) error {
+	ix.lock.Lock()
+	defer ix.lock.Unlock()
+	if !ix.done || ix.saved {
+		return nil
+	}
+	ix.saved = true
+
+	tmp := file + ".new"
+	f, err := os.OpenFile(tmp, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+	w := bufio.NewWriter(f)
+	h.Magic, h.Points = indexMagic, uint32(len(ix.points))
+	binary.Write(w, binary.LittleEndian, &h)
+	for _, p := range ix.points {
+		binary.Write(w, binary.LittleEndian, &struct{ Bit, Pos, Window int64 }{p.bit, p.pos, int64(len(p.window))})
+		w.Write(p.window)
+	}
+	err = w.Flush()
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(tmp, file)
+	}
+	if err != nil {
+		os.Remove(tmp)
+	}
+	return err
+}